@@ -28,6 +28,7 @@ extern "C" {
 #include "export_wig.h"
 #include "nucleotide_alignment_frequencies.h"
 #include "filter_hisat2.h"
+#include "bam_cache.h"
 
 static const R_CallMethodDef callMethods[] = {
     /* split_sam_chr.c */
@@ -45,13 +46,25 @@ static const R_CallMethodDef callMethods[] = {
     /* remove_unmapped_from_sam.c */
     {"removeUnmappedFromSamAndConvertToBam", (DL_FUNC) &remove_unmapped_from_sam_and_convert_to_bam, 2},
     /* count_alignments.c */
-    {"countAlignmentsNonAllelic", (DL_FUNC) &count_alignments_non_allelic, 14},
-    {"countAlignmentsAllelic", (DL_FUNC) &count_alignments_allelic, 14},
+    {"countAlignmentsNonAllelic", (DL_FUNC) &count_alignments_non_allelic, 15},
+    {"countAlignmentsAllelic", (DL_FUNC) &count_alignments_allelic, 15},
+    {"countAlignmentsNonAllelicSweep", (DL_FUNC) &count_alignments_non_allelic_sweep, 15},
+    {"countAlignmentsStranded", (DL_FUNC) &count_alignments_stranded, 14},
+    {"countAlignmentsParameterSweep", (DL_FUNC) &count_alignments_parameter_sweep, 15},
+    {"countAlignmentsMultiple", (DL_FUNC) &count_alignments_multiple, 18},
+    {"countAlignmentsByGene", (DL_FUNC) &count_alignments_by_gene, 19},
+    {"countAlignmentsMultipleStranded", (DL_FUNC) &count_alignments_multiple_stranded, 17},
+    {"countAlignmentsBins", (DL_FUNC) &count_alignments_bins, 11},
+    {"countSidecarCreate", (DL_FUNC) &count_sidecar_create, 9},
     /* count_junctions.cpp */
-    {"countJunctions", (DL_FUNC) &count_junctions, 8},
+    {"countJunctions", (DL_FUNC) &count_junctions, 9},
+    {"countJunctionsMultiple", (DL_FUNC) &count_junctions_multiple, 6},
+    {"countJunctionsAnnotated", (DL_FUNC) &count_junctions_annotated, 13},
     /* profile_alignments.c */
-    {"profileAlignmentsNonAllelic", (DL_FUNC) &profile_alignments_non_allelic, 23},
-    {"profileAlignmentsAllelic", (DL_FUNC) &profile_alignments_allelic, 23},
+    {"profileAlignmentsNonAllelic", (DL_FUNC) &profile_alignments_non_allelic, 26},
+    {"profileAlignmentsAggregate", (DL_FUNC) &profile_alignments_aggregate, 25},
+    {"profileCoverage", (DL_FUNC) &profile_coverage, 9},
+    {"profileAlignmentsAllelic", (DL_FUNC) &profile_alignments_allelic, 25},
     /* count_alignments_subregions.c */
     // {"countAlignmentsSubregions", (DL_FUNC) &count_alignments_subregions, 10},
     /* quantify_methylation.cpp */
@@ -65,6 +78,14 @@ static const R_CallMethodDef callMethods[] = {
     {"nucleotideAlignmentFrequencies", (DL_FUNC) &nucleotide_alignment_frequencies, 6},
     /* filter_hisat2.c */
     {"filterHisat2", (DL_FUNC) &filter_hisat2, 3},
+    /* bam_cache.c */
+    {"bamCacheOpen", (DL_FUNC) &bam_cache_open, 1},
+    {"bamCacheEvict", (DL_FUNC) &bam_cache_evict, 1},
+    {"bamCacheList", (DL_FUNC) &bam_cache_list, 0},
+    {"bamCacheLimit", (DL_FUNC) &bam_cache_limit, 1},
+    /* utilities.c */
+    {"htsPoolSize", (DL_FUNC) &hts_pool_size, 0},
+    {"positionHashLimit", (DL_FUNC) &position_hash_limit, 1},
     {NULL, NULL, 0}
 };
 
@@ -77,7 +98,12 @@ void R_init_QuasR(DllInfo *info)
     R_forceSymbols(info, (Rboolean)TRUE);
 }
 
-void R_unload_QuasR(DllInfo *info){}
+void R_unload_QuasR(DllInfo *info)
+{
+    // close cached bam files before destroying the thread pool they use
+    _bam_cache_evict(NULL);
+    _hts_pool_destroy();
+}
 
 #ifdef __cplusplus
 }  /*    extern "C"   */
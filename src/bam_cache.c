@@ -0,0 +1,411 @@
+/*!
+  @header
+
+  Session-level cache of bam file handles and indices, keyed by the file name and
+  the modification times and sizes of the bam file and its index. Entry points acquire an entry instead of opening
+  the bam file and loading its index, and release it when done. Unused entries are
+  kept until they are evicted explicitly or the cache exceeds its limit (least
+  recently used entries first). Entries pinned by R external pointers or acquired
+  by a running call are never freed, only removed from the cache.
+
+  All functions except the .Call entry points are thread-safe; the .Call entry
+  points must be called from the R main thread.
+ */
+
+#include "bam_cache.h"
+#include "utilities.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static bamCacheEntry *cacheHead = NULL;           // cached entries
+static unsigned long cacheClock = 0;              // incremented at each acquisition
+static int cacheLimit = BAM_CACHE_DEFAULT_LIMIT;  // maximal number of unused cached entries
+
+
+/*! @function
+  @abstract  free an entry that is no longer used and no longer cached
+  @param     entry   the cache entry
+ */
+static void _bam_cache_free(bamCacheEntry *entry){
+    if(entry->fin != 0)
+        samclose(entry->fin);
+    if(entry->idx != 0)
+        bam_index_destroy(entry->idx);
+    free(entry->path);
+    free(entry);
+}
+
+
+/*! @function
+  @abstract  remove an entry from the cache and free it if it is not used (caller holds the lock)
+  @param     entry   the cache entry
+  @param     prev    pointer to the link to entry in the cache list
+ */
+static void _bam_cache_unlink(bamCacheEntry *entry, bamCacheEntry **prev){
+    *prev = entry->next;
+    entry->next = NULL;
+    entry->cached = 0;
+    if(entry->refs == 0)
+        _bam_cache_free(entry);
+}
+
+
+/*! @function
+  @abstract  evict least recently used unused entries until at most cacheLimit remain (caller holds the lock)
+ */
+static void _bam_cache_shrink(void){
+    bamCacheEntry *e, **prev, **oldest;
+    int unused;
+
+    while(1){
+        unused = 0;
+        oldest = NULL;
+        for(prev = &cacheHead; (e = *prev) != NULL; prev = &e->next)
+            if(e->refs == 0){
+                unused++;
+                if(oldest == NULL || e->lastUse < (*oldest)->lastUse)
+                    oldest = prev;
+            }
+        if(unused <= cacheLimit || oldest == NULL)
+            break;
+        _bam_cache_unlink(*oldest, oldest);
+    }
+}
+
+
+/*! @function
+  @abstract  get the modification time and size of the bam index file of a bamfile, looked up like
+             bam_index_load() does ("<bamfile>.bai", or "<bamfile without .bam>.bai")
+  @param     filename   name of the bamfile
+  @param     mtime      returns the modification time (0 if no index file was found)
+  @param     size       returns the size (-1 if no index file was found)
+  @return    0 if successful, -1 if memory could not be allocated
+ */
+static int _bam_index_stat(const char *filename, time_t *mtime, long long *size){
+    size_t len = strlen(filename);
+    char *fn = (char*) malloc(len + 5);
+    struct stat st;
+    int found;
+
+    *mtime = 0;
+    *size = -1;
+    if(fn == NULL)
+        return -1;
+    strcpy(fn, filename);
+    strcat(fn, ".bai");
+    found = (stat(fn, &st) == 0);
+    if(!found && len > 4 && strcmp(filename + len - 4, ".bam") == 0){
+        strcpy(fn + len - 4, ".bai");
+        found = (stat(fn, &st) == 0);
+    }
+    if(found){
+        *mtime = st.st_mtime;
+        *size = (long long)st.st_size;
+    }
+    free(fn);
+
+    return 0;
+}
+
+
+/*! @function
+  @abstract  get the cache entry of a bamfile, opening the file and loading its index if it is not cached
+             or if the file or its index has changed since it was cached; the entry has to be released using
+             _bam_cache_release(). Does not call the R API and can be used from worker threads.
+  @param     filename   name of the bamfile
+  @param     status     returns BAM_CACHE_OK, BAM_CACHE_OPEN_FAILED, BAM_CACHE_NO_HEADER or BAM_CACHE_NO_INDEX
+  @return    the cache entry, or NULL if status != BAM_CACHE_OK
+ */
+bamCacheEntry * _bam_cache_acquire(const char *filename, int *status){
+    bamCacheEntry *e = NULL, **prev;
+    struct stat st;
+    time_t idxMtime;
+    long long idxSize;
+
+    // create the BGZF thread pool before taking the lock (drops the cache in forked child processes)
+    _hts_pool_init();
+
+    *status = BAM_CACHE_OK;
+    if(stat(filename, &st) != 0 || _bam_index_stat(filename, &idxMtime, &idxSize) != 0){
+        *status = BAM_CACHE_OPEN_FAILED;
+        return NULL;
+    }
+
+#ifdef _OPENMP
+#pragma omp critical(bam_cache)
+#endif
+    {
+        // look up the file, evict the entry if the file or its index has changed
+        for(prev = &cacheHead; (e = *prev) != NULL; prev = &e->next)
+            if(strcmp(e->path, filename) == 0)
+                break;
+        if(e != NULL && (e->mtime != st.st_mtime || e->size != (long long)st.st_size ||
+                         e->idxMtime != idxMtime || e->idxSize != idxSize)){
+            _bam_cache_unlink(e, prev);
+            e = NULL;
+        }
+
+        // open bam file and load index if not cached
+        if(e == NULL){
+            e = (bamCacheEntry*) calloc(1, sizeof(bamCacheEntry));
+            if(e == NULL || (e->path = (char*) malloc(strlen(filename) + 1)) == NULL){
+                *status = BAM_CACHE_OPEN_FAILED;
+                free(e);
+                e = NULL;
+            } else {
+                strcpy(e->path, filename);
+                e->mtime = st.st_mtime;
+                e->size = (long long)st.st_size;
+                e->idxMtime = idxMtime;
+                e->idxSize = idxSize;
+                e->fin = samopen(filename, "rb", NULL);
+                _bam_attach_pool(e->fin);
+                if(e->fin == 0)
+                    *status = BAM_CACHE_OPEN_FAILED;
+                else if(e->fin->header == 0 || e->fin->header->n_targets == 0)
+                    *status = BAM_CACHE_NO_HEADER;
+                else if((e->idx = bam_index_load(filename)) == 0)
+                    *status = BAM_CACHE_NO_INDEX;
+                if(*status != BAM_CACHE_OK){
+                    _bam_cache_free(e);
+                    e = NULL;
+                } else {
+                    e->cached = 1;
+                    e->next = cacheHead;
+                    cacheHead = e;
+                }
+            }
+        }
+
+        if(e != NULL){
+            e->refs++;
+            e->lastUse = ++cacheClock;
+            _bam_cache_shrink();
+        }
+    }
+
+    return e;
+}
+
+
+/*! @function
+  @abstract  raise the R error for a status returned by _bam_cache_acquire() (nothing for BAM_CACHE_OK).
+             Must be called from the R main thread.
+  @param     filename   name of the bamfile
+  @param     status     BAM_CACHE_OK, BAM_CACHE_OPEN_FAILED, BAM_CACHE_NO_HEADER or BAM_CACHE_NO_INDEX
+ */
+void _bam_cache_error(const char *filename, int status){
+    if(status == BAM_CACHE_OPEN_FAILED)
+        Rf_error("failed to open BAM file: '%s'", filename);
+    else if(status == BAM_CACHE_NO_HEADER)
+        Rf_error("BAM header missing or empty of file: '%s'", filename);
+    else if(status == BAM_CACHE_NO_INDEX)
+        Rf_error("failed to open BAM index file: '%s'", filename);
+}
+
+
+/*! @function
+  @abstract  get the cache entry of a bamfile like _bam_cache_acquire(), but raise an R error on failure.
+             Must be called from the R main thread.
+  @param     filename   name of the bamfile
+  @return    the cache entry
+ */
+bamCacheEntry * _bam_cache_tryopen(const char *filename){
+    int status;
+    bamCacheEntry *e = _bam_cache_acquire(filename, &status);
+
+    _bam_cache_error(filename, status);
+
+    return e;
+}
+
+
+/*! @function
+  @abstract  release a cache entry obtained by _bam_cache_acquire()
+  @param     entry   the cache entry (may be NULL)
+ */
+void _bam_cache_release(bamCacheEntry *entry){
+    if(entry == NULL)
+        return;
+#ifdef _OPENMP
+#pragma omp critical(bam_cache)
+#endif
+    {
+        entry->refs--;
+        if(entry->cached == 0 && entry->refs == 0)
+            _bam_cache_free(entry);
+        else
+            _bam_cache_shrink();
+    }
+}
+
+
+/*! @function
+  @abstract  remove a bamfile or all bamfiles from the cache; entries that are in use are freed when released
+  @param     filename   name of the bamfile, or NULL for all bamfiles
+  @return    number of evicted entries
+ */
+int _bam_cache_evict(const char *filename){
+    bamCacheEntry *e, **prev;
+    int n = 0;
+
+#ifdef _OPENMP
+#pragma omp critical(bam_cache)
+#endif
+    {
+        prev = &cacheHead;
+        while((e = *prev) != NULL){
+            if(filename == NULL || strcmp(e->path, filename) == 0){
+                _bam_cache_unlink(e, prev);
+                n++;
+            } else {
+                prev = &e->next;
+            }
+        }
+    }
+
+    return n;
+}
+
+
+/*! @function
+  @abstract  drop all entries inherited by a forked child process from its parent, whose file handles
+             use the BGZF threads of the parent (see _hts_pool_init). The handles are neither used nor
+             closed; entries that are in use keep only their index and are freed when released.
+ */
+void _bam_cache_detach(void){
+    bamCacheEntry *e;
+
+#ifdef _OPENMP
+#pragma omp critical(bam_cache)
+#endif
+    {
+        while((e = cacheHead) != NULL){
+            e->fin = 0;
+            _bam_cache_unlink(e, &cacheHead);
+        }
+    }
+}
+
+
+/*! @function
+  @abstract  finalizer of R external pointers to cache entries
+  @param     ptr   external pointer
+ */
+static void _bam_cache_finalizer(SEXP ptr){
+    bamCacheEntry *e = (bamCacheEntry*) R_ExternalPtrAddr(ptr);
+    if(e != NULL){
+        _bam_cache_release(e);
+        R_ClearExternalPtr(ptr);
+    }
+}
+
+
+/*! @function
+  @abstract  Open bamfiles and load their indices into the cache, and return external pointers that keep
+             the entries in the cache until they are garbage collected or evicted.
+  @param  bamfiles   Names of the bamfiles
+  @return            List of external pointers (tagged with the file names)
+ */
+SEXP bam_cache_open(SEXP bamfiles){
+    if(!Rf_isString(bamfiles))
+        Rf_error("'bamfiles' must be of type character");
+
+    int i, n = Rf_length(bamfiles);
+    SEXP res, ptr;
+    PROTECT(res = Rf_allocVector(VECSXP, n));
+    for(i = 0; i < n; i++){
+        bamCacheEntry *e = _bam_cache_tryopen(Rf_translateChar(STRING_ELT(bamfiles, i)));
+        PROTECT(ptr = R_MakeExternalPtr(e, Rf_ScalarString(STRING_ELT(bamfiles, i)), R_NilValue));
+        R_RegisterCFinalizerEx(ptr, _bam_cache_finalizer, TRUE);
+        SET_VECTOR_ELT(res, i, ptr);
+        UNPROTECT(1);
+    }
+    UNPROTECT(1);
+
+    return res;
+}
+
+
+/*! @function
+  @abstract  Evict bamfiles from the cache.
+  @param  bamfiles   Names of the bamfiles, or NULL to evict all bamfiles
+  @return            Number of evicted entries
+ */
+SEXP bam_cache_evict(SEXP bamfiles){
+    int i, n = 0;
+
+    if(Rf_isNull(bamfiles))
+        n = _bam_cache_evict(NULL);
+    else if(Rf_isString(bamfiles))
+        for(i = 0; i < Rf_length(bamfiles); i++)
+            n += _bam_cache_evict(Rf_translateChar(STRING_ELT(bamfiles, i)));
+    else
+        Rf_error("'bamfiles' must be of type character or NULL");
+
+    return Rf_ScalarInteger(n);
+}
+
+
+/*! @function
+  @abstract  List the cached bamfiles.
+  @return    List with elements 'path' (file names), 'mtime' (modification times in seconds since the epoch)
+             and 'inUse' (number of users)
+ */
+SEXP bam_cache_list(void){
+    bamCacheEntry *e;
+    int i, n = 0;
+    SEXP res, path, mtime, inUse, names;
+
+    for(e = cacheHead; e != NULL; e = e->next)
+        n++;
+    PROTECT(path = Rf_allocVector(STRSXP, n));
+    PROTECT(mtime = Rf_allocVector(REALSXP, n));
+    PROTECT(inUse = Rf_allocVector(INTSXP, n));
+    for(e = cacheHead, i = 0; e != NULL; e = e->next, i++){
+        SET_STRING_ELT(path, i, Rf_mkChar(e->path));
+        REAL(mtime)[i] = (double)e->mtime;
+        INTEGER(inUse)[i] = e->refs;
+    }
+
+    PROTECT(res = Rf_allocVector(VECSXP, 3));
+    PROTECT(names = Rf_allocVector(STRSXP, 3));
+    SET_VECTOR_ELT(res, 0, path);
+    SET_VECTOR_ELT(res, 1, mtime);
+    SET_VECTOR_ELT(res, 2, inUse);
+    SET_STRING_ELT(names, 0, Rf_mkChar("path"));
+    SET_STRING_ELT(names, 1, Rf_mkChar("mtime"));
+    SET_STRING_ELT(names, 2, Rf_mkChar("inUse"));
+    Rf_setAttrib(res, R_NamesSymbol, names);
+    UNPROTECT(5);
+
+    return res;
+}
+
+
+/*! @function
+  @abstract  Get and optionally set the maximal number of unused entries kept in the cache.
+  @param  limit   new limit (integer(1) >= 0, 0 disables caching of unused entries), or NULL
+  @return         previous limit
+ */
+SEXP bam_cache_limit(SEXP limit){
+    int old = cacheLimit;
+
+    if(!Rf_isNull(limit)){
+        if(!Rf_isInteger(limit) || Rf_length(limit) != 1 || INTEGER(limit)[0] == NA_INTEGER || INTEGER(limit)[0] < 0)
+            Rf_error("'limit' must be of type integer(1) and have a value greater or equal to zero");
+#ifdef _OPENMP
+#pragma omp critical(bam_cache)
+#endif
+        {
+            cacheLimit = INTEGER(limit)[0];
+            _bam_cache_shrink();
+        }
+    }
+
+    return Rf_ScalarInteger(old);
+}
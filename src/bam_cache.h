@@ -0,0 +1,64 @@
+#ifndef QUASR_BAM_CACHE_H
+#define QUASR_BAM_CACHE_H
+
+// include Boolean.h early, will define TRUE/FALSE enum prefent Rdefines.h from defining them as int constants
+#include <R_ext/Boolean.h>
+#include <Rinternals.h>
+#include <time.h>
+#include <samtools-1.7-compat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BAM_CACHE_OK 0            // bam file and index available
+#define BAM_CACHE_OPEN_FAILED 1   // bam file could not be opened
+#define BAM_CACHE_NO_HEADER 2     // bam header missing or empty
+#define BAM_CACHE_NO_INDEX 3      // bam index could not be loaded
+#define BAM_CACHE_DEFAULT_LIMIT 16 // default maximal number of unused entries kept in the cache
+
+/*! @typedef
+  @abstract Entry of the session-level cache of bam file handles and indices.
+  @field path     name of the bamfile
+  @field mtime    modification time of the bamfile when the entry was created
+  @field size     size of the bamfile when the entry was created
+  @field idxMtime modification time of the bam index file when the entry was created
+  @field idxSize  size of the bam index file when the entry was created (-1 if it was not found)
+  @field fin      open bam file handle (must only be used by one thread at a time)
+  @field idx      bam index (read-only, can be shared by threads)
+  @field refs     number of users (acquisitions and R external pointers)
+  @field cached   entry is still in the cache (0 after eviction; freed when refs drops to zero)
+  @field lastUse  value of the cache clock at the last acquisition (least recently used entries are evicted first)
+  @field next     next entry in the cache
+*/
+typedef struct bamCacheEntry {
+    char *path;
+    time_t mtime;
+    long long size;
+    time_t idxMtime;
+    long long idxSize;
+    samfile_t *fin;
+    bam_index_t *idx;
+    int refs;
+    int cached;
+    unsigned long lastUse;
+    struct bamCacheEntry *next;
+} bamCacheEntry;
+
+bamCacheEntry * _bam_cache_acquire(const char *filename, int *status);
+bamCacheEntry * _bam_cache_tryopen(const char *filename);
+void _bam_cache_error(const char *filename, int status);
+void _bam_cache_release(bamCacheEntry *entry);
+int _bam_cache_evict(const char *filename);
+void _bam_cache_detach(void);
+
+SEXP bam_cache_open(SEXP bamfiles);
+SEXP bam_cache_evict(SEXP bamfiles);
+SEXP bam_cache_list(void);
+SEXP bam_cache_limit(SEXP limit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,10 +10,17 @@
  */
 
 #include "count_alignments.h"
+#include "position_hash.h"
+#include "region_mask.h"
+#include <limits.h>
 #include <stdlib.h>
 
 #define SMART_SHIFT -1000000 // for half insert size shift towards the mate read
-#define NO_ISIZE_FILTER -1   // disabled insert size-based alignment filtering
+#define FRAGMENT_SHIFT -2000000 // count each paired-end fragment once at its midpoint
+#define SWEEP_MAX_GAP 16384  // maximal gap between fetch windows that are merged into the same sweep block
+#define REGION_CHUNK 64      // number of regions per dynamically scheduled work unit of the threaded loops
+#define XV_MISSING 1         // XV tag missing in an alignment (allelic counting)
+#define XV_INVALID 2         // invalid value of the XV tag in an alignment (allelic counting)
 
 /*! @typedef
   @abstract Structure to provid the data to the bam_fetch() functions.
@@ -22,17 +29,14 @@
   @field sumA         Current count of the fetch region (allelic Alternative)
   @field start        Start of the fetch region
   @field end          End of the fetch region
-  @field strand       Strand of the fetch regions
+  @field strand       Strand of the fetch regions ('+', '-' or '*')
   @field shift        Shift size of the reads
-  @field readBitMask  select first/last read from a multi-read experiment
-  @field skipSecondary  skip secondary alignments true(1) or false(0)
   @field selectReadPosition  weight of alignment on "s"tart or "e"nd
   @field allelic      allelic true(1) or false(0)
-  @field includeSpliced  count spliced alignments true(1) or false(0)
-  @field mapqMin      minimum mapping quality (MAPQ >= mapqMin)
-  @field mapqMax      maximum mapping quality (MAPQ <= mapqMax)
-  @field absIsizeMin  minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
-  @field absIsizeMax  maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
+  @field filter       compiled region-independent alignment filter (spliced, MAPQ, ISIZE, read and secondary flags)
+  @field dups         alignments of the current fetch region (duplicate removal, see _dedup_pass), or NULL
+  @field xvError      first XV tag error (0, XV_MISSING or XV_INVALID), reported after counting
+  @field xvValue      invalid XV tag value (if xvError == XV_INVALID)
 */
 typedef struct {
     int sumU;
@@ -40,33 +44,35 @@ typedef struct {
     int sumA;
     int start;
     int end;
-    const char * strand;
+    char strand;
     int shift;
-    int readBitMask;
-    int skipSecondary;
     char selectReadPosition;
     int allelic;
-    int includeSpliced;
-    uint8_t mapqMin;
-    uint8_t mapqMax;
-    int32_t absIsizeMin;
-    int32_t absIsizeMax;
+    alignmentFilter filter;
+    positionHash *dups;
+    int xvError;
+    char xvValue;
 } regionInfoSums;
 
 
 /*! @function
   @abstract  increase allele specific counts.
+             Errors are recorded in rinfo->xvError instead of calling Rf_error(), which must not be
+             called from worker threads; they are reported by _report_xv_error() after counting.
   @param     hit     the alignment
   @param     rinfo   regionInfoSums
   @return    0 if successful
  */
 static int _sum_allelic(const bam1_t *hit, regionInfoSums *rinfo){
-    static uint8_t *xv_ptr = 0;
+    uint8_t *xv_ptr = 0;
 
     // get XV tag
     xv_ptr = bam_aux_get(hit,"XV");
-    if(xv_ptr == 0)
-        Rf_error("XV tag missing but needed for allele-specific counting");
+    if(xv_ptr == 0){
+        if(rinfo->xvError == 0)
+            rinfo->xvError = XV_MISSING;
+        return 1;
+    }
 
     // increase count
     switch(bam_aux2A(xv_ptr)){
@@ -80,7 +86,11 @@ static int _sum_allelic(const bam1_t *hit, regionInfoSums *rinfo){
         rinfo->sumA += 1;
         break;
     default:
-        Rf_error("'%c' is not a valid XV tag value; should be one of 'U','R' or 'A'", bam_aux2A(xv_ptr));
+        if(rinfo->xvError == 0){
+            rinfo->xvError = XV_INVALID;
+            rinfo->xvValue = bam_aux2A(xv_ptr);
+        }
+        return 1;
     }
 
     return 0;
@@ -88,44 +98,30 @@ static int _sum_allelic(const bam1_t *hit, regionInfoSums *rinfo){
 
 
 /*! @function
-  @abstract  callback for bam_fetch(); sums alignments if correct strand and shifted biological start/end position overlap fetch region
-  @param  hit   the alignment
-  @param  data  user provided data
-  @return       0 if successful
+  @abstract  raise an R error for an XV tag error recorded by _sum_allelic(); must be called from the master thread
+  @param     rinfo   regionInfoSums
  */
-static int _addValidHitToSums(const bam1_t *hit, void *data){
-    regionInfoSums *rinfo = (regionInfoSums*)data;
-    static double shift = 0;
-    static int pos = 0;
-
-    // skip alignment if rinfo->includeSpliced == false and alignmend is spliced
-    if(rinfo->includeSpliced == 0 && _isSpliced(hit) == 1)
-        return 0;
-
-    // skip alignment if mapping quality not in specified range
-    if(hit->core.qual < rinfo->mapqMin || hit->core.qual > rinfo->mapqMax)
-        return 0;
-
-    // skip alignment if insert size not in specified range
-    if((rinfo->absIsizeMin != NO_ISIZE_FILTER && llabs(hit->core.isize) < rinfo->absIsizeMin) ||
-       (rinfo->absIsizeMax != NO_ISIZE_FILTER && llabs(hit->core.isize) > rinfo->absIsizeMax))
-        return 0;
-
-    // skip alignment if read1 or read2 flag is set (=paired-end) and if wrong readBitMask
-    if((hit->core.flag & (BAM_FREAD1 + BAM_FREAD2)) && (hit->core.flag & rinfo->readBitMask) == 0)
-        return 0;
+static void _report_xv_error(const regionInfoSums *rinfo){
+    if(rinfo->xvError == XV_MISSING)
+        Rf_error("XV tag missing but needed for allele-specific counting");
+    else if(rinfo->xvError == XV_INVALID)
+        Rf_error("'%c' is not a valid XV tag value; should be one of 'U','R' or 'A'", rinfo->xvValue);
+}
 
-    // skip alignment if secondary and skipSecondary==true
-    if((hit->core.flag & BAM_FSECONDARY) && rinfo->skipSecondary)
-	return 0;
 
-    // skip alignment if region is not * and the strand of alignment or region is not the same
-    if(strcmp(rinfo->strand, "*")
-       && (((hit->core.flag & BAM_FREVERSE) == 0) != (strcmp(rinfo->strand, "+") == 0)))
-        return 0;
+/*! @function
+  @abstract  calculate the shifted biological start/end position (anchor) of an alignment for a shift and anchor
+  @param  hit                 the alignment
+  @param  hitEnd              0-based exclusive end of the alignment (bam_calend)
+  @param  shiftSize           shift size of the reads (or SMART_SHIFT)
+  @param  selectReadPosition  alignment anchored at "s"tart or "e"nd
+  @return                     0-based anchor position
+ */
+static int _anchorPositionFor(const bam1_t *hit, int hitEnd, int shiftSize, char selectReadPosition){
+    double shift = 0;
 
     // set shift
-    if(rinfo->shift == SMART_SHIFT){
+    if(shiftSize == SMART_SHIFT){
         // the sign of isize needs to be examined to make sure that shift(x) == -shift(-x)
         // example: 13 -> 12/2 but also -13 -> -12/2
         if(hit->core.isize > 0)
@@ -135,20 +131,58 @@ static int _addValidHitToSums(const bam1_t *hit, void *data){
     }
     else if((hit->core.flag & BAM_FREVERSE) == 0)
         // alignment on plus-strand
-        shift = (double)rinfo->shift;
+        shift = (double)shiftSize;
     else
         // alignment on minus-strand
-        shift = -(double)rinfo->shift;
+        shift = -(double)shiftSize;
 
     // calculate position
-    if(((hit->core.flag & BAM_FREVERSE) == 0) == (rinfo->selectReadPosition == 's')) // XOR
+    if(((hit->core.flag & BAM_FREVERSE) == 0) == (selectReadPosition == 's')) // XOR
 	// plus-strand and startwithin OR minus-strand and endwithin
         // --> position on the left side of the read
-	pos = (int)((double)hit->core.pos + shift); // 0-based inclusive start
+	return (int)((double)hit->core.pos + shift); // 0-based inclusive start
     else
 	// plus-strand and endwithin OR minus-strand and startwithin
         // --> position on the right side of the read
-        pos = (int)((double)bam_calend(&hit->core, bam1_cigar(hit)) - 1 + shift); // 0-based exclusive end --> -1
+        return (int)((double)hitEnd - 1 + shift); // 0-based exclusive end --> -1
+}
+
+
+/*! @function
+  @abstract  calculate the shifted biological start/end position (anchor) of an alignment
+  @param  hit    the alignment
+  @param  rinfo  regionInfoSums with the shift and selectReadPosition parameters
+  @return        0-based anchor position
+ */
+static int _anchorPosition(const bam1_t *hit, const regionInfoSums *rinfo){
+    return _anchorPositionFor(hit, bam_calend(&hit->core, bam1_cigar(hit)), rinfo->shift, rinfo->selectReadPosition);
+}
+
+
+/*! @function
+  @abstract  callback for bam_fetch(); sums alignments if correct strand and shifted biological start/end position overlap fetch region
+  @param  hit   the alignment
+  @param  data  user provided data
+  @return       0 if successful
+ */
+static int _addValidHitToSums(const bam1_t *hit, void *data){
+    regionInfoSums *rinfo = (regionInfoSums*)data;
+    int pos = 0;
+
+    // skip alignment if it does not pass the region-independent filters
+    if(!_filter_pass(&rinfo->filter, hit))
+        return 0;
+
+    // skip duplicated alignments
+    if(!_dedup_pass(rinfo->dups, hit))
+        return 0;
+
+    // skip alignment if region is not * and the strand of alignment or region is not the same
+    if(!_strand_pass((alignmentStrand)rinfo->strand, hit))
+        return 0;
+
+    // calculate position
+    pos = _anchorPosition(hit, rinfo);
 
     // check if in region
     if(rinfo->start <= pos && pos < rinfo->end){
@@ -162,6 +196,625 @@ static int _addValidHitToSums(const bam1_t *hit, void *data){
 }
 
 
+/*! @typedef
+  @abstract Parameter sets (shift and selectReadPosition) that are counted together in a single sweep.
+  @field n                   number of parameter sets
+  @field shift               shift size of the reads for each parameter set (or SMART_SHIFT)
+  @field selectReadPosition  alignment anchored at "s"tart or "e"nd for each parameter set
+  @field fwidth              extension of the fetch windows on either side of the regions for each parameter set
+*/
+typedef struct {
+    int n;
+    const int *shift;
+    const char *selectReadPosition;
+    const int *fwidth;
+} parameterSets;
+
+
+/*! @typedef
+  @abstract Structure to provide the data to the bam_fetch() function of the sorted sweep engine.
+  @field rinfo        regionInfoSums with the alignment filter, shift and selectReadPosition parameters
+  @field start        start of the regions (0-based inclusive, unsorted)
+  @field end          end of the regions (0-based exclusive, unsorted)
+  @field strand       strand of the regions ('+', '-' or '*', unsorted)
+  @field order        region indices sorted by (tid, start)
+  @field next         position in order of the next region that is not yet active
+  @field last         position in order after the last region of the current fetch block
+  @field active       indices of the active regions (fetch window may overlap current alignment)
+  @field nactive      number of active regions
+  @field fwidth       extension of the fetch windows on either side of the regions (shift + broaden; the
+                      maximum over the parameter sets if params is not NULL)
+  @field params       parameter sets counted in the same sweep, or NULL to use the parameters of rinfo
+  @field nregions     number of regions (column length of count if params is not NULL)
+  @field count        alignment counts (unsorted, one per region; allelic Unknown if allelic; plus strand
+                      alignments if strand-resolved; regions x parameter sets if params is not NULL)
+  @field countMinus   minus strand alignment counts (strand-resolved counting), or NULL
+  @field countR       allelic Reference counts (NULL if non-allelic)
+  @field countA       allelic Alternative counts (NULL if non-allelic)
+  @field mates        mates of fragments that have already been counted (fragment counting, rinfo->shift ==
+                      FRAGMENT_SHIFT), or NULL
+  @field dups         alignments of the current block (duplicate removal, see _dedup_pass), or NULL
+  @field mask         masked intervals of the target of the current block (alignments with a masked position
+                      are skipped), or NULL
+  @field xvError      first XV tag error (0, XV_MISSING or XV_INVALID), reported after counting
+  @field xvValue      invalid XV tag value (if xvError == XV_INVALID)
+*/
+typedef struct {
+    const regionInfoSums *rinfo;
+    const int *start;
+    const int *end;
+    const char *strand;
+    const int *order;
+    int next;
+    int last;
+    int *active;
+    int nactive;
+    int fwidth;
+    const parameterSets *params;
+    int nregions;
+    int *count;
+    int *countMinus;
+    int *countR;
+    int *countA;
+    positionHash *mates;
+    positionHash *dups;
+    maskCursor *mask;
+    int xvError;
+    char xvValue;
+} regionSweep;
+
+
+/*! @function
+  @abstract  increase the allele specific count of a region in the sorted sweep engine (see _sum_allelic)
+  @param     hit     the alignment
+  @param     sweep   regionSweep
+  @param     r       index of the region
+  @return    0 if successful
+ */
+static int _sweep_sum_allelic(const bam1_t *hit, regionSweep *sweep, int r){
+    uint8_t *xv_ptr = 0;
+
+    // get XV tag
+    xv_ptr = bam_aux_get(hit,"XV");
+    if(xv_ptr == 0){
+        if(sweep->xvError == 0)
+            sweep->xvError = XV_MISSING;
+        return 1;
+    }
+
+    // increase count
+    switch(bam_aux2A(xv_ptr)){
+    case 'U':
+        sweep->count[r] += 1;
+        break;
+    case 'R':
+        sweep->countR[r] += 1;
+        break;
+    case 'A':
+        sweep->countA[r] += 1;
+        break;
+    default:
+        if(sweep->xvError == 0){
+            sweep->xvError = XV_INVALID;
+            sweep->xvValue = bam_aux2A(xv_ptr);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*! @function
+  @abstract  update the active regions of the sorted sweep engine for the next alignment
+  @param  sweep     regionSweep
+  @param  hitStart  0-based inclusive start of the alignment
+  @param  hitEnd    0-based exclusive end of the alignment
+ */
+static void _sweep_update_active(regionSweep *sweep, int hitStart, int hitEnd){
+    int i;
+
+    // retire regions with a fetch window that ends before the alignment (alignments arrive sorted by position)
+    for(i = 0; i < sweep->nactive; ){
+        if(sweep->end[sweep->active[i]] + sweep->fwidth <= hitStart)
+            sweep->active[i] = sweep->active[--(sweep->nactive)];
+        else
+            i++;
+    }
+
+    // activate regions with a fetch window that starts before the end of the alignment
+    while(sweep->next < sweep->last &&
+          sweep->start[sweep->order[sweep->next]] - sweep->fwidth < hitEnd)
+        sweep->active[(sweep->nactive)++] = sweep->order[(sweep->next)++];
+}
+
+
+/*! @function
+  @abstract  calculate the midpoint of the fragment of an alignment for fragment counting, so that each fragment is
+             counted once: the first mate of a pair in the sorted stream anchors the fragment at the midpoint of
+             its insert (as for SMART_SHIFT) and is remembered in the mate hash, and the second mate is skipped
+             if it finds its mate in the hash (otherwise the first mate did not pass the filters, and the second
+             mate anchors the fragment). Unpaired alignments and pairs on different targets are anchored at the
+             midpoint of the alignment.
+             With duplicate removal, duplicated fragments are recognized at their first mate, which stays in the
+             mate hash so that the second mate of a duplicate is skipped as well.
+             If the mate hash is full, the fragment would be counted again at its second mate: the callers check
+             the full flag of the hash and fail the call.
+  @param  hit     the alignment
+  @param  mates   mates of fragments that have already been counted
+  @param  dups    alignments of the current stream (duplicate removal, see _dedup_pass), or NULL
+  @param  pos     returns the 0-based midpoint of the fragment
+  @param  plus    returns the strand of the fragment (the strand of the first read) true(1) if plus
+  @return         1 if the fragment should be counted, 0 if it has already been counted
+ */
+static int _fragment_anchor(const bam1_t *hit, positionHash *mates, positionHash *dups, int *pos, int *plus){
+    const bam1_core_t *c = &hit->core;
+    int hitEnd = (int)bam_calend(c, bam1_cigar(hit));
+    uint64_t key;
+
+    *plus = (((c->flag & BAM_FREVERSE) == 0) != ((c->flag & BAM_FREAD2) != 0));
+
+    // unpaired alignment: anchor at the midpoint of the alignment
+    if((c->flag & BAM_FPAIRED) == 0 || (c->flag & BAM_FMUNMAP) != 0 || c->mtid != c->tid || c->isize == 0){
+        *pos = (int)c->pos + (hitEnd - (int)c->pos - 1) / 2;
+        return _dedup_pass(dups, hit);
+    }
+
+    // skip the second mate of a fragment that has been counted at its first mate; remember the first mate
+    // until the stream passes its mate (if the hash is full, its full flag fails the call after the stream)
+    key = _position_hash_key(bam1_qname(hit), (c->pos < c->mpos ? (int)c->pos : (int)c->mpos),
+                             (c->pos < c->mpos ? (int)c->mpos : (int)c->pos));
+    if(c->mpos < c->pos){
+        if(_position_hash_remove(mates, key) == 1)
+            return 0;
+    } else if(_position_hash_insert(mates, key, (int)c->mpos, (int)c->pos) == 0){
+        // second of two mates at the same position
+        _position_hash_remove(mates, key);
+        return 0;
+    } else if(!_dedup_pass(dups, hit)){
+        // duplicated fragment
+        return 0;
+    }
+
+    // anchor at the midpoint of the insert (see _anchorPositionFor for SMART_SHIFT)
+    if(c->isize > 0)
+        *pos = (int)((double)c->pos + ((double)c->isize - 1) / 2);
+    else
+        *pos = (int)((double)hitEnd - 1 + ((double)c->isize + 1) / 2);
+
+    return 1;
+}
+
+
+/*! @function
+  @abstract  callback for bam_fetch() of the sorted sweep engine; adds an alignment to all active regions
+             that contain its shifted biological start/end position
+  @param  hit   the alignment
+  @param  data  user provided data (regionSweep)
+  @return       0 if successful
+ */
+static int _addValidHitToActiveRegions(const bam1_t *hit, void *data){
+    regionSweep *sweep = (regionSweep*)data;
+    int i, r, pos, hitEnd, hitPlus;
+
+    // skip alignment if it does not pass the region-independent filters
+    if(!_filter_pass(&sweep->rinfo->filter, hit))
+        return 0;
+
+    // alignment span as used by bam_fetch() for overlap tests
+    hitEnd = (int)bam_endpos(hit);
+    _sweep_update_active(sweep, (int)hit->core.pos, hitEnd);
+
+    // add alignment (or its fragment) to active regions that contain its position
+    if(sweep->mates != NULL){
+        if(!_fragment_anchor(hit, sweep->mates, sweep->dups, &pos, &hitPlus))
+            return 0;
+    } else {
+        if(!_dedup_pass(sweep->dups, hit))
+            return 0;
+        pos = _anchorPosition(hit, sweep->rinfo);
+        hitPlus = ((hit->core.flag & BAM_FREVERSE) == 0);
+    }
+    if(sweep->mask != NULL && _mask_cursor_test(sweep->mask, pos))
+        return 0;
+    if(sweep->countMinus != NULL){
+        // strand-resolved: count alignments of either strand in their own vector
+        int *count = (hitPlus ? sweep->count : sweep->countMinus);
+        for(i = 0; i < sweep->nactive; i++){
+            r = sweep->active[i];
+            if(sweep->start[r] <= pos && pos < sweep->end[r] && sweep->start[r] - sweep->fwidth < hitEnd)
+                count[r] += 1;
+        }
+        return 0;
+    }
+    for(i = 0; i < sweep->nactive; i++){
+        r = sweep->active[i];
+        if(sweep->start[r] <= pos && pos < sweep->end[r] &&
+           sweep->start[r] - sweep->fwidth < hitEnd &&                       // alignment overlaps fetch window
+           (sweep->strand[r] == '*' || hitPlus == (sweep->strand[r] == '+'))){
+            if(sweep->countR == NULL)
+                sweep->count[r] += 1;
+            else
+                _sweep_sum_allelic(hit, sweep, r);
+        }
+    }
+
+    return 0;
+}
+
+
+/*! @function
+  @abstract  callback for bam_fetch() of the sorted sweep engine with several parameter sets; decodes an alignment
+             once and adds it to the count of each parameter set and active region that contains the shifted
+             biological start/end position of the parameter set. The alignment must overlap the fetch window of
+             the region for the parameter set, so that the counts are identical to separate sweeps.
+  @param  hit   the alignment
+  @param  data  user provided data (regionSweep)
+  @return       0 if successful
+ */
+static int _addValidHitToParameterSets(const bam1_t *hit, void *data){
+    regionSweep *sweep = (regionSweep*)data;
+    const parameterSets *ps = sweep->params;
+    int i, k, r, pos, hitStart, hitEnd, hitPlus, calend;
+
+    // skip alignment if it does not pass the region-independent filters or is a duplicate
+    if(!_filter_pass(&sweep->rinfo->filter, hit) || !_dedup_pass(sweep->dups, hit))
+        return 0;
+
+    // alignment span as used by bam_fetch() for overlap tests
+    hitStart = (int)hit->core.pos;
+    hitEnd = (int)bam_endpos(hit);
+    _sweep_update_active(sweep, hitStart, hitEnd);
+
+    // add alignment to active regions of the correct strand that contain its position
+    hitPlus = ((hit->core.flag & BAM_FREVERSE) == 0);
+    calend = (int)bam_calend(&hit->core, bam1_cigar(hit));
+    for(k = 0; k < ps->n; k++){
+        int *count = sweep->count + (size_t)k * sweep->nregions;
+        int fw = ps->fwidth[k];
+        pos = _anchorPositionFor(hit, calend, ps->shift[k], ps->selectReadPosition[k]);
+        for(i = 0; i < sweep->nactive; i++){
+            r = sweep->active[i];
+            if(sweep->start[r] <= pos && pos < sweep->end[r] &&
+               sweep->start[r] - fw < hitEnd && hitStart < sweep->end[r] + fw &&
+               (sweep->strand[r] == '*' || hitPlus == (sweep->strand[r] == '+')))
+                count[r] += 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*! @typedef
+  @abstract Structure used to sort regions by (tid, start).
+*/
+typedef struct {
+    int tid;
+    int start;
+    int idx;
+} regionKey;
+
+static int _compareRegionKeys(const void *a, const void *b){
+    const regionKey *ra = (const regionKey*)a, *rb = (const regionKey*)b;
+    if(ra->tid != rb->tid)
+        return (ra->tid < rb->tid) ? -1 : 1;
+    if(ra->start != rb->start)
+        return (ra->start < rb->start) ? -1 : 1;
+    return (ra->idx < rb->idx) ? -1 : (ra->idx > rb->idx);
+}
+
+
+/*! @typedef
+  @abstract Structure describing a block of neighboring regions that is processed by a single multi-region iterator.
+  @field tid          target identifier of the block
+  @field start        start of the merged fetch windows (0-based inclusive)
+  @field end          end of the merged fetch windows (0-based exclusive)
+  @field first        position in the sorted region order of the first region of the block
+  @field last         position in the sorted region order after the last region of the block
+*/
+typedef struct {
+    int tid;
+    int start;
+    int end;
+    int first;
+    int last;
+} sweepBlock;
+
+
+/*! @function
+  @abstract  group sorted regions into blocks of neighboring fetch windows on the same target
+             (gaps up to SWEEP_MAX_GAP) for the sorted sweep engine
+  @param  tid     target identifier of the regions (unsorted)
+  @param  start   start of the regions (unsorted)
+  @param  end     end of the regions (unsorted)
+  @param  order   region indices sorted by (tid, start)
+  @param  n       number of regions
+  @param  fwidth  extension of the fetch windows on either side of the regions
+  @param  blocks  returns the blocks (at most n)
+  @return         number of blocks
+ */
+static int _build_sweep_blocks(const int *tid, const int *start, const int *end, const int *order, int n,
+                               int fwidth, sweepBlock *blocks){
+    int i, b, nblocks = 0;
+
+    for(b = 0; b < n; nblocks++){
+        // extend block while the next fetch window is on the same target and close enough
+        blocks[nblocks].tid = tid[order[b]];
+        blocks[nblocks].start = start[order[b]] - fwidth;
+        blocks[nblocks].end = end[order[b]] + fwidth;
+        for(i = b + 1; i < n && tid[order[i]] == blocks[nblocks].tid &&
+                start[order[i]] - fwidth <= blocks[nblocks].end + SWEEP_MAX_GAP; i++)
+            if(end[order[i]] + fwidth > blocks[nblocks].end)
+                blocks[nblocks].end = end[order[i]] + fwidth;
+        blocks[nblocks].first = b;
+        blocks[nblocks].last = i;
+        b = i;
+    }
+
+    return nblocks;
+}
+
+
+/*! @function
+  @abstract  get the fetch windows of the regions of a block for _bam_fetch_regions(); the windows are
+             coalesced there, so that gaps between them are skipped and shared BGZF blocks are read once
+  @param  block   the block
+  @param  tid     target identifier of the block in the bam file
+  @param  start   start of the regions (unsorted)
+  @param  end     end of the regions (unsorted)
+  @param  order   region indices sorted by (tid, start)
+  @param  fwidth  extension of the fetch windows on either side of the regions
+  @param  reg     returns the fetch windows (at least block->last - block->first elements)
+  @return         number of fetch windows
+ */
+static int _block_fetch_regions(const sweepBlock *block, int tid, const int *start, const int *end, const int *order,
+                                int fwidth, bamRegion *reg){
+    int i, n = 0;
+
+    for(i = block->first; i < block->last; i++, n++){
+        reg[n].tid = tid;
+        reg[n].beg = start[order[i]] - fwidth; // 0-based inclusive start
+        reg[n].end = end[order[i]] + fwidth;   // 0-based exclusive end
+    }
+
+    return n;
+}
+
+
+/*! @typedef
+  @abstract Node of an implicit augmented interval tree (intervals sorted by start, see _itv_index).
+  @field start        start of the interval (0-based inclusive)
+  @field end          end of the interval (0-based exclusive)
+  @field max          maximal end of the intervals in the subtree of the node
+  @field id           index of the region
+*/
+typedef struct {
+    int start;
+    int end;
+    int max;
+    int id;
+} itvNode;
+
+
+/*! @function
+  @abstract  index an array of intervals sorted by start as an implicit augmented interval tree:
+             node i is at level k, the number of trailing 1-bits of i, and has the children
+             i - 2^(k-1) and i + 2^(k-1). The maximal end of each subtree is stored in the node.
+  @param  a   intervals sorted by start
+  @param  n   number of intervals
+  @return     level of the root node (-1 if n == 0)
+ */
+static int _itv_index(itvNode *a, int n){
+    int i, k, x, el, er, e, last_i = 0, last = 0;
+
+    if(n == 0)
+        return -1;
+    // leaves (level 0)
+    for(i = 0; i < n; i += 2){
+        last_i = i;
+        last = a[i].max = a[i].end;
+    }
+    // inner nodes
+    for(k = 1; (1 << k) <= n; k++){
+        x = 1 << (k - 1);
+        for(i = (x << 1) - 1; i < n; i += x << 2){
+            el = a[i - x].max;
+            er = (i + x < n) ? a[i + x].max : last;
+            e = a[i].end;
+            if(el > e) e = el;
+            if(er > e) e = er;
+            a[i].max = e;
+        }
+        last_i = ((last_i >> k) & 1) ? last_i - x : last_i + x;
+        if(last_i < n && a[last_i].max > last)
+            last = a[last_i].max;
+    }
+
+    return k - 1;
+}
+
+
+/*! @function
+  @abstract  find the intervals of an implicit augmented interval tree that contain a position
+  @param  a         intervals indexed by _itv_index
+  @param  n         number of intervals
+  @param  maxLevel  level of the root node returned by _itv_index
+  @param  pos       0-based position
+  @param  hits      returns the positions in a of the intervals that contain pos (at least n elements)
+  @return           number of hits
+ */
+static int _itv_stab(const itvNode *a, int n, int maxLevel, int pos, int *hits){
+    struct { int x, k, w; } stack[64], z;
+    int i, i0, i1, y, t = 0, nhits = 0;
+
+    if(n == 0)
+        return 0;
+    stack[t].x = (1 << maxLevel) - 1;
+    stack[t].k = maxLevel;
+    stack[t++].w = 0;
+    while(t > 0){
+        z = stack[--t];
+        if(z.k <= 3){
+            // small subtree: linear scan
+            i0 = (z.x >> z.k) << z.k;
+            i1 = i0 + (1 << (z.k + 1)) - 1;
+            if(i1 > n)
+                i1 = n;
+            for(i = i0; i < i1 && a[i].start <= pos; i++)
+                if(pos < a[i].end)
+                    hits[nhits++] = i;
+        } else if(z.w == 0){
+            // revisit node after its left child
+            y = z.x - (1 << (z.k - 1));
+            stack[t].x = z.x;
+            stack[t].k = z.k;
+            stack[t++].w = 1;
+            if(y >= n || a[y].max > pos){
+                stack[t].x = y;
+                stack[t].k = z.k - 1;
+                stack[t++].w = 0;
+            }
+        } else if(z.x < n && a[z.x].start <= pos){
+            if(pos < a[z.x].end)
+                hits[nhits++] = z.x;
+            stack[t].x = z.x + (1 << (z.k - 1));
+            stack[t].k = z.k - 1;
+            stack[t++].w = 0;
+        }
+    }
+
+    return nhits;
+}
+
+
+/*! @typedef
+  @abstract Structure to provide the data to the bam_fetch() function of gene-level counting.
+  @field rinfo        regionInfoSums with the alignment filter, shift and selectReadPosition parameters
+  @field start        start of the regions (0-based inclusive, unsorted)
+  @field end          end of the regions (0-based exclusive, unsorted)
+  @field strand       strand of the regions ('+', '-' or '*', unsorted)
+  @field gene         gene of the regions (0-based, unsorted)
+  @field nodes        interval tree over the regions of the current fetch block
+  @field nnodes       number of regions in the current fetch block
+  @field maxLevel     level of the root node of the interval tree
+  @field fwidth       extension of the fetch windows on either side of the regions (shift + broaden)
+  @field hits         buffer for interval tree hits (at least nnodes elements)
+  @field lastHit      serial number of the last alignment counted for each gene
+  @field serial       serial number of the current alignment
+  @field count        alignment counts per gene (allelic Unknown if allelic; plus strand alignments if strand-resolved)
+  @field countMinus   minus strand alignment counts per gene (strand-resolved counting), or NULL
+  @field countR       allelic Reference counts per gene (NULL if non-allelic)
+  @field countA       allelic Alternative counts per gene (NULL if non-allelic)
+  @field dups         alignments of the current block (duplicate removal, see _dedup_pass), or NULL
+  @field mask         masked intervals of the target of the current block (alignments with a masked position
+                      are skipped), or NULL
+  @field xvError      first XV tag error (0, XV_MISSING or XV_INVALID), reported after counting
+  @field xvValue      invalid XV tag value (if xvError == XV_INVALID)
+*/
+typedef struct {
+    const regionInfoSums *rinfo;
+    const int *start;
+    const int *end;
+    const char *strand;
+    const int *gene;
+    const itvNode *nodes;
+    int nnodes;
+    int maxLevel;
+    int fwidth;
+    int *hits;
+    int *lastHit;
+    int serial;
+    int *count;
+    int *countMinus;
+    int *countR;
+    int *countA;
+    positionHash *dups;
+    maskCursor *mask;
+    int xvError;
+    char xvValue;
+} geneSweep;
+
+
+/*! @function
+  @abstract  callback for bam_fetch() of gene-level counting; adds an alignment once to each gene
+             with a region that contains its shifted biological start/end position
+  @param  hit   the alignment
+  @param  data  user provided data (geneSweep)
+  @return       0 if successful
+ */
+static int _addValidHitToGenes(const bam1_t *hit, void *data){
+    geneSweep *gs = (geneSweep*)data;
+    int i, r, g, nhits, pos, hitStart, hitEnd, hitPlus;
+    int *target = 0;
+    uint8_t *xv_ptr = 0;
+
+    // skip alignment if it does not pass the region-independent filters or is a duplicate
+    if(!_filter_pass(&gs->rinfo->filter, hit) || !_dedup_pass(gs->dups, hit))
+        return 0;
+
+    // find regions that contain the alignment position (unless it is masked)
+    pos = _anchorPosition(hit, gs->rinfo);
+    if(gs->mask != NULL && _mask_cursor_test(gs->mask, pos))
+        return 0;
+    nhits = _itv_stab(gs->nodes, gs->nnodes, gs->maxLevel, pos, gs->hits);
+    if(nhits == 0)
+        return 0;
+
+    hitStart = (int)hit->core.pos;
+    hitEnd = (int)bam_endpos(hit);
+    hitPlus = ((hit->core.flag & BAM_FREVERSE) == 0);
+    gs->serial++;
+    for(i = 0; i < nhits; i++){
+        r = gs->nodes[gs->hits[i]].id;
+        g = gs->gene[r];
+        if(gs->lastHit[g] == gs->serial ||                                            // gene already counted
+           gs->start[r] - gs->fwidth >= hitEnd || hitStart >= gs->end[r] + gs->fwidth || // alignment outside fetch window
+           (gs->strand[r] != '*' && hitPlus != (gs->strand[r] == '+')))
+            continue;
+        gs->lastHit[g] = gs->serial;
+
+        // select count vector
+        if(gs->countMinus != NULL){
+            target = (hitPlus ? gs->count : gs->countMinus);
+        } else if(gs->countR == NULL){
+            target = gs->count;
+        } else {
+            if(xv_ptr == 0 && (xv_ptr = bam_aux_get(hit, "XV")) == 0){
+                if(gs->xvError == 0)
+                    gs->xvError = XV_MISSING;
+                return 1;
+            }
+            switch(bam_aux2A(xv_ptr)){
+            case 'U':
+                target = gs->count;
+                break;
+            case 'R':
+                target = gs->countR;
+                break;
+            case 'A':
+                target = gs->countA;
+                break;
+            default:
+                if(gs->xvError == 0){
+                    gs->xvError = XV_INVALID;
+                    gs->xvValue = bam_aux2A(xv_ptr);
+                }
+                return 1;
+            }
+        }
+
+        // regions of a gene may be processed by several threads
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+        target[g]++;
+    }
+
+    return 0;
+}
+
+
 /*! @function
   @abstract  verify the parameters of the count_alignments_non_allelic and count_alignments_allelic function
   @param  bamfile        Name of the bamfile
@@ -170,7 +823,7 @@ static int _addValidHitToSums(const bam1_t *hit, void *data){
  */
 int _verify_parameters(SEXP bamfile, SEXP tid,  SEXP start, SEXP end, SEXP strand,
                       SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
-                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax){
+                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads){
     // check bamfile parameter
     if(!Rf_isString(bamfile) || Rf_length(bamfile) != 1)
         Rf_error("'bamfile' must be of type character(1)");
@@ -223,95 +876,265 @@ int _verify_parameters(SEXP bamfile, SEXP tid,  SEXP start, SEXP end, SEXP stran
     if(INTEGER(absIsizeMin)[0] != NO_ISIZE_FILTER && INTEGER(absIsizeMax)[0] != NO_ISIZE_FILTER && INTEGER(absIsizeMin)[0] > INTEGER(absIsizeMax)[0])
 	Rf_error("'absIsizeMin' must not be greater than 'absIsizeMax'");
 
+    // check nthreads parameter
+    if(!Rf_isInteger(nthreads) || Rf_length(nthreads) != 1 || INTEGER(nthreads)[0] < 1)
+        Rf_error("'nthreads' must be of type integer(1) and have a value greater than zero");
+
     return 0;
 }
 
 /*! @function
-  @abstract  Counts the alignments in regions, which fit the strand, overlap type and shift criteria.
-  @param  bamfile             Name of the bamfile
-  @param  tid                 target region identifier
-  @param  start               target region start
-  @param  end                 target region end
-  @param  strand              target region strand
+  @abstract  initialise the region-independent fields of a regionInfoSums from the (verified) parameters
+  @param  rinfo               regionInfoSums to initialise
   @param  selectReadPosition  alignment ancored at start/end
   @param  readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments
   @param  shift               shift size
-  @param  broaden             extend query region for bam_fetch to catch alignments with overlaps due to shifting
   @param  includeSpliced      also count spliced alignments
   @param  mapqMin             minimal mapping quality to count alignment (MAPQ >= mapqMin)
   @param  mapqMax             maximum mapping quality to count alignment (MAPQ <= mapqMax)
   @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
   @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
-  @return               Vector of the alignment counts
+  @param  allelic             allelic true(1) or false(0)
  */
-SEXP count_alignments_non_allelic(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand,
-                                  SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
-                                  SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax){
+static void _init_region_info(regionInfoSums *rinfo, SEXP selectReadPosition, SEXP readBitMask, SEXP shift,
+                              SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
+                              int allelic){
+    rinfo->sumU = 0;
+    rinfo->sumR = 0;
+    rinfo->sumA = 0;
+    rinfo->shift = INTEGER(shift)[0];
+    rinfo->selectReadPosition = Rf_translateChar(STRING_ELT(selectReadPosition, 0))[0];
+    rinfo->allelic = allelic;
+    _filter_init(&rinfo->filter, INTEGER(readBitMask)[0], INTEGER(mapqMin)[0], INTEGER(mapqMax)[0],
+                 INTEGER(absIsizeMin)[0], INTEGER(absIsizeMax)[0], Rf_asLogical(includeSpliced));
+    rinfo->dups = NULL;
+    rinfo->xvError = 0;
+    rinfo->xvValue = 0;
+}
 
-    // check parameters
-    _verify_parameters(bamfile, tid, start, end, strand, selectReadPosition, readBitMask, shift, broaden, includeSpliced,
-		       mapqMin, mapqMax, absIsizeMin, absIsizeMax);
-
-    // open bam file
-    samfile_t *fin = 0;
-    fin = samopen(Rf_translateChar(STRING_ELT(bamfile, 0)), "rb", NULL);
-    if (fin == 0)
-        Rf_error("failed to open BAM file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (fin->header == 0 || fin->header->n_targets == 0) {
-        samclose(fin);
-        Rf_error("BAM header missing or empty of file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    }
-    // open bam index
-    bam_index_t *idx = 0;
-    idx = bam_index_load(Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (idx == 0){
-        samclose(fin);
-        Rf_error("failed to open BAM index file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    }
 
-    // initialise regionInfoSums
-    regionInfoSums rinfo;
-    rinfo.readBitMask = (INTEGER(readBitMask)[0] & (BAM_FREAD1 + BAM_FREAD2));
-    rinfo.skipSecondary = ((INTEGER(readBitMask)[0] & BAM_FSECONDARY) ? 0 : 1);
-    rinfo.shift = INTEGER(shift)[0];
-    rinfo.selectReadPosition = Rf_translateChar(STRING_ELT(selectReadPosition, 0))[0];
-    rinfo.allelic = 0;
-    rinfo.includeSpliced = (Rf_asLogical(includeSpliced) ? 1 : 0);
-    rinfo.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    rinfo.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
-    rinfo.absIsizeMin = (uint32_t)(INTEGER(absIsizeMin)[0]);
-    rinfo.absIsizeMax = (uint32_t)(INTEGER(absIsizeMax)[0]);
+/*! @function
+  @abstract  translate the region strands to single characters, which can be used in worker threads
+  @param  strand  target region strand (character vector)
+  @return         array with one strand character per region (release with R_Free)
+ */
+static char *_translate_strands(SEXP strand){
+    int i, num_regions = Rf_length(strand);
+    char *strand_c = (char*) R_Calloc(num_regions, char);
+    for(i = 0; i < num_regions; i++)
+        strand_c[i] = Rf_translateChar(STRING_ELT(strand, i))[0];
+    return strand_c;
+}
 
-    // set shift for fetch to zero if smart shift
-    int shift_f = abs(INTEGER(shift)[0]);
-    if(INTEGER(shift)[0] == SMART_SHIFT)
-        shift_f = 0;
 
-    // select bam_fetch callback function
-    bam_fetch_f fetch_func = _addValidHitToSums;
+/*! @function
+  @abstract  open the count sidecar of a bamfile that matches the (verified) counting parameters, if there is one.
+             Sidecars store non-allelic anchor positions for fixed shifts only.
+  @param  bamfile             Name of the bamfile
+  @param  rinfo               regionInfoSums initialised by _init_region_info()
+  @param  readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments
+  @param  includeSpliced      also count spliced alignments
+  @param  mapqMin             minimal mapping quality to count alignment (MAPQ >= mapqMin)
+  @param  mapqMax             maximum mapping quality to count alignment (MAPQ <= mapqMax)
+  @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
+  @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
+  @return                     the open sidecar (close with _sidecar_close), or NULL
+ */
+static countSidecar *_open_count_sidecar(const char *bamfile, const regionInfoSums *rinfo, SEXP readBitMask,
+                                         SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax,
+                                         SEXP absIsizeMin, SEXP absIsizeMax){
+    sidecarKey key;
 
-    // loop over query regions
-    int num_regions = Rf_length(tid);
-    SEXP count;
-    PROTECT(count = allocVector(INTSXP, num_regions));
-    for(int i = 0; i < num_regions; i++){
-        // reset counter and setup region in rinfo
-        rinfo.sumU = 0;
-        rinfo.start = INTEGER(start)[i];
-        rinfo.end = INTEGER(end)[i];
-        rinfo.strand = Rf_translateChar(STRING_ELT(strand, i));
-        // process alignments that overlap region
-        bam_fetch(fin->x.bam, idx, INTEGER(tid)[i],
-                  INTEGER(start)[i]-shift_f-INTEGER(broaden)[0], // 0-based inclusive start
-                  INTEGER(end)[i]+shift_f+INTEGER(broaden)[0],   // 0-based exclusive end
-                  &rinfo, fetch_func);
-	// copy result to return values
-        INTEGER(count)[i] = rinfo.sumU;
+    if(rinfo->allelic || rinfo->shift == SMART_SHIFT || rinfo->shift == FRAGMENT_SHIFT)
+        return NULL;
+    _sidecar_key_init(&key, rinfo->shift, rinfo->selectReadPosition, INTEGER(readBitMask)[0],
+                      INTEGER(mapqMin)[0], INTEGER(mapqMax)[0], INTEGER(absIsizeMin)[0], INTEGER(absIsizeMax)[0],
+                      Rf_asLogical(includeSpliced));
+    return _sidecar_open(bamfile, &key);
+}
+
+
+/*! @function
+  @abstract  count the alignments in each region from a count sidecar (prefix sums over the anchor positions)
+  @param  sc          the count sidecar
+  @param  tid         target region identifier
+  @param  start       target region start
+  @param  end         target region end
+  @param  strand      target region strand
+  @param  count       counts (one per region; plus strand alignments if countMinus is not NULL)
+  @param  countMinus  minus strand alignment counts (strand-resolved counting), or NULL
+ */
+static void _count_alignments_from_sidecar(const countSidecar *sc, SEXP tid, SEXP start, SEXP end, SEXP strand,
+                                           int *count, int *countMinus){
+    int i, num_regions = Rf_length(tid);
+    const int *tid_c = INTEGER(tid), *start_c = INTEGER(start), *end_c = INTEGER(end);
+    char *strand_c = _translate_strands(strand);
+
+    for(i = 0; i < num_regions; i++){
+        if(countMinus == NULL)
+            count[i] = _sidecar_count(sc, tid_c[i], start_c[i], end_c[i], strand_c[i]);
+        else {
+            count[i] = _sidecar_count(sc, tid_c[i], start_c[i], end_c[i], '+');
+            countMinus[i] = _sidecar_count(sc, tid_c[i], start_c[i], end_c[i], '-');
+        }
+    }
+
+    R_Free(strand_c);
+}
+
+
+/*! @function
+  @abstract  count the alignments in each region with a separate bam_fetch(). The regions are distributed
+             in chunks of REGION_CHUNK over nthreads threads, each with its own file handle but a shared
+             bam index, and each writing to its own elements of the count vectors.
+  @param  bamfile     Name of the bamfile
+  @param  tid         target region identifier
+  @param  start       target region start
+  @param  end         target region end
+  @param  strand      target region strand
+  @param  broaden     extend query region for bam_fetch to catch alignments with overlaps due to shifting
+  @param  nthreads    number of threads
+  @param  rinfo_init  regionInfoSums initialised by _init_region_info()
+  @param  countU      counts (non-allelic or allelic Unknown)
+  @param  countR      counts allelic Reference (NULL if non-allelic)
+  @param  countA      counts allelic Alternative (NULL if non-allelic)
+ */
+static void _count_alignments_by_region(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand, SEXP broaden,
+                                        SEXP nthreads, const regionInfoSums *rinfo_init,
+                                        int *countU, int *countR, int *countA){
+    int i, t, num_regions = Rf_length(tid);
+    int nt = _get_nthreads(nthreads, (num_regions + REGION_CHUNK - 1) / REGION_CHUNK);
+    const int *tid_c = INTEGER(tid), *start_c = INTEGER(start), *end_c = INTEGER(end);
+
+    if(rinfo_init->shift == FRAGMENT_SHIFT)
+        Rf_error("fragment counting is only supported for non-allelic counting with a sorted sweep");
+
+    // set shift for fetch to zero if smart shift
+    int shift_f = abs(rinfo_init->shift);
+    if(rinfo_init->shift == SMART_SHIFT)
+        shift_f = 0;
+    int fwidth = shift_f + INTEGER(broaden)[0];
+
+    // open one bam file handle per thread and get the shared bam index from the cache
+    bamCacheEntry *bce = 0;
+    samfile_t **fin = _bam_open_handles(Rf_translateChar(STRING_ELT(bamfile, 0)), nt, &bce);
+    bam_index_t *idx = bce->idx;
+
+    // prepare strands and one regionInfoSums per thread (with its own hash for duplicate removal)
+    char *strand_c = _translate_strands(strand);
+    regionInfoSums *rinfo = (regionInfoSums*) R_Calloc(nt, regionInfoSums);
+    positionHash *dups = 0;
+    int dups_failed = 0, dups_full = 0;
+    if(rinfo_init->filter.dedup)
+        dups = (positionHash*) R_Calloc(nt, positionHash);
+    for(t = 0; t < nt; t++){
+        rinfo[t] = *rinfo_init;
+        if(dups != 0){
+            dups_failed |= _position_hash_init(&dups[t]);
+            rinfo[t].dups = &dups[t];
+        }
+    }
+
+    // loop over query regions
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nt) schedule(dynamic, REGION_CHUNK)
+#endif
+    for(i = 0; i < (dups_failed ? 0 : num_regions); i++){
+        int th = _thread_num();
+        regionInfoSums *ri = &rinfo[th];
+        // reset counters and setup region in rinfo
+        ri->sumU = 0;
+        ri->sumR = 0;
+        ri->sumA = 0;
+        ri->start = start_c[i];
+        ri->end = end_c[i];
+        ri->strand = strand_c[i];
+        if(ri->dups != NULL)
+            _position_hash_reset(ri->dups);
+        // process alignments that overlap region
+        bam_fetch(fin[th]->x.bam, idx, tid_c[i],
+                  start_c[i]-fwidth, // 0-based inclusive start
+                  end_c[i]+fwidth,   // 0-based exclusive end
+                  ri, _addValidHitToSums);
+        // copy result to return values
+        countU[i] = ri->sumU;
+        if(countR != NULL){
+            countR[i] = ri->sumR;
+            countA[i] = ri->sumA;
+        }
+    }
+
+    // collect XV tag errors of all threads
+    regionInfoSums err = *rinfo_init;
+    for(t = 0; t < nt && err.xvError == 0; t++){
+        err.xvError = rinfo[t].xvError;
+        err.xvValue = rinfo[t].xvValue;
     }
 
     // clean up
-    samclose(fin);
-    bam_index_destroy(idx);
+    _bam_close_handles(fin, nt, bce);
+    R_Free(strand_c);
+    R_Free(rinfo);
+    if(dups != 0){
+        for(t = 0; t < nt; t++){
+            dups_full |= dups[t].full;
+            _position_hash_free(&dups[t]);
+        }
+        R_Free(dups);
+    }
+    if(dups_failed)
+        Rf_error("failed to allocate memory for duplicate removal");
+    if(dups_full)
+        Rf_error("too many overlapping alignments for duplicate removal");
+
+    _report_xv_error(&err);
+}
+
+
+/*! @function
+  @abstract  Counts the alignments in regions, which fit the strand, overlap type and shift criteria.
+  @param  bamfile             Name of the bamfile
+  @param  tid                 target region identifier
+  @param  start               target region start
+  @param  end                 target region end
+  @param  strand              target region strand
+  @param  selectReadPosition  alignment ancored at start/end
+  @param  readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments
+  @param  shift               shift size
+  @param  broaden             extend query region for bam_fetch to catch alignments with overlaps due to shifting
+  @param  includeSpliced      also count spliced alignments
+  @param  mapqMin             minimal mapping quality to count alignment (MAPQ >= mapqMin)
+  @param  mapqMax             maximum mapping quality to count alignment (MAPQ <= mapqMax)
+  @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
+  @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
+  @param  nthreads            number of threads used to process the regions in parallel
+  @return               Vector of the alignment counts
+ */
+SEXP count_alignments_non_allelic(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand,
+                                  SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
+                                  SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads){
+
+    // check parameters
+    _verify_parameters(bamfile, tid, start, end, strand, selectReadPosition, readBitMask, shift, broaden, includeSpliced,
+		       mapqMin, mapqMax, absIsizeMin, absIsizeMax, nthreads);
+
+    // initialise regionInfoSums
+    regionInfoSums rinfo;
+    _init_region_info(&rinfo, selectReadPosition, readBitMask, shift, includeSpliced,
+                      mapqMin, mapqMax, absIsizeMin, absIsizeMax, 0);
+
+    // count alignments in query regions (from the count sidecar if available)
+    SEXP count;
+    PROTECT(count = allocVector(INTSXP, Rf_length(tid)));
+    countSidecar *sc = _open_count_sidecar(Rf_translateChar(STRING_ELT(bamfile, 0)), &rinfo, readBitMask,
+                                           includeSpliced, mapqMin, mapqMax, absIsizeMin, absIsizeMax);
+    if(sc != NULL){
+        _count_alignments_from_sidecar(sc, tid, start, end, strand, INTEGER(count), NULL);
+        _sidecar_close(sc);
+    } else {
+        _count_alignments_by_region(bamfile, tid, start, end, strand, broaden, nthreads, &rinfo,
+                                    INTEGER(count), NULL, NULL);
+    }
 
     UNPROTECT(1);
 
@@ -320,74 +1143,25 @@ SEXP count_alignments_non_allelic(SEXP bamfile, SEXP tid, SEXP start, SEXP end,
 
 SEXP count_alignments_allelic(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand,
                                   SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
-                                  SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax){
+                                  SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads){
 
     // check parameters
     _verify_parameters(bamfile, tid, start, end, strand, selectReadPosition, readBitMask, shift, broaden, includeSpliced,
-		       mapqMin, mapqMax, absIsizeMin, absIsizeMax);
-
-    // open bam file
-    samfile_t *fin = 0;
-    fin = samopen(Rf_translateChar(STRING_ELT(bamfile, 0)), "rb", NULL);
-    if (fin == 0)
-        Rf_error("failed to open BAM file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (fin->header == 0 || fin->header->n_targets == 0) {
-        samclose(fin);
-        Rf_error("BAM header missing or empty of file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    }
-    // open bam index
-    bam_index_t *idx = 0;
-    idx = bam_index_load(Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (idx == 0){
-        samclose(fin);
-        Rf_error("failed to open BAM index file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    }
+		       mapqMin, mapqMax, absIsizeMin, absIsizeMax, nthreads);
 
     // initialise regionInfoSums
     regionInfoSums rinfo;
-    rinfo.readBitMask = (INTEGER(readBitMask)[0] & (BAM_FREAD1 + BAM_FREAD2));
-    rinfo.skipSecondary = ((INTEGER(readBitMask)[0] & BAM_FSECONDARY) ? 0 : 1);
-    rinfo.shift = INTEGER(shift)[0];
-    rinfo.selectReadPosition = Rf_translateChar(STRING_ELT(selectReadPosition, 0))[0];
-    rinfo.allelic = 1;
-    rinfo.includeSpliced = (Rf_asLogical(includeSpliced) ? 1 : 0);
-    rinfo.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    rinfo.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
-    rinfo.absIsizeMin = (uint32_t)(INTEGER(absIsizeMin)[0]);
-    rinfo.absIsizeMax = (uint32_t)(INTEGER(absIsizeMax)[0]);
+    _init_region_info(&rinfo, selectReadPosition, readBitMask, shift, includeSpliced,
+                      mapqMin, mapqMax, absIsizeMin, absIsizeMax, 1);
 
-    // set shift for fetch to zero if smart shift
-    int shift_f = abs(INTEGER(shift)[0]);
-    if(INTEGER(shift)[0] == SMART_SHIFT)
-        shift_f = 0;
-
-    // select bam_fetch callback function
-    bam_fetch_f fetch_func = _addValidHitToSums;
-
-    // loop over query regions
+    // count alignments in query regions
     int num_regions = Rf_length(tid);
     SEXP count, attrib, countU, countR, countA;
     PROTECT(countU = allocVector(INTSXP, num_regions));
     PROTECT(countR = allocVector(INTSXP, num_regions));
     PROTECT(countA = allocVector(INTSXP, num_regions));
-    for(int i = 0; i < num_regions; i++){
-        // reset counters and setup region in rinfo
-	rinfo.sumU = 0;
-	rinfo.sumR = 0;
-	rinfo.sumA = 0;
-        rinfo.start = INTEGER(start)[i];
-        rinfo.end = INTEGER(end)[i];
-        rinfo.strand = Rf_translateChar(STRING_ELT(strand, i));
-        // process alignments that overlap region
-        bam_fetch(fin->x.bam, idx, INTEGER(tid)[i],
-                  INTEGER(start)[i]-shift_f-INTEGER(broaden)[0], // 0-based inclusive start
-                  INTEGER(end)[i]+shift_f+INTEGER(broaden)[0],   // 0-based exclusive end
-                  &rinfo, fetch_func);
-	// copy result to return values
-	INTEGER(countU)[i] = rinfo.sumU;
-	INTEGER(countR)[i] = rinfo.sumR;
-	INTEGER(countA)[i] = rinfo.sumA;
-    }
+    _count_alignments_by_region(bamfile, tid, start, end, strand, broaden, nthreads, &rinfo,
+                                INTEGER(countU), INTEGER(countR), INTEGER(countA));
 
     // pack results into list
     PROTECT(count = allocVector(VECSXP, 3));
@@ -401,11 +1175,1237 @@ SEXP count_alignments_allelic(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP
     SET_VECTOR_ELT(count, 2, countA);
     setAttrib(count, R_NamesSymbol, attrib);
 
+    UNPROTECT(5);
+
+    return count;
+}
+
+
+/*! @function
+  @abstract  count the alignments in regions with a single sorted sweep: regions are sorted by (tid, start),
+             neighboring fetch windows on the same target are merged into blocks (gaps up to SWEEP_MAX_GAP), and
+             the alignments of each block are decoded only once and added to all active regions. Blocks are
+             distributed over nthreads threads, each with its own file handle but a shared bam index; the regions
+             of different blocks are disjoint.
+  @param  bamfile     Name of the bamfile
+  @param  tid         target region identifier
+  @param  start       target region start
+  @param  end         target region end
+  @param  strand      target region strand (ignored for strand-resolved counting)
+  @param  broaden     extend query region for bam_fetch to catch alignments with overlaps due to shifting
+  @param  nthreads    number of threads
+  @param  rinfo       regionInfoSums initialised by _init_region_info()
+  @param  params      parameter sets counted in the same sweep (fetch windows extended by their maximal
+                      fwidth), or NULL to use the shift and selectReadPosition of rinfo
+  @param  count_c       counts (one per region; plus strand alignments if countMinus_c is not NULL; regions x
+                        parameter sets if params is not NULL)
+  @param  countMinus_c  minus strand alignment counts (strand-resolved counting), or NULL
+ */
+static void _count_alignments_sweep(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand, SEXP broaden,
+                                    SEXP nthreads, const regionInfoSums *rinfo, const parameterSets *params,
+                                    int *count_c, int *countMinus_c){
+    int k, ncounts = (params == NULL) ? 1 : params->n;
+
+    // set shift for fetch to zero if smart shift or fragment counting
+    int shift_f = abs(rinfo->shift);
+    if(rinfo->shift == SMART_SHIFT || rinfo->shift == FRAGMENT_SHIFT)
+        shift_f = 0;
+    int fwidth = shift_f + INTEGER(broaden)[0];
+    if(params != NULL)
+        for(k = 0, fwidth = 0; k < params->n; k++)
+            if(params->fwidth[k] > fwidth)
+                fwidth = params->fwidth[k];
+
+    // open one bam file handle per thread and get the shared bam index from the cache, before allocating
+    // anything that would leak if the bam file cannot be opened (at most one thread per region)
+    int i, b, nblocks = 0, num_regions = Rf_length(tid);
+    int t, nt = _get_nthreads(nthreads, num_regions), hash_failed = 0;
+    bamCacheEntry *bce = 0;
+    samfile_t **fin = _bam_open_handles(Rf_translateChar(STRING_ELT(bamfile, 0)), nt, &bce);
+    bam_index_t *idx = bce->idx;
+    int n_targets = fin[0]->header->n_targets;
+
+    // sort regions by (tid, start)
+    int *tid_c = INTEGER(tid), *start_c = INTEGER(start), *end_c = INTEGER(end);
+    regionKey *keys = (regionKey*) R_Calloc(num_regions, regionKey);
+    int *order = (int*) R_Calloc(num_regions, int);
+    int *active = (int*) R_Calloc(num_regions, int);
+    bamRegion *breg = (bamRegion*) R_Calloc(num_regions, bamRegion);
+    sweepBlock *blocks = (sweepBlock*) R_Calloc(num_regions, sweepBlock);
+    char *strand_c = _translate_strands(strand);
+    for(i = 0; i < num_regions; i++){
+        keys[i].tid = tid_c[i];
+        keys[i].start = start_c[i];
+        keys[i].idx = i;
+    }
+    qsort(keys, (size_t)num_regions, sizeof(regionKey), _compareRegionKeys);
+    for(i = 0; i < num_regions; i++)
+        order[i] = keys[i].idx;
+
+    // build blocks of neighboring regions, and close the handles of threads without a block
+    nblocks = _build_sweep_blocks(tid_c, start_c, end_c, order, num_regions, fwidth, blocks);
+    for(t = _get_nthreads(nthreads, nblocks); t < nt; t++)
+        samclose(fin[t]);
+    nt = _get_nthreads(nthreads, nblocks);
+
+    // allocate one mate hash per thread for fragment counting, and one hash per thread for duplicate removal
+    int mates_full = 0, dups_full = 0;
+    positionHash *mates = 0, *dups = 0;
+    if(params == NULL && rinfo->shift == FRAGMENT_SHIFT){
+        mates = (positionHash*) R_Calloc(nt, positionHash);
+        for(t = 0; t < nt; t++)
+            hash_failed |= _position_hash_init(&mates[t]);
+    }
+    if(rinfo->filter.dedup){
+        dups = (positionHash*) R_Calloc(nt, positionHash);
+        for(t = 0; t < nt; t++)
+            hash_failed |= 2 * _position_hash_init(&dups[t]);
+    }
+    if(hash_failed)
+        nblocks = 0;
+
+    // initialise counts
+    for(i = 0; i < num_regions * ncounts; i++)
+        count_c[i] = 0;
+    for(i = 0; i < num_regions; i++){
+        if(countMinus_c != NULL)
+            countMinus_c[i] = 0;
+    }
+
+    // loop over blocks of neighboring regions
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nt) schedule(dynamic, 1)
+#endif
+    for(b = 0; b < nblocks; b++){
+        // skip regions on unknown targets
+        if(blocks[b].tid < 0 || blocks[b].tid >= n_targets)
+            continue;
+
+        // the active regions and fetch windows of a block are subsets of its regions: use the corresponding part
+        // of active and breg
+        regionSweep sweep;
+        sweep.rinfo = rinfo;
+        sweep.start = start_c;
+        sweep.end = end_c;
+        sweep.strand = strand_c;
+        sweep.order = order;
+        sweep.next = blocks[b].first;
+        sweep.last = blocks[b].last;
+        sweep.active = active + blocks[b].first;
+        sweep.nactive = 0;
+        sweep.fwidth = fwidth;
+        sweep.params = params;
+        sweep.nregions = num_regions;
+        sweep.count = count_c;
+        sweep.countMinus = countMinus_c;
+        sweep.countR = NULL;
+        sweep.countA = NULL;
+        sweep.mates = NULL;
+        sweep.dups = NULL;
+        sweep.mask = NULL;
+        sweep.xvError = 0;
+        if(mates != 0){
+            sweep.mates = &mates[_thread_num()];
+            _position_hash_reset(sweep.mates);
+        }
+        if(dups != 0){
+            sweep.dups = &dups[_thread_num()];
+            _position_hash_reset(sweep.dups);
+        }
+
+        // process alignments that overlap the fetch windows of the block
+        bamRegion *reg = breg + blocks[b].first;
+        int nreg = _block_fetch_regions(&blocks[b], blocks[b].tid, start_c, end_c, order, fwidth, reg);
+        _bam_fetch_regions(fin[_thread_num()], idx, reg, nreg, &sweep,
+                           (params == NULL) ? _addValidHitToActiveRegions : _addValidHitToParameterSets);
+    }
+
     // clean up
-    samclose(fin);
-    bam_index_destroy(idx);
+    _bam_close_handles(fin, nt, bce);
+    if(mates != 0){
+        for(t = 0; t < nt; t++){
+            mates_full |= mates[t].full;
+            _position_hash_free(&mates[t]);
+        }
+        R_Free(mates);
+    }
+    if(dups != 0){
+        for(t = 0; t < nt; t++){
+            dups_full |= dups[t].full;
+            _position_hash_free(&dups[t]);
+        }
+        R_Free(dups);
+    }
+    R_Free(keys);
+    R_Free(order);
+    R_Free(active);
+    R_Free(breg);
+    R_Free(blocks);
+    R_Free(strand_c);
+    if(hash_failed & 1)
+        Rf_error("failed to allocate memory for fragment counting");
+    else if(hash_failed)
+        Rf_error("failed to allocate memory for duplicate removal");
+    if(mates_full)
+        Rf_error("too many overlapping fragments for fragment counting");
+    else if(dups_full)
+        Rf_error("too many overlapping alignments for duplicate removal");
+}
+
+
+/*! @function
+  @abstract  Counts the alignments in regions like count_alignments_non_allelic, but with a single sorted sweep
+             (see _count_alignments_sweep), or from the count sidecar of the bamfile if there is one for the
+             counting parameters.
+  @param  bamfile             Name of the bamfile
+  @param  tid                 target region identifier
+  @param  start               target region start
+  @param  end                 target region end
+  @param  strand              target region strand
+  @param  selectReadPosition  alignment ancored at start/end
+  @param  readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments
+  @param  shift               shift size
+  @param  broaden             extend query region for bam_fetch to catch alignments with overlaps due to shifting
+  @param  includeSpliced      also count spliced alignments
+  @param  mapqMin             minimal mapping quality to count alignment (MAPQ >= mapqMin)
+  @param  mapqMax             maximum mapping quality to count alignment (MAPQ <= mapqMax)
+  @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
+  @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
+  @param  nthreads            number of threads used to process the blocks in parallel
+  @return               Vector of the alignment counts (same order as the regions)
+ */
+SEXP count_alignments_non_allelic_sweep(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand,
+                                        SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
+                                        SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads){
+
+    // check parameters
+    _verify_parameters(bamfile, tid, start, end, strand, selectReadPosition, readBitMask, shift, broaden, includeSpliced,
+		       mapqMin, mapqMax, absIsizeMin, absIsizeMax, nthreads);
+
+    // initialise regionInfoSums
+    regionInfoSums rinfo;
+    _init_region_info(&rinfo, selectReadPosition, readBitMask, shift, includeSpliced,
+                      mapqMin, mapqMax, absIsizeMin, absIsizeMax, 0);
+
+    // count alignments from the count sidecar if available, or from the bamfile
+    SEXP count;
+    PROTECT(count = allocVector(INTSXP, Rf_length(tid)));
+    countSidecar *sc = _open_count_sidecar(Rf_translateChar(STRING_ELT(bamfile, 0)), &rinfo, readBitMask,
+                                           includeSpliced, mapqMin, mapqMax, absIsizeMin, absIsizeMax);
+    if(sc != NULL){
+        _count_alignments_from_sidecar(sc, tid, start, end, strand, INTEGER(count), NULL);
+        _sidecar_close(sc);
+    } else {
+        _count_alignments_sweep(bamfile, tid, start, end, strand, broaden, nthreads, &rinfo, NULL,
+                                INTEGER(count), NULL);
+    }
+
+    UNPROTECT(1);
+
+    return count;
+}
+
+
+/*! @function
+  @abstract  Counts the plus and minus strand alignments in regions separately, with a single sorted sweep
+             (see _count_alignments_sweep) or from the count sidecar of the bamfile. The counts for the
+             orientations of qCount are derived from the two columns: "any" is their sum, "same" is the column
+             of the region strand ("+" for unstranded regions: use "any"), and "opposite" the other column.
+  @param  bamfile             Name of the bamfile
+  @param  tid                 target region identifier
+  @param  start               target region start
+  @param  end                 target region end
+  @param  selectReadPosition  alignment ancored at start/end
+  @param  readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments
+  @param  shift               shift size
+  @param  broaden             extend query region for bam_fetch to catch alignments with overlaps due to shifting
+  @param  includeSpliced      also count spliced alignments
+  @param  mapqMin             minimal mapping quality to count alignment (MAPQ >= mapqMin)
+  @param  mapqMax             maximum mapping quality to count alignment (MAPQ <= mapqMax)
+  @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
+  @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
+  @param  nthreads            number of threads used to process the blocks in parallel
+  @return               Matrix of the alignment counts with one row per region and columns "+" and "-"
+ */
+SEXP count_alignments_stranded(SEXP bamfile, SEXP tid, SEXP start, SEXP end,
+                               SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
+                               SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads){
+    int i, num_regions = Rf_length(tid);
+
+    // unstranded regions
+    SEXP strand;
+    PROTECT(strand = allocVector(STRSXP, num_regions));
+    for(i = 0; i < num_regions; i++)
+        SET_STRING_ELT(strand, i, mkChar("*"));
+
+    // check parameters
+    _verify_parameters(bamfile, tid, start, end, strand, selectReadPosition, readBitMask, shift, broaden, includeSpliced,
+		       mapqMin, mapqMax, absIsizeMin, absIsizeMax, nthreads);
+
+    // initialise regionInfoSums
+    regionInfoSums rinfo;
+    _init_region_info(&rinfo, selectReadPosition, readBitMask, shift, includeSpliced,
+                      mapqMin, mapqMax, absIsizeMin, absIsizeMax, 0);
+
+    // count alignments from the count sidecar if available, or from the bamfile
+    SEXP count, dimnames, colnames;
+    PROTECT(count = allocMatrix(INTSXP, num_regions, 2));
+    int *count_c = INTEGER(count);
+    countSidecar *sc = _open_count_sidecar(Rf_translateChar(STRING_ELT(bamfile, 0)), &rinfo, readBitMask,
+                                           includeSpliced, mapqMin, mapqMax, absIsizeMin, absIsizeMax);
+    if(sc != NULL){
+        _count_alignments_from_sidecar(sc, tid, start, end, strand, count_c, count_c + num_regions);
+        _sidecar_close(sc);
+    } else {
+        _count_alignments_sweep(bamfile, tid, start, end, strand, broaden, nthreads, &rinfo, NULL,
+                                count_c, count_c + num_regions);
+    }
+
+    // set column names
+    PROTECT(dimnames = allocVector(VECSXP, 2));
+    PROTECT(colnames = allocVector(STRSXP, 2));
+    SET_STRING_ELT(colnames, 0, mkChar("+"));
+    SET_STRING_ELT(colnames, 1, mkChar("-"));
+    SET_VECTOR_ELT(dimnames, 1, colnames);
+    setAttrib(count, R_DimNamesSymbol, dimnames);
+
+    UNPROTECT(4);
+
+    return count;
+}
+
+
+/*! @function
+  @abstract  Counts the alignments in regions for several parameter sets (pairs of shift and selectReadPosition)
+             with a single sorted sweep (see _count_alignments_sweep): the fetch windows are extended once by the
+             maximal shift, and each alignment is decoded once and added to the counts of all parameter sets.
+             The counts are identical to separate calls of count_alignments_non_allelic_sweep.
+  @param  bamfile             Name of the bamfile
+  @param  tid                 target region identifier
+  @param  start               target region start
+  @param  end                 target region end
+  @param  strand              target region strand
+  @param  selectReadPosition  alignment ancored at start/end, one per parameter set
+  @param  readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments
+  @param  shift               shift size, one per parameter set
+  @param  broaden             extend query region for bam_fetch to catch alignments with overlaps due to shifting
+  @param  includeSpliced      also count spliced alignments
+  @param  mapqMin             minimal mapping quality to count alignment (MAPQ >= mapqMin)
+  @param  mapqMax             maximum mapping quality to count alignment (MAPQ <= mapqMax)
+  @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
+  @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
+  @param  nthreads            number of threads used to process the blocks in parallel
+  @return               Matrix of the alignment counts with one row per region and one column per parameter set
+ */
+SEXP count_alignments_parameter_sweep(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand,
+                                      SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden,
+                                      SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin,
+                                      SEXP absIsizeMax, SEXP nthreads){
+    int k, nparams = Rf_length(shift);
+
+    // check parameter sets
+    if(!Rf_isInteger(shift) || nparams < 1)
+        Rf_error("'shift' must be of type integer and have at least one element");
+    if(!Rf_isString(selectReadPosition) || Rf_length(selectReadPosition) != nparams)
+        Rf_error("'selectReadPosition' must be of type character and have the same length as 'shift'");
+
+    // check the other parameters (with the first parameter set)
+    SEXP selectReadPosition1, shift1;
+    PROTECT(selectReadPosition1 = Rf_ScalarString(STRING_ELT(selectReadPosition, 0)));
+    PROTECT(shift1 = Rf_ScalarInteger(INTEGER(shift)[0]));
+    _verify_parameters(bamfile, tid, start, end, strand, selectReadPosition1, readBitMask, shift1, broaden,
+                       includeSpliced, mapqMin, mapqMax, absIsizeMin, absIsizeMax, nthreads);
+
+    // initialise regionInfoSums and parameter sets
+    regionInfoSums rinfo;
+    _init_region_info(&rinfo, selectReadPosition1, readBitMask, shift1, includeSpliced,
+                      mapqMin, mapqMax, absIsizeMin, absIsizeMax, 0);
+    // (parameter sets are allocated by R, so that they are released if the sweep cannot open the bam file)
+    SEXP select, fwidth;
+    PROTECT(select = allocVector(RAWSXP, nparams));
+    PROTECT(fwidth = allocVector(INTSXP, nparams));
+    char *select_c = (char*) RAW(select);
+    int *fwidth_c = INTEGER(fwidth);
+    for(k = 0; k < nparams; k++){
+        select_c[k] = Rf_translateChar(STRING_ELT(selectReadPosition, k))[0];
+        if(select_c[k] != 's' && select_c[k] != 'e')
+            Rf_error("The value of 'selectReadPosition' not supportet.");
+        if(INTEGER(shift)[k] == FRAGMENT_SHIFT)
+            Rf_error("fragment counting is not supported for parameter sweeps");
+        // set shift for fetch to zero if smart shift
+        fwidth_c[k] = ((INTEGER(shift)[k] == SMART_SHIFT) ? 0 : abs(INTEGER(shift)[k])) + INTEGER(broaden)[0];
+    }
+    parameterSets params;
+    params.n = nparams;
+    params.shift = INTEGER(shift);
+    params.selectReadPosition = select_c;
+    params.fwidth = fwidth_c;
+
+    // count alignments in a single sweep
+    SEXP count;
+    PROTECT(count = allocMatrix(INTSXP, Rf_length(tid), nparams));
+    _count_alignments_sweep(bamfile, tid, start, end, strand, broaden, nthreads, &rinfo, &params,
+                            INTEGER(count), NULL);
 
     UNPROTECT(5);
 
     return count;
 }
+
+
+/*! @function
+  @abstract  Counts the alignments in regions or genes for multiple bamfiles, and returns the complete count
+             matrix (regions/genes x bamfiles, or x 3*bamfiles for allelic counting, or x 2*bamfiles for
+             strand-resolved counting).
+             Regions are sorted and grouped into blocks once; the work units (bamfile, block) are distributed
+             over nthreads threads. Each thread opens its own handle of the current bamfile, and the index of
+             a bamfile is loaded once, shared by all threads and released when all its blocks are processed.
+             Without genes, regions are counted by the sorted sweep engine, or from the count sidecar of a
+             bamfile if there is one for the counting parameters. With genes, each block is indexed as an
+             interval tree, and each alignment is counted at most once per gene.
+  @param  bamfiles            Names of the bamfiles
+  @param  seqlevel            target region sequence (0-based index into seqlevels)
+  @param  seqlevels           sequence names, translated to target identifiers separately for each bamfile
+  @param  start               target region start
+  @param  end                 target region end
+  @param  strand              target region strand
+  @param  selectReadPosition  alignment ancored at start/end
+  @param  readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments
+  @param  shift               shift size (one per bamfile)
+  @param  broaden             extend query region for bam_fetch to catch alignments with overlaps due to shifting
+  @param  includeSpliced      also count spliced alignments
+  @param  mapqMin             minimal mapping quality to count alignment (MAPQ >= mapqMin)
+  @param  mapqMax             maximum mapping quality to count alignment (MAPQ <= mapqMax)
+  @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
+  @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
+  @param  allelic             allelic counting (columns R, U and A for each bamfile)
+  @param  nthreads            number of threads
+  @param  gene                gene of the regions (0-based), or R_NilValue to count regions
+  @param  stranded            count plus and minus strand alignments separately (columns + and - for each bamfile;
+                              non-allelic only, the region strands are ignored)
+  @param  mask                masked intervals (list of 0-based indices into 'seqlevels', 0-based starts and
+                              exclusive ends, sorted and non-overlapping, see _mask_init), or R_NilValue; alignments
+                              with a masked position are not counted
+  @return               Matrix of the alignment counts (same row order as the regions, or ordered by gene)
+ */
+static SEXP _count_alignments_multiple(SEXP bamfiles, SEXP seqlevel, SEXP seqlevels, SEXP start, SEXP end, SEXP strand,
+                                       SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden,
+                                       SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin,
+                                       SEXP absIsizeMax, SEXP allelic, SEXP nthreads, SEXP gene, int stranded,
+                                       SEXP mask){
+
+    // check parameters
+    if(!Rf_isString(bamfiles) || Rf_length(bamfiles) < 1)
+        Rf_error("'bamfiles' must be of type character with at least one element");
+    if(!Rf_isString(seqlevels))
+        Rf_error("'seqlevels' must be of type character");
+    if(!Rf_isInteger(shift) || Rf_length(shift) != Rf_length(bamfiles))
+        Rf_error("'shift' must be of type integer and contain one value per bamfile");
+    if(!Rf_isLogical(allelic) || Rf_length(allelic) != 1)
+        Rf_error("'allelic' must be of type logical(1)");
+    SEXP bamfile1, shift1;
+    PROTECT(bamfile1 = Rf_ScalarString(STRING_ELT(bamfiles, 0)));
+    PROTECT(shift1 = Rf_ScalarInteger(INTEGER(shift)[0]));
+    _verify_parameters(bamfile1, seqlevel, start, end, strand, selectReadPosition, readBitMask, shift1, broaden,
+                       includeSpliced, mapqMin, mapqMax, absIsizeMin, absIsizeMax, nthreads);
+    UNPROTECT(2);
+
+    int i, f, b, t, nblocks = 0, fragments = 0;
+    for(f = 0; f < Rf_length(shift); f++)
+        if(INTEGER(shift)[f] == FRAGMENT_SHIFT && (gene != R_NilValue || Rf_asLogical(allelic)))
+            Rf_error("fragment counting is only supported for non-allelic counting of regions");
+    int num_files = Rf_length(bamfiles), num_regions = Rf_length(seqlevel), num_levels = Rf_length(seqlevels);
+    int is_allelic = (Rf_asLogical(allelic) ? 1 : 0);
+    int *seqlevel_c = INTEGER(seqlevel), *start_c = INTEGER(start), *end_c = INTEGER(end);
+    for(i = 0; i < num_regions; i++)
+        if(seqlevel_c[i] < 0 || seqlevel_c[i] >= num_levels)
+            Rf_error("'seqlevel' must contain 0-based indices into 'seqlevels'");
+    int *gene_c = 0, num_rows = num_regions;
+    if(gene != R_NilValue){
+        if(!Rf_isInteger(gene) || Rf_length(gene) != num_regions)
+            Rf_error("'gene' must be of type integer and have the same length as 'seqlevel'");
+        gene_c = INTEGER(gene);
+        num_rows = 0;
+        for(i = 0; i < num_regions; i++){
+            if(gene_c[i] < 0 || gene_c[i] == NA_INTEGER)
+                Rf_error("'gene' must contain 0-based gene indices");
+            if(gene_c[i] >= num_rows)
+                num_rows = gene_c[i] + 1;
+        }
+    }
+    regionMask *rmask = _mask_init(mask, num_levels);
+
+    // translate file names and seqlevels to target identifiers of each bamfile (from the bam headers);
+    // this also puts the bamfiles and their indices into the bam handle cache for the worker threads
+    const char **fname = (const char**) R_Calloc(num_files, char*);
+    int *tidmap = (int*) R_Calloc((size_t)num_files * num_levels + 1, int);
+    for(f = 0; f < num_files; f++){
+        int status;
+        fname[f] = Rf_translateChar(STRING_ELT(bamfiles, f));
+        bamCacheEntry *bce = _bam_cache_acquire(fname[f], &status);
+        if(status != BAM_CACHE_OK){
+            const char *err_fname = fname[f];
+            R_Free(fname);
+            R_Free(tidmap);
+            _mask_free(rmask);
+            if(status == BAM_CACHE_NO_INDEX)
+                Rf_error("failed to open BAM index file: '%s'", err_fname);
+            else
+                Rf_error("failed to open BAM file or BAM header missing or empty: '%s'", err_fname);
+        }
+        for(i = 0; i < num_levels; i++)
+            tidmap[f * num_levels + i] = bam_name2id(bce->fin->header, Rf_translateChar(STRING_ELT(seqlevels, i)));
+        _bam_cache_release(bce);
+    }
+
+    // initialise one regionInfoSums per bamfile (shifts may differ) and the maximal fetch window extension
+    int fwidth_max = 0;
+    int *fwidth = (int*) R_Calloc(num_files, int);
+    regionInfoSums *rinfo = (regionInfoSums*) R_Calloc(num_files, regionInfoSums);
+    for(f = 0; f < num_files; f++){
+        _init_region_info(&rinfo[f], selectReadPosition, readBitMask, shift1, includeSpliced,
+                          mapqMin, mapqMax, absIsizeMin, absIsizeMax, is_allelic);
+        rinfo[f].shift = INTEGER(shift)[f];
+        // set shift for fetch to zero if smart shift or fragment counting
+        fwidth[f] = ((rinfo[f].shift == SMART_SHIFT || rinfo[f].shift == FRAGMENT_SHIFT) ? 0 : abs(rinfo[f].shift)) +
+            INTEGER(broaden)[0];
+        if(rinfo[f].shift == FRAGMENT_SHIFT)
+            fragments = 1;
+        if(fwidth[f] > fwidth_max)
+            fwidth_max = fwidth[f];
+    }
+
+    // open the count sidecars of the bamfiles if available (region counts only)
+    countSidecar **sidecar = (countSidecar**) R_Calloc(num_files, countSidecar*);
+    if(gene_c == 0)
+        for(f = 0; f < num_files; f++)
+            sidecar[f] = _open_count_sidecar(fname[f], &rinfo[f], readBitMask, includeSpliced,
+                                             mapqMin, mapqMax, absIsizeMin, absIsizeMax);
+
+    // sort regions by (seqlevel, start) and build blocks of neighboring regions (identical for all bamfiles)
+    regionKey *keys = (regionKey*) R_Calloc(num_regions, regionKey);
+    int *order = (int*) R_Calloc(num_regions, int);
+    sweepBlock *blocks = (sweepBlock*) R_Calloc(num_regions, sweepBlock);
+    char *strand_c = _translate_strands(strand);
+    for(i = 0; i < num_regions; i++){
+        keys[i].tid = seqlevel_c[i];
+        keys[i].start = start_c[i];
+        keys[i].idx = i;
+    }
+    qsort(keys, (size_t)num_regions, sizeof(regionKey), _compareRegionKeys);
+    for(i = 0; i < num_regions; i++)
+        order[i] = keys[i].idx;
+    nblocks = _build_sweep_blocks(seqlevel_c, start_c, end_c, order, num_regions, fwidth_max, blocks);
+    int max_block = 0;
+    for(b = 0; b < nblocks; b++)
+        if(blocks[b].last - blocks[b].first > max_block)
+            max_block = blocks[b].last - blocks[b].first;
+
+    // for gene-level counting, index the regions of each block as an interval tree
+    itvNode *nodes = 0;
+    int *maxLevel = 0;
+    if(gene_c != 0){
+        nodes = (itvNode*) R_Calloc(num_regions, itvNode);
+        maxLevel = (int*) R_Calloc(nblocks, int);
+        for(i = 0; i < num_regions; i++){
+            nodes[i].start = start_c[order[i]];
+            nodes[i].end = end_c[order[i]];
+            nodes[i].id = order[i];
+        }
+        for(b = 0; b < nblocks; b++)
+            maxLevel[b] = _itv_index(nodes + blocks[b].first, blocks[b].last - blocks[b].first);
+    }
+
+    // per-thread active regions and errors, per-bamfile errors
+    int nunits = num_files * nblocks;
+    int nt = _get_nthreads(nthreads, nunits);
+    int *active = (int*) R_Calloc((size_t)nt * (max_block > 0 ? max_block : 1), int);
+    bamRegion *breg = (bamRegion*) R_Calloc((size_t)nt * (max_block > 0 ? max_block : 1), bamRegion);
+    int *lastHit = (gene_c != 0 ? (int*) R_Calloc((size_t)nt * (num_rows > 0 ? num_rows : 1), int) : 0);
+    int *xvError = (int*) R_Calloc(nt, int);
+    char *xvValue = (char*) R_Calloc(nt, char);
+    int *fileError = (int*) R_Calloc(num_files, int);
+
+    // initialise counts (ncpf columns per bamfile)
+    int ncpf = (is_allelic ? 3 : (stranded ? 2 : 1)), ncol = ncpf * num_files;
+    SEXP count, dimnames, colnames;
+    PROTECT(count = allocMatrix(INTSXP, num_rows, ncol));
+    int *count_c = INTEGER(count);
+    for(i = 0; i < num_rows * ncol; i++)
+        count_c[i] = 0;
+
+    // count bamfiles with a count sidecar (prefix sums over the anchor positions, minus the masked parts of the regions)
+    for(f = 0; f < num_files; f++)
+        if(sidecar[f] != 0)
+            for(i = 0; i < num_regions; i++){
+                int ftid = tidmap[f * num_levels + seqlevel_c[i]];
+                if(stranded){
+                    count_c[(size_t)(2 * f) * num_regions + i] = _sidecar_count(sidecar[f], ftid, start_c[i], end_c[i], '+');
+                    count_c[(size_t)(2 * f + 1) * num_regions + i] = _sidecar_count(sidecar[f], ftid, start_c[i], end_c[i], '-');
+                } else {
+                    count_c[(size_t)f * num_regions + i] = _sidecar_count(sidecar[f], ftid, start_c[i], end_c[i], strand_c[i]);
+                }
+                if(rmask != NULL){
+                    maskCursor mc;
+                    for(_mask_cursor_set(&mc, rmask, seqlevel_c[i], start_c[i]); mc.cur < mc.n && mc.start[mc.cur] < end_c[i]; mc.cur++){
+                        int ms = (mc.start[mc.cur] > start_c[i] ? mc.start[mc.cur] : start_c[i]);
+                        int me = (mc.end[mc.cur] < end_c[i] ? mc.end[mc.cur] : end_c[i]);
+                        if(stranded){
+                            count_c[(size_t)(2 * f) * num_regions + i] -= _sidecar_count(sidecar[f], ftid, ms, me, '+');
+                            count_c[(size_t)(2 * f + 1) * num_regions + i] -= _sidecar_count(sidecar[f], ftid, ms, me, '-');
+                        } else {
+                            count_c[(size_t)f * num_regions + i] -= _sidecar_count(sidecar[f], ftid, ms, me, strand_c[i]);
+                        }
+                    }
+                }
+            }
+
+    // loop over work units (bamfile, block) in bamfile-major order
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nt)
+#endif
+    {
+        int th = _thread_num(), u, uf, ub, cur = -1, status;
+        samfile_t *fin = 0;
+        bamCacheEntry *bce = 0;
+        bam_index_t *fidx = 0;
+        regionSweep sweep;
+        positionHash mates, dups;
+        maskCursor mcursor;
+        int mates_ok = (fragments && _position_hash_init(&mates) == 0);
+        int dups_ok = (rinfo[0].filter.dedup && _position_hash_init(&dups) == 0);
+        sweep.start = start_c;
+        sweep.end = end_c;
+        sweep.strand = strand_c;
+        sweep.order = order;
+        sweep.active = active + (size_t)th * max_block;
+        sweep.countMinus = NULL;
+        sweep.params = NULL;
+        sweep.nregions = num_regions;
+        bamRegion *reg = breg + (size_t)th * max_block;
+        int nreg;
+        sweep.xvError = 0;
+        sweep.xvValue = 0;
+        geneSweep gs;
+        gs.start = start_c;
+        gs.end = end_c;
+        gs.strand = strand_c;
+        gs.gene = gene_c;
+        gs.hits = sweep.active;
+        gs.lastHit = (gene_c != 0 ? lastHit + (size_t)th * num_rows : 0);
+        gs.countMinus = NULL;
+        gs.dups = NULL;
+        sweep.dups = NULL;
+        gs.mask = sweep.mask = (rmask != NULL ? &mcursor : NULL);
+        gs.serial = 0;
+        gs.xvError = 0;
+        gs.xvValue = 0;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+        for(u = 0; u < nunits; u++){
+            uf = u / nblocks;
+            ub = u % nblocks;
+
+            // skip bamfiles that were counted from their count sidecar
+            if(sidecar[uf] != 0)
+                continue;
+
+            // switch to the bamfile of the work unit: open own handle, get shared index from the cache
+            if(uf != cur){
+                if(fin != 0)
+                    samclose(fin);
+                _bam_cache_release(bce);
+                fin = samopen(fname[uf], "rb", NULL);
+                _bam_attach_pool(fin);
+                bce = _bam_cache_acquire(fname[uf], &status);
+                fidx = (bce != 0 ? bce->idx : 0);
+                cur = uf;
+                if(fin == 0 || status == BAM_CACHE_OPEN_FAILED || status == BAM_CACHE_NO_HEADER)
+                    fileError[uf] = 1;
+                else if(status == BAM_CACHE_NO_INDEX)
+                    fileError[uf] = 2;
+            }
+
+            // reset the hash for duplicate removal
+            if(rinfo[uf].filter.dedup){
+                if(dups_ok){
+                    _position_hash_reset(&dups);
+                    gs.dups = sweep.dups = &dups;
+                } else {
+                    fileError[uf] = 4;
+                    continue;
+                }
+            }
+
+            // position the mask cursor at the start of the block
+            if(rmask != NULL)
+                _mask_cursor_set(&mcursor, rmask, blocks[ub].tid, start_c[order[blocks[ub].first]] - fwidth[uf]);
+
+            // process alignments that overlap block
+            if(fin != 0 && fidx != 0 && gene_c != 0 && tidmap[uf * num_levels + blocks[ub].tid] >= 0){
+                gs.rinfo = &rinfo[uf];
+                gs.nodes = nodes + blocks[ub].first;
+                gs.nnodes = blocks[ub].last - blocks[ub].first;
+                gs.maxLevel = maxLevel[ub];
+                gs.fwidth = fwidth[uf];
+                if(is_allelic){
+                    gs.countR = count_c + (size_t)(3 * uf) * num_rows;
+                    gs.count = count_c + (size_t)(3 * uf + 1) * num_rows;
+                    gs.countA = count_c + (size_t)(3 * uf + 2) * num_rows;
+                } else {
+                    gs.count = count_c + (size_t)(ncpf * uf) * num_rows;
+                    gs.countMinus = (stranded ? gs.count + num_rows : NULL);
+                    gs.countR = NULL;
+                    gs.countA = NULL;
+                }
+                nreg = _block_fetch_regions(&blocks[ub], tidmap[uf * num_levels + blocks[ub].tid],
+                                            start_c, end_c, order, fwidth[uf], reg);
+                _bam_fetch_regions(fin, fidx, reg, nreg, &gs, _addValidHitToGenes);
+            } else if(fin != 0 && fidx != 0 && tidmap[uf * num_levels + blocks[ub].tid] >= 0){
+                sweep.rinfo = &rinfo[uf];
+                sweep.next = blocks[ub].first;
+                sweep.last = blocks[ub].last;
+                sweep.nactive = 0;
+                sweep.fwidth = fwidth[uf];
+                sweep.mates = NULL;
+                if(rinfo[uf].shift == FRAGMENT_SHIFT){
+                    if(mates_ok){
+                        _position_hash_reset(&mates);
+                        sweep.mates = &mates;
+                    } else {
+                        fileError[uf] = 3;
+                        continue;
+                    }
+                }
+                if(is_allelic){
+                    sweep.countR = count_c + (size_t)(3 * uf) * num_regions;
+                    sweep.count = count_c + (size_t)(3 * uf + 1) * num_regions;
+                    sweep.countA = count_c + (size_t)(3 * uf + 2) * num_regions;
+                } else {
+                    sweep.count = count_c + (size_t)(ncpf * uf) * num_regions;
+                    sweep.countMinus = (stranded ? sweep.count + num_regions : NULL);
+                    sweep.countR = NULL;
+                    sweep.countA = NULL;
+                }
+                nreg = _block_fetch_regions(&blocks[ub], tidmap[uf * num_levels + blocks[ub].tid],
+                                            start_c, end_c, order, fwidth[uf], reg);
+                _bam_fetch_regions(fin, fidx, reg, nreg, &sweep, _addValidHitToActiveRegions);
+                if(sweep.mates != NULL && mates.full){
+                    fileError[uf] = 5;
+                    mates.full = 0;
+                }
+            }
+            if(rinfo[uf].filter.dedup && dups.full){
+                fileError[uf] = 6;
+                dups.full = 0;
+            }
+        }
+
+        if(fin != 0)
+            samclose(fin);
+        _bam_cache_release(bce);
+        if(mates_ok)
+            _position_hash_free(&mates);
+        if(dups_ok)
+            _position_hash_free(&dups);
+        xvError[th] = (sweep.xvError != 0 ? sweep.xvError : gs.xvError);
+        xvValue[th] = (sweep.xvError != 0 ? sweep.xvValue : gs.xvValue);
+    }
+
+    // collect errors
+    int err_file = -1, err_type = 0;
+    regionInfoSums err = rinfo[0];
+    for(f = 0; f < num_files && err_type == 0; f++)
+        if(fileError[f] != 0){
+            err_file = f;
+            err_type = fileError[f];
+        }
+    for(t = 0; t < nt && err.xvError == 0; t++){
+        err.xvError = xvError[t];
+        err.xvValue = xvValue[t];
+    }
+
+    // clean up
+    for(f = 0; f < num_files; f++)
+        _sidecar_close(sidecar[f]);
+    R_Free(sidecar);
+    R_Free(tidmap);
+    R_Free(fwidth);
+    R_Free(rinfo);
+    R_Free(keys);
+    R_Free(order);
+    R_Free(blocks);
+    R_Free(strand_c);
+    R_Free(active);
+    R_Free(breg);
+    if(gene_c != 0){
+        R_Free(nodes);
+        R_Free(maxLevel);
+        R_Free(lastHit);
+    }
+    R_Free(xvError);
+    R_Free(xvValue);
+    R_Free(fileError);
+    _mask_free(rmask);
+
+    if(err_type != 0){
+        const char *err_fname = fname[err_file];
+        R_Free(fname);
+        if(err_type == 1)
+            Rf_error("failed to open BAM file: '%s'", err_fname);
+        else if(err_type == 2)
+            Rf_error("failed to open BAM index file: '%s'", err_fname);
+        else if(err_type == 3)
+            Rf_error("failed to allocate memory for fragment counting of BAM file: '%s'", err_fname);
+        else if(err_type == 4)
+            Rf_error("failed to allocate memory for duplicate removal of BAM file: '%s'", err_fname);
+        else if(err_type == 5)
+            Rf_error("too many overlapping fragments for fragment counting of BAM file: '%s'", err_fname);
+        else
+            Rf_error("too many overlapping alignments for duplicate removal of BAM file: '%s'", err_fname);
+    }
+    R_Free(fname);
+    _report_xv_error(&err);
+
+    // set column names for allelic and strand-resolved counts
+    if(is_allelic || stranded){
+        PROTECT(dimnames = allocVector(VECSXP, 2));
+        PROTECT(colnames = allocVector(STRSXP, ncol));
+        for(f = 0; f < num_files; f++){
+            if(is_allelic){
+                SET_STRING_ELT(colnames, 3 * f, mkChar("R"));
+                SET_STRING_ELT(colnames, 3 * f + 1, mkChar("U"));
+                SET_STRING_ELT(colnames, 3 * f + 2, mkChar("A"));
+            } else {
+                SET_STRING_ELT(colnames, 2 * f, mkChar("+"));
+                SET_STRING_ELT(colnames, 2 * f + 1, mkChar("-"));
+            }
+        }
+        SET_VECTOR_ELT(dimnames, 1, colnames);
+        setAttrib(count, R_DimNamesSymbol, dimnames);
+        UNPROTECT(2);
+    }
+
+    UNPROTECT(1);
+
+    return count;
+}
+
+
+/*! @function
+  @abstract  Counts the alignments in regions for multiple bamfiles using the sorted sweep engine, and returns
+             the complete count matrix (regions x bamfiles, or regions x 3*bamfiles for allelic counting).
+             See _count_alignments_multiple for the parameters.
+  @return               Matrix of the alignment counts (same row order as the regions)
+ */
+SEXP count_alignments_multiple(SEXP bamfiles, SEXP seqlevel, SEXP seqlevels, SEXP start, SEXP end, SEXP strand,
+                               SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
+                               SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP allelic,
+                               SEXP nthreads, SEXP mask){
+    return _count_alignments_multiple(bamfiles, seqlevel, seqlevels, start, end, strand, selectReadPosition,
+                                      readBitMask, shift, broaden, includeSpliced, mapqMin, mapqMax, absIsizeMin,
+                                      absIsizeMax, allelic, nthreads, R_NilValue, 0, mask);
+}
+
+
+/*! @function
+  @abstract  Counts the alignments in genes (groups of regions, e.g. exons) for multiple bamfiles, and returns the
+             complete count matrix (genes x bamfiles, or genes x 3*bamfiles for allelic counting). The regions of
+             each fetch block are indexed as an interval tree, and each alignment is counted at most once per gene,
+             even if its position is contained in several regions of the gene.
+             See _count_alignments_multiple for the other parameters.
+  @param  gene                gene of the regions (0-based); the result has max(gene)+1 rows
+  @return               Matrix of the alignment counts (one row per gene)
+ */
+SEXP count_alignments_by_gene(SEXP bamfiles, SEXP seqlevel, SEXP seqlevels, SEXP start, SEXP end, SEXP strand,
+                              SEXP gene, SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden,
+                              SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
+                              SEXP allelic, SEXP nthreads, SEXP mask){
+    return _count_alignments_multiple(bamfiles, seqlevel, seqlevels, start, end, strand, selectReadPosition,
+                                      readBitMask, shift, broaden, includeSpliced, mapqMin, mapqMax, absIsizeMin,
+                                      absIsizeMax, allelic, nthreads, gene, 0, mask);
+}
+
+
+/*! @function
+  @abstract  Counts the plus and minus strand alignments in regions or genes separately for multiple bamfiles, and
+             returns the complete count matrix (regions/genes x 2*bamfiles, columns "+" and "-" for each bamfile).
+             The counts for the orientations of qCount are derived from the two columns of a bamfile (see
+             count_alignments_stranded). See _count_alignments_multiple for the other parameters.
+  @param  gene                gene of the regions (0-based), or R_NilValue to count regions
+  @return               Matrix of the alignment counts (same row order as the regions, or one row per gene)
+ */
+SEXP count_alignments_multiple_stranded(SEXP bamfiles, SEXP seqlevel, SEXP seqlevels, SEXP start, SEXP end,
+                                        SEXP gene, SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden,
+                                        SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin,
+                                        SEXP absIsizeMax, SEXP nthreads, SEXP mask){
+    int i, num_regions = Rf_length(seqlevel);
+    SEXP strand, allelic, count;
+
+    // unstranded regions, non-allelic
+    PROTECT(strand = allocVector(STRSXP, num_regions));
+    for(i = 0; i < num_regions; i++)
+        SET_STRING_ELT(strand, i, mkChar("*"));
+    PROTECT(allelic = Rf_ScalarLogical(0));
+
+    count = _count_alignments_multiple(bamfiles, seqlevel, seqlevels, start, end, strand, selectReadPosition,
+                                       readBitMask, shift, broaden, includeSpliced, mapqMin, mapqMax, absIsizeMin,
+                                       absIsizeMax, allelic, nthreads, gene, 1, mask);
+    UNPROTECT(2);
+
+    return count;
+}
+
+
+/*! @typedef
+  @abstract Structure to provide the data to the bam_fetch() function of fixed-window binning.
+  @field rinfo        regionInfoSums with the alignment filter, shift and selectReadPosition parameters
+  @field count        alignment counts of the bins of the current target
+  @field len          length of the current target
+  @field binSize      size of the bins (the last bin of a target may be shorter)
+  @field mates        mates of fragments that have already been counted (fragment counting), or NULL
+  @field dups         alignments of the current target (duplicate removal, see _dedup_pass), or NULL
+*/
+typedef struct {
+    const regionInfoSums *rinfo;
+    int *count;
+    int len;
+    int binSize;
+    positionHash *mates;
+    positionHash *dups;
+} binSweep;
+
+
+/*! @function
+  @abstract  callback for bam_fetch() of fixed-window binning; adds an alignment to the bin that contains
+             its shifted biological start/end position
+  @param  hit   the alignment
+  @param  data  user provided data (binSweep)
+  @return       0 if successful
+ */
+static int _addValidHitToBins(const bam1_t *hit, void *data){
+    binSweep *bs = (binSweep*)data;
+    int pos, hitPlus;
+
+    // skip alignment if it does not pass the region-independent filters
+    if(!_filter_pass(&bs->rinfo->filter, hit))
+        return 0;
+
+    if(bs->mates != NULL){
+        if(!_fragment_anchor(hit, bs->mates, bs->dups, &pos, &hitPlus))
+            return 0;
+    } else {
+        if(!_dedup_pass(bs->dups, hit))
+            return 0;
+        pos = _anchorPosition(hit, bs->rinfo);
+    }
+    if(pos >= 0 && pos < bs->len)
+        bs->count[pos / bs->binSize] += 1;
+
+    return 0;
+}
+
+
+/*! @function
+  @abstract  Counts the alignments in fixed-size bins that tile each target of a bamfile, without a region
+             vector. Each target is read in a single sequential bam_fetch(), and the targets are distributed
+             over nthreads threads, each with its own file handle but a shared bam index. If there is a count
+             sidecar for the counting parameters, the bins are counted from the sidecar instead.
+  @param  bamfile             Name of the bamfile
+  @param  binSize             size of the bins
+  @param  selectReadPosition  alignment ancored at start/end
+  @param  readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments
+  @param  shift               shift size
+  @param  includeSpliced      also count spliced alignments
+  @param  mapqMin             minimal mapping quality to count alignment (MAPQ >= mapqMin)
+  @param  mapqMax             maximum mapping quality to count alignment (MAPQ <= mapqMax)
+  @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
+  @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
+  @param  nthreads            number of threads used to process the targets in parallel
+  @return               List with one integer vector of bin counts per target (named by the targets)
+ */
+SEXP count_alignments_bins(SEXP bamfile, SEXP binSize, SEXP selectReadPosition, SEXP readBitMask, SEXP shift,
+                           SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
+                           SEXP nthreads){
+
+    // check parameters
+    SEXP noregion, nostrand, broaden;
+    PROTECT(noregion = allocVector(INTSXP, 0));
+    PROTECT(nostrand = allocVector(STRSXP, 0));
+    PROTECT(broaden = Rf_ScalarInteger(0));
+    _verify_parameters(bamfile, noregion, noregion, noregion, nostrand, selectReadPosition, readBitMask, shift,
+                       broaden, includeSpliced, mapqMin, mapqMax, absIsizeMin, absIsizeMax, nthreads);
+    UNPROTECT(3);
+    if(!Rf_isInteger(binSize) || Rf_length(binSize) != 1 || INTEGER(binSize)[0] < 1)
+        Rf_error("'binSize' must be of type integer(1) and have a value greater than zero");
+    int bsize = INTEGER(binSize)[0];
+
+    // initialise regionInfoSums
+    regionInfoSums rinfo;
+    _init_region_info(&rinfo, selectReadPosition, readBitMask, shift, includeSpliced,
+                      mapqMin, mapqMax, absIsizeMin, absIsizeMax, 0);
+
+    // open one bam file handle per thread and get the shared bam index and header from the cache, before
+    // allocating anything that would leak if the bam file cannot be opened
+    const char *fname = Rf_translateChar(STRING_ELT(bamfile, 0));
+    bamCacheEntry *bce = 0;
+    int nt = _get_nthreads(nthreads, INT_MAX);
+    samfile_t **fin = _bam_open_handles(fname, nt, &bce);
+    bam_index_t *idx = bce->idx;
+    int t, b, n_targets = fin[0]->header->n_targets;
+
+    // use at most one thread per target (none if the bins are counted from the count sidecar), and close the
+    // surplus handles
+    countSidecar *sc = _open_count_sidecar(fname, &rinfo, readBitMask, includeSpliced,
+                                           mapqMin, mapqMax, absIsizeMin, absIsizeMax);
+    for(t = (sc != NULL ? 1 : _get_nthreads(nthreads, n_targets)); t < nt; t++)
+        samclose(fin[t]);
+    nt = (sc != NULL ? 1 : _get_nthreads(nthreads, n_targets));
+
+    // allocate the bin counts of each target (from the bam header)
+    SEXP count, names;
+    PROTECT(count = allocVector(VECSXP, n_targets));
+    PROTECT(names = allocVector(STRSXP, n_targets));
+    int **count_c = (int**) R_Calloc(n_targets > 0 ? n_targets : 1, int*);
+    int *len = (int*) R_Calloc(n_targets > 0 ? n_targets : 1, int);
+    for(t = 0; t < n_targets; t++){
+        len[t] = (int)fin[0]->header->target_len[t];
+        SET_VECTOR_ELT(count, t, allocVector(INTSXP, (len[t] + bsize - 1) / bsize));
+        SET_STRING_ELT(names, t, mkChar(fin[0]->header->target_name[t]));
+        count_c[t] = INTEGER(VECTOR_ELT(count, t));
+        for(b = 0; b < Rf_length(VECTOR_ELT(count, t)); b++)
+            count_c[t][b] = 0;
+    }
+    setAttrib(count, R_NamesSymbol, names);
+
+    // count bins from the count sidecar if available (prefix sums over the anchor positions)
+    if(sc != NULL){
+        for(t = 0; t < n_targets; t++)
+            for(b = 0; b < Rf_length(VECTOR_ELT(count, t)); b++)
+                count_c[t][b] = _sidecar_count(sc, t, b * bsize,
+                                               (len[t] - b * bsize > bsize) ? (b + 1) * bsize : len[t], '*');
+        _sidecar_close(sc);
+        _bam_close_handles(fin, nt, bce);
+        R_Free(count_c);
+        R_Free(len);
+        UNPROTECT(2);
+        return count;
+    }
+
+    // allocate one mate hash per thread for fragment counting, and one hash per thread for duplicate removal
+    int hash_failed = 0, mates_full = 0, dups_full = 0;
+    positionHash *mates = 0, *dups = 0;
+    if(rinfo.shift == FRAGMENT_SHIFT){
+        mates = (positionHash*) R_Calloc(nt, positionHash);
+        for(t = 0; t < nt; t++)
+            hash_failed |= _position_hash_init(&mates[t]);
+    }
+    if(rinfo.filter.dedup){
+        dups = (positionHash*) R_Calloc(nt, positionHash);
+        for(t = 0; t < nt; t++)
+            hash_failed |= 2 * _position_hash_init(&dups[t]);
+    }
+
+    // loop over targets (a target is read by a single thread, so that fragments and duplicates are recognized
+    // across the whole target)
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nt) schedule(dynamic, 1)
+#endif
+    for(t = 0; t < (hash_failed ? 0 : n_targets); t++){
+        binSweep bs;
+        bs.rinfo = &rinfo;
+        bs.count = count_c[t];
+        bs.len = len[t];
+        bs.binSize = bsize;
+        bs.mates = NULL;
+        bs.dups = NULL;
+        if(mates != 0){
+            bs.mates = &mates[_thread_num()];
+            _position_hash_reset(bs.mates);
+        }
+        if(dups != 0){
+            bs.dups = &dups[_thread_num()];
+            _position_hash_reset(bs.dups);
+        }
+        bam_fetch(fin[_thread_num()]->x.bam, idx, t, 0, len[t], &bs, _addValidHitToBins);
+    }
+
+    // clean up
+    _bam_close_handles(fin, nt, bce);
+    if(mates != 0){
+        for(t = 0; t < nt; t++){
+            mates_full |= mates[t].full;
+            _position_hash_free(&mates[t]);
+        }
+        R_Free(mates);
+    }
+    if(dups != 0){
+        for(t = 0; t < nt; t++){
+            dups_full |= dups[t].full;
+            _position_hash_free(&dups[t]);
+        }
+        R_Free(dups);
+    }
+    R_Free(count_c);
+    R_Free(len);
+    if(hash_failed & 1)
+        Rf_error("failed to allocate memory for fragment counting");
+    else if(hash_failed)
+        Rf_error("failed to allocate memory for duplicate removal");
+    if(mates_full)
+        Rf_error("too many overlapping fragments for fragment counting");
+    else if(dups_full)
+        Rf_error("too many overlapping alignments for duplicate removal");
+
+    UNPROTECT(2);
+
+    return count;
+}
+
+
+/*! @function
+  @abstract  Creates the count sidecar of a bamfile for a set of counting parameters: reads all alignments once,
+             and stores the anchor positions of those that pass the filters, separately for each target and
+             strand. Subsequent non-allelic region counts with the same parameters (count_alignments_non_allelic,
+             count_alignments_non_allelic_sweep, count_alignments_multiple, count_alignments_bins) are answered from
+             the sidecar.
+             The bamfile has to be sorted by coordinate.
+  @param  bamfile             Name of the bamfile
+  @param  selectReadPosition  alignment ancored at start/end
+  @param  readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments
+  @param  shift               shift size (smart shift is not supported)
+  @param  includeSpliced      also count spliced alignments
+  @param  mapqMin             minimal mapping quality to count alignment (MAPQ >= mapqMin)
+  @param  mapqMax             maximum mapping quality to count alignment (MAPQ <= mapqMax)
+  @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
+  @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
+  @return               Name of the count sidecar file
+ */
+SEXP count_sidecar_create(SEXP bamfile, SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP includeSpliced,
+                          SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax){
+
+    // check parameters
+    SEXP noregion, nostrand, broaden, nthreads;
+    PROTECT(noregion = allocVector(INTSXP, 0));
+    PROTECT(nostrand = allocVector(STRSXP, 0));
+    PROTECT(broaden = Rf_ScalarInteger(0));
+    PROTECT(nthreads = Rf_ScalarInteger(1));
+    _verify_parameters(bamfile, noregion, noregion, noregion, nostrand, selectReadPosition, readBitMask, shift,
+                       broaden, includeSpliced, mapqMin, mapqMax, absIsizeMin, absIsizeMax, nthreads);
+    UNPROTECT(4);
+    if(INTEGER(shift)[0] == SMART_SHIFT)
+        Rf_error("count sidecars do not support 'shift=\"halfInsert\"'");
+    if(INTEGER(shift)[0] == FRAGMENT_SHIFT)
+        Rf_error("count sidecars do not support 'shift=\"fragment\"'");
+
+    // initialise regionInfoSums and sidecar parameters
+    regionInfoSums rinfo;
+    sidecarKey key;
+    _init_region_info(&rinfo, selectReadPosition, readBitMask, shift, includeSpliced,
+                      mapqMin, mapqMax, absIsizeMin, absIsizeMax, 0);
+    _sidecar_key_init(&key, rinfo.shift, rinfo.selectReadPosition, INTEGER(readBitMask)[0],
+                      INTEGER(mapqMin)[0], INTEGER(mapqMax)[0], INTEGER(absIsizeMin)[0], INTEGER(absIsizeMax)[0],
+                      Rf_asLogical(includeSpliced));
+
+    // open bam file and sidecar
+    const char *fname = Rf_translateChar(STRING_ELT(bamfile, 0));
+    samfile_t *fin = _bam_tryopen(fname, "rb", NULL);
+    sidecarWriter *w = _sidecar_writer_open(fname, &key, fin->header->n_targets);
+    if(w == NULL){
+        samclose(fin);
+        Rf_error("failed to create count sidecar of BAM file: '%s'", fname);
+    }
+
+    // hash of the alignments of the current target for duplicate removal
+    positionHash dupsHash, *dups = NULL;
+    if(rinfo.filter.dedup){
+        if(_position_hash_init(&dupsHash) != 0){
+            _sidecar_writer_close(w, 0);
+            samclose(fin);
+            Rf_error("failed to allocate memory for duplicate removal");
+        }
+        dups = &dupsHash;
+    }
+
+    // collect the anchor positions of each target (plus and minus strand) and add them to the sidecar
+    // (the anchor buffers are allocated with calloc/realloc, so that an allocation failure does not leave
+    // the temporary sidecar file, the bam file and the hash behind)
+    bam1_t *hit = bam_init1();
+    int64_t n[2] = {0, 0}, cap[2] = {1024, 1024};
+    int32_t *anchors[2], *tmp;
+    anchors[0] = (int32_t*) calloc(cap[0], sizeof(int32_t));
+    anchors[1] = (int32_t*) calloc(cap[1], sizeof(int32_t));
+    int s, tid = -1, pos = -1, err = 0;
+    if(anchors[0] == NULL || anchors[1] == NULL)
+        err = 4;
+    while(err == 0 && samread(fin, hit) >= 0 && hit->core.tid >= 0){
+        if(hit->core.tid != tid){
+            if(hit->core.tid < tid){
+                err = 1;
+                break;
+            }
+            for(s = 0; s < 2 && err == 0; s++)
+                if(_sidecar_writer_add(w, tid, s, anchors[s], n[s]) != 0)
+                    err = 2;
+            n[0] = n[1] = 0;
+            tid = hit->core.tid;
+            pos = -1;
+            if(dups != NULL)
+                _position_hash_reset(dups);
+        } else if(hit->core.pos < pos){
+            err = 1;
+        }
+        if(err != 0)
+            break;
+        pos = hit->core.pos;
+        if(!_filter_pass(&rinfo.filter, hit) || !_dedup_pass(dups, hit))
+            continue;
+        if(dups != NULL && dups->full){
+            err = 3;
+            break;
+        }
+        s = ((hit->core.flag & BAM_FREVERSE) ? 1 : 0);
+        if(n[s] == cap[s]){
+            if((tmp = (int32_t*) realloc(anchors[s], (size_t)(2 * cap[s]) * sizeof(int32_t))) == NULL){
+                err = 4;
+                break;
+            }
+            anchors[s] = tmp;
+            cap[s] *= 2;
+        }
+        anchors[s][n[s]++] = _anchorPosition(hit, &rinfo);
+    }
+    for(s = 0; s < 2 && err == 0; s++)
+        if(_sidecar_writer_add(w, tid, s, anchors[s], n[s]) != 0)
+            err = 2;
+
+    // clean up
+    bam_destroy1(hit);
+    samclose(fin);
+    if(dups != NULL)
+        _position_hash_free(dups);
+    free(anchors[0]);
+    free(anchors[1]);
+    if(_sidecar_writer_close(w, (err == 0)) != 0 && err == 0)
+        err = 2;
+    if(err == 1)
+        Rf_error("BAM file is not sorted by coordinate: '%s'", fname);
+    else if(err == 2)
+        Rf_error("failed to write count sidecar of BAM file: '%s'", fname);
+    else if(err == 3)
+        Rf_error("too many overlapping alignments for duplicate removal of BAM file: '%s'", fname);
+    else if(err == 4)
+        Rf_error("failed to allocate memory for count sidecar of BAM file: '%s'", fname);
+
+    char *path = _sidecar_path(fname, &key);
+    if(path == NULL)
+        Rf_error("failed to allocate memory for count sidecar of BAM file: '%s'", fname);
+    SEXP res;
+    PROTECT(res = Rf_mkString(path));
+    free(path);
+    UNPROTECT(1);
+
+    return res;
+}
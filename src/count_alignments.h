@@ -3,12 +3,47 @@
 #include <Rdefines.h>
 #include "htslib/sam.h"
 #include "utilities.h"
+#include "count_sidecar.h"
 
 SEXP count_alignments_non_allelic(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand, 
                       SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
-                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax);
+                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads);
 
 SEXP count_alignments_allelic(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand, 
                       SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
-                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax);
+                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads);
+
+
+SEXP count_alignments_non_allelic_sweep(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand,
+                      SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
+                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads);
+
+SEXP count_alignments_stranded(SEXP bamfile, SEXP tid, SEXP start, SEXP end,
+                      SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
+                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads);
 
+SEXP count_alignments_parameter_sweep(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP strand,
+                      SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
+                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP nthreads);
+
+SEXP count_alignments_multiple(SEXP bamfiles, SEXP seqlevel, SEXP seqlevels, SEXP start, SEXP end, SEXP strand,
+                      SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden, SEXP includeSpliced,
+                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax, SEXP allelic, SEXP nthreads,
+                      SEXP mask);
+
+SEXP count_alignments_by_gene(SEXP bamfiles, SEXP seqlevel, SEXP seqlevels, SEXP start, SEXP end, SEXP strand,
+                      SEXP gene, SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden,
+                      SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
+                      SEXP allelic, SEXP nthreads, SEXP mask);
+
+SEXP count_alignments_multiple_stranded(SEXP bamfiles, SEXP seqlevel, SEXP seqlevels, SEXP start, SEXP end,
+                      SEXP gene, SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP broaden,
+                      SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
+                      SEXP nthreads, SEXP mask);
+
+SEXP count_alignments_bins(SEXP bamfile, SEXP binSize, SEXP selectReadPosition, SEXP readBitMask, SEXP shift,
+                      SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
+                      SEXP nthreads);
+
+SEXP count_sidecar_create(SEXP bamfile, SEXP selectReadPosition, SEXP readBitMask, SEXP shift, SEXP includeSpliced,
+                      SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax);
@@ -1,57 +1,125 @@
 #include "count_junctions.h"
-//#include <sstream>
+#include "junction_hash.h"
 #include <string>
+#include <climits>
+#include <cstdio>
+#include <exception>
+#include <new>
 #include <map>
-#include <set>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
+#define XV_MISSING 1         // XV tag missing in an alignment (allelic counting)
+#define XV_INVALID 2         // invalid value of the XV tag in an alignment (allelic counting)
+
+/*! @typedef
+  @abstract Annotated junctions (known introns) and gene loci, used to count only annotated junctions and to
+            aggregate all other junctions by the gene locus that contains them. The annotation sequences are
+            identified by their index in the sequence levels of the annotation.
+  @field known        hash of the known introns (keys with the annotation sequence and strand 0)
+  @field nknown       number of known introns (rows 0 to nknown-1 of the counts)
+  @field seqmap       annotation sequence by target identifier of the current bamfile (-1 if not annotated)
+  @field loffset      loci of annotation sequence s are loffset[s] to loffset[s+1]-1 (sorted by start)
+  @field lstart       locus start (first base, 1-based)
+  @field lend         locus end (last base, 1-based)
+  @field lmaxend      maximal end of the loci of the same sequence up to the locus
+  @field lrow         row of the locus in the counts (nknown + index of the locus)
+ */
+typedef struct {
+    junctionHash known;
+    int nknown;
+    vector<int> seqmap;
+    vector<int> loffset;
+    vector<int> lstart;
+    vector<int> lend;
+    vector<int> lmaxend;
+    vector<int> lrow;
+} junctionAnnotation;
+
+
 /*! @typedef
-  @abstract Structure to provide the data to the bam_fetch() function
-  @field junctionsU   map<string,int> with junction counts (non-allelic or allelic Unknown)
-                      key of the form "chromosome:first_intronic_base:last_intronic_base:strand"
-  @field junctionsR   map<string,int> with junction counts (allelic Reference)
-  @field junctionsA   map<string,int> with junction counts (allelic Alternative)
-  @field tname        target name string
+  @abstract Structure to provide the data to the bam_fetch() callback function
+  @field junctions    hash of the observed junctions (junction indices)
+  @field counts       junction counts by junction index, with one (non-allelic) or three (allelic R, U and A)
+                      counts per junction (or by row of the annotation if annot is not NULL)
+  @field annot        count only annotated junctions and gene loci (see junctionAnnotation), or NULL
   @field allelic      allelic true(1) or false(0)
-  @field skipSecondary  ignore secondary alignments true(1) or false(0)
-  @field mapqMin      minimum mapping quality (MAPQ >= mapqMin)
-  @field mapqMax      maximum mapping quality (MAPQ <= mapqMax)
+  @field filter       compiled alignment filter (secondary alignments and MAPQ range)
+  @field failed       true(1) if a junction could not be stored (out of memory)
+  @field xvError      XV_MISSING or XV_INVALID if an alignment without a valid XV tag was encountered
+                      (allelic), 0 otherwise
+  @field xvValue      the invalid XV tag value (for xvError == XV_INVALID)
  */
 typedef struct {
-    map<string,int> junctionsU;
-    map<string,int> junctionsR;
-    map<string,int> junctionsA;
-    char* tname;
+    junctionHash junctions;
+    vector<int> counts;
+    const junctionAnnotation *annot;
     int allelic;
-    int skipSecondary;
-    uint8_t mapqMin;
-    uint8_t mapqMax;
+    alignmentFilter filter;
+    int failed;
+    int xvError;
+    char xvValue;
 } fetch_param;
 
 
 /*! @function
-  @abstract  callback for bam_fetch(); sums alignments if correct strand and shifted biological start/end position overlap fetch region
+  @abstract  get the row of a junction in the counts of annotated junctions: the known intron with identical
+             coordinates (on either strand), or else the gene locus with the largest start that contains the
+             junction
+  @param  annot  the annotation
+  @param  tid    target identifier of the junction
+  @param  first  first intronic base (1-based)
+  @param  last   last intronic base (1-based)
+  @return        row of the junction, or -1 if it is neither annotated nor contained in a gene locus
+ */
+static int _annotatedJunctionRow(const junctionAnnotation *annot, int tid, int first, int last){
+    if(tid < 0 || tid >= (int)annot->seqmap.size() || annot->seqmap[tid] < 0)
+	return -1;
+    int s = annot->seqmap[tid];
+
+    // known intron
+    int k = _junction_hash_find(&annot->known, _junction_key(s, first, last, 0));
+    if(k >= 0)
+	return k;
+
+    // gene locus: last locus with start <= first, then move to loci with smaller start while they may still
+    // reach last
+    int lo = annot->loffset[s], hi = annot->loffset[s + 1], mid, a = lo;
+    while(lo < hi){
+	mid = lo + (hi - lo) / 2;
+	if(annot->lstart[mid] <= first)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    for(int i = lo - 1; i >= a && annot->lmaxend[i] >= last; i--)
+	if(annot->lend[i] >= last)
+	    return annot->lrow[i];
+
+    return -1;
+}
+
+
+/*! @function
+  @abstract  callback for bam_fetch(); counts the junctions (skipped reference regions) of an alignment.
+             Does not call the R API or throw exceptions (errors are recorded in the fetch_param) and can be used
+             from worker threads.
   @param  hit   the alignment
   @param  data  user provided data
   @return       0 if successful
  */
 static int _addJunction(const bam1_t *hit, void *data){
-    static uint8_t *xv_ptr = 0;
     fetch_param *jinfo = (fetch_param*)data;
 
-    // skip alignment if mapping quality not in specified range
-    if(hit->core.qual < jinfo->mapqMin || hit->core.qual > jinfo->mapqMax)
+    // skip all alignments after a failure
+    if(jinfo->failed)
         return 0;
 
-    // skip alignment if secondary and skipSecondary==true
-    if((hit->core.flag & BAM_FSECONDARY) && jinfo->skipSecondary)
+    // skip alignment if secondary (and not included) or mapping quality not in specified range
+    if(!_filter_pass(&jinfo->filter, hit))
         return 0;
-    
-    //ostringstream ss;
-    //static string jid; // junction identifier, of the form "chromosome:first_intronic_base:last_intronic_base:strand"
-    static char strbuffer[1024];
-    static map<string,int>::iterator it;
 
     uint32_t *cigar = bam1_cigar(hit);
     unsigned int i = 0; // current position of cigar operations
@@ -59,32 +127,38 @@ static int _addJunction(const bam1_t *hit, void *data){
     int x; // leftmost coordinate of the current cigar operation in reference string
     int y; // leftmost coordinate of the current cigar operation in read
     int op; // current cigar operation type
+    int j; // junction index
 
-    // get pointer to junctions counter
-    static map<string,int> *junctions = NULL;
-    if(jinfo->allelic==0) {
-	junctions = &(jinfo->junctionsU);
-
-    } else {
+    // get count column (0 for non-allelic and R, U, A as 0, 1, 2 for allelic)
+    int col = 0, ncol = 1;
+    if(jinfo->allelic != 0) {
 	// get XV tag
-	xv_ptr = bam_aux_get(hit,"XV");
-	if(xv_ptr == 0)
-	    Rf_error("XV tag missing but needed for allele-specific counting");
+	uint8_t *xv_ptr = bam_aux_get(hit,"XV");
+	if(xv_ptr == 0) {
+	    if(jinfo->xvError == 0)
+		jinfo->xvError = XV_MISSING;
+	    return 0;
+	}
+	ncol = 3;
 	switch(bam_aux2A(xv_ptr)){
-	case 'U':
-	    junctions = &(jinfo->junctionsU);
-	    break;
 	case 'R':
-	    junctions = &(jinfo->junctionsR);
+	    col = 0;
+	    break;
+	case 'U':
+	    col = 1;
 	    break;
 	case 'A':
-	    junctions = &(jinfo->junctionsA);
+	    col = 2;
 	    break;
 	default:
-	    Rf_error("'%c' is not a valid XV tag value; should be one of 'U','R' or 'A'", bam_aux2A(xv_ptr));
+	    if(jinfo->xvError == 0) {
+		jinfo->xvError = XV_INVALID;
+		jinfo->xvValue = bam_aux2A(xv_ptr);
+	    }
+	    return 0;
 	}
     }
-    
+
     // loop over cigar operations
     x = hit->core.pos;
     for (i = y = 0; i < hit->core.n_cigar; ++i) {
@@ -95,18 +169,30 @@ static int _addJunction(const bam1_t *hit, void *data){
 	    // aligned bases -> increase read and reference coordinates
 	    x += l; y += l;
 
+	} else if (op == BAM_CREF_SKIP && jinfo->annot != NULL) { // N skipped region, annotated junctions only
+	    // count annotated junction or gene locus, and increase reference coordinate
+	    j = _annotatedJunctionRow(jinfo->annot, hit->core.tid, x+1, x+l);
+	    if(j >= 0)
+		jinfo->counts[(size_t)j * ncol + col]++;
+	    x += l;
+
 	} else if (op == BAM_CREF_SKIP) { // N skipped region spliced alignment
-	    // read skips reference region -> store junction and increase reference coordinate
-	    snprintf(strbuffer, 1024, "%s:%i:%i:%c", jinfo->tname, x+1, x+l, hit->core.flag & BAM_FREVERSE ? '-' : '+');
-	    //ss << jinfo->tname << ":" << (x+1) << ":" << (x+l) << ":" << (hit->core.flag & BAM_FREVERSE ? "-" : "+");
-	    //jid = ss.str();
-	    string jid(strbuffer);
-	    it = junctions->find(jid);
-	    if(it == junctions->end()) {
-		junctions->insert(pair<string,int>(jid, 1));
-	    } else {
-		it->second++;
+	    // read skips reference region -> count junction and increase reference coordinate
+	    j = _junction_hash_index(&jinfo->junctions,
+	                             _junction_key(hit->core.tid, x+1, x+l, (hit->core.flag & BAM_FREVERSE) ? 1 : 0));
+	    if(j < 0) {
+		jinfo->failed = 1;
+		return 0;
+	    }
+	    if((size_t)j * ncol >= jinfo->counts.size()) {
+		try {
+		    jinfo->counts.resize(((size_t)j + 1) * ncol, 0);
+		} catch(std::bad_alloc &e) {
+		    jinfo->failed = 1;
+		    return 0;
+		}
 	    }
+	    jinfo->counts[(size_t)j * ncol + col]++;
 	    x += l;
 
 	} else if (op == BAM_CDEL) { // deletion from the reference
@@ -123,157 +209,679 @@ static int _addJunction(const bam1_t *hit, void *data){
 }
 
 
+/*! @typedef
+  @abstract Reference to a junction of one of several junction tables, used to merge the junction tables.
+  @field key    the junction
+  @field t      junction table
+  @field j      junction index in the junction table
+ */
+typedef struct {
+    junctionKey key;
+    int t;
+    int j;
+} junctionRef;
+
+
+/*! @function
+  @abstract  merge junction tables into a list with one element per column, sorted by target, first and last
+             intronic base and strand (the order of the packed junction keys); junctions present in more than
+             one table are combined
+  @param  tables     the junction tables (hashes of the junctions)
+  @param  counts     the counts of the junction tables, with width counts per junction
+  @param  width      number of counts per junction
+  @param  levels     names of the targets (the target identifiers of the junction keys are 0-based indices)
+  @param  countnames names of the count columns (character vector of length width), or R_NilValue to return
+                     the counts as a single matrix
+  @return        list with elements "seqnames" (factor with levels as levels), "start" (first intronic
+                 base), "end" (last intronic base), "strand" ("+" or "-"), followed by one integer vector per
+                 count column, or by an integer matrix "counts" with width columns
+ */
+static SEXP _junctionTable(const vector<const junctionHash*> &tables, const vector<const vector<int>*> &counts,
+                           int width, SEXP levels, SEXP countnames){
+    // sort references to all junctions by their key
+    vector<junctionRef> refs;
+    size_t nref = 0;
+    for(size_t t = 0; t < tables.size(); t++)
+	nref += (size_t)tables[t]->n;
+    refs.reserve(nref);
+    for(size_t t = 0; t < tables.size(); t++)
+	for(int j = 0; j < tables[t]->n; j++) {
+	    junctionRef r = {tables[t]->keys[j], (int)t, j};
+	    refs.push_back(r);
+	}
+    sort(refs.begin(), refs.end(), [](const junctionRef &a, const junctionRef &b) {
+	return a.key.hi < b.key.hi || (a.key.hi == b.key.hi && a.key.lo < b.key.lo);
+    });
+    R_xlen_t n = 0, i = -1;
+    for(size_t k = 0; k < refs.size(); k++)
+	if(k == 0 || refs[k].key.hi != refs[k-1].key.hi || refs[k].key.lo != refs[k-1].key.lo)
+	    n++;
+
+    // allocate columns
+    SEXP res, resnames, seqnames, jstart, jend, jstrand, plus, minus;
+    int asMatrix = (countnames == R_NilValue);
+    int nres = 4 + (asMatrix ? 1 : width);
+    PROTECT(res = Rf_allocVector(VECSXP, nres));
+    PROTECT(resnames = Rf_allocVector(STRSXP, nres));
+    PROTECT(seqnames = Rf_allocVector(INTSXP, n));
+    PROTECT(jstart = Rf_allocVector(INTSXP, n));
+    PROTECT(jend = Rf_allocVector(INTSXP, n));
+    PROTECT(jstrand = Rf_allocVector(STRSXP, n));
+    PROTECT(plus = Rf_mkChar("+"));
+    PROTECT(minus = Rf_mkChar("-"));
+    SET_VECTOR_ELT(res, 0, seqnames);
+    SET_VECTOR_ELT(res, 1, jstart);
+    SET_VECTOR_ELT(res, 2, jend);
+    SET_VECTOR_ELT(res, 3, jstrand);
+    SET_STRING_ELT(resnames, 0, Rf_mkChar("seqnames"));
+    SET_STRING_ELT(resnames, 1, Rf_mkChar("start"));
+    SET_STRING_ELT(resnames, 2, Rf_mkChar("end"));
+    SET_STRING_ELT(resnames, 3, Rf_mkChar("strand"));
+    vector<int*> count_c(width);
+    if(asMatrix) {
+	SET_VECTOR_ELT(res, 4, Rf_allocMatrix(INTSXP, n, width));
+	SET_STRING_ELT(resnames, 4, Rf_mkChar("counts"));
+	for(int c = 0; c < width; c++)
+	    count_c[c] = INTEGER(VECTOR_ELT(res, 4)) + (size_t)c * n;
+    } else {
+	for(int c = 0; c < width; c++) {
+	    SET_VECTOR_ELT(res, 4 + c, Rf_allocVector(INTSXP, n));
+	    SET_STRING_ELT(resnames, 4 + c, STRING_ELT(countnames, c));
+	    count_c[c] = INTEGER(VECTOR_ELT(res, 4 + c));
+	}
+    }
+    Rf_setAttrib(res, R_NamesSymbol, resnames);
+
+    // seqnames as a factor of all targets
+    Rf_setAttrib(seqnames, R_LevelsSymbol, levels);
+    Rf_setAttrib(seqnames, R_ClassSymbol, Rf_mkString("factor"));
+
+    // fill in columns, combining the counts of identical junctions
+    int *seqnames_c = INTEGER(seqnames), *jstart_c = INTEGER(jstart), *jend_c = INTEGER(jend);
+    for(size_t k = 0; k < refs.size(); k++) {
+	junctionKey key = refs[k].key;
+	if(k == 0 || key.hi != refs[k-1].key.hi || key.lo != refs[k-1].key.lo) {
+	    i++;
+	    seqnames_c[i] = _junction_key_tid(key) + 1;
+	    jstart_c[i] = _junction_key_first(key);
+	    jend_c[i] = _junction_key_last(key);
+	    SET_STRING_ELT(jstrand, i, _junction_key_minus(key) ? minus : plus);
+	    for(int c = 0; c < width; c++)
+		count_c[c][i] = 0;
+	}
+	const int *cnt = counts[refs[k].t]->data() + (size_t)refs[k].j * width;
+	for(int c = 0; c < width; c++)
+	    count_c[c][i] += cnt[c];
+    }
+
+    UNPROTECT(8);
+
+    return res;
+}
+
+
+/*! @function
+  @abstract  initialise the junction tables of the threads
+  @param  jinfo      the junction tables (one per thread)
+  @param  allelic, includeSecondary, mapqMin, mapqMax    see count_junctions
+  @return            0 if successful
+ */
+static int _init_junction_tables(vector<fetch_param> &jinfo, SEXP allelic, SEXP includeSecondary, SEXP mapqMin,
+                                 SEXP mapqMax){
+    int failed = 0;
+    for(size_t t = 0; t < jinfo.size(); t++) {
+	jinfo[t].annot = NULL;
+	jinfo[t].allelic = Rf_asLogical(allelic) ? 1 : 0;
+	_filter_init(&jinfo[t].filter, BAM_FREAD1 | BAM_FREAD2 | (Rf_asLogical(includeSecondary) ? BAM_FSECONDARY : 0),
+	             INTEGER(mapqMin)[0], INTEGER(mapqMax)[0], NO_ISIZE_FILTER, NO_ISIZE_FILTER, 1);
+	jinfo[t].failed = _junction_hash_init(&jinfo[t].junctions);
+	jinfo[t].xvError = 0;
+	jinfo[t].xvValue = 0;
+	failed |= jinfo[t].failed;
+    }
+    return failed;
+}
+
+
+/*! @function
+  @abstract  count the junctions of the alignments in regions of a bamfile, processing the regions of each target
+             by a single thread (so that alignments overlapping several regions of the target are counted once)
+  @param  fin      bam file handles (one per thread)
+  @param  idx      bam index
+  @param  reg      the regions (will be sorted and coalesced in place)
+  @param  jinfo    the junction tables (one per thread)
+ */
+static void _count_junctions_threads(samfile_t **fin, const bam_index_t *idx, vector<bamRegion> &reg,
+                                     vector<fetch_param> &jinfo){
+    int num_regions = (int)reg.size(), nt = (int)jinfo.size();
+
+    // group the regions by target
+    sort(reg.begin(), reg.end(), [](const bamRegion &a, const bamRegion &b) { return a.tid < b.tid; });
+    vector<int> toff;
+    for(int i = 0; i < num_regions; i++)
+	if(i == 0 || reg[i].tid != reg[i-1].tid)
+	    toff.push_back(i);
+    int num_targets = (int)toff.size();
+    toff.push_back(num_regions);
+
+    // process the alignments of each target with a single multi-region iterator (exceptions must not leave the
+    // parallel region: they are recorded as failures of the thread)
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nt) schedule(dynamic, 1)
+#endif
+    for(int i = 0; i < num_targets; i++) {
+	int t = _thread_num();
+	try {
+	    if(jinfo[t].failed == 0)
+		_bam_fetch_regions(fin[t], idx, reg.data() + toff[i], toff[i + 1] - toff[i], &jinfo[t], _addJunction);
+	} catch(...) {
+	    jinfo[t].failed = 1;
+	}
+    }
+}
+
+
+/*! @function
+  @abstract  get the first error of the junction tables of the threads
+  @param  jinfo      the junction tables (one per thread)
+  @param  xvValue    receives the invalid XV tag value (for XV_INVALID)
+  @return            0 if there was no error, -1 if memory could not be allocated, XV_MISSING or XV_INVALID
+ */
+static int _junction_tables_error(const vector<fetch_param> &jinfo, char *xvValue){
+    for(size_t t = 0; t < jinfo.size(); t++)
+	if(jinfo[t].failed)
+	    return -1;
+    for(size_t t = 0; t < jinfo.size(); t++)
+	if(jinfo[t].xvError != 0) {
+	    *xvValue = jinfo[t].xvValue;
+	    return jinfo[t].xvError;
+	}
+    return 0;
+}
+
+
+/*! @function
+  @abstract  raise an error returned by _junction_tables_error
+ */
+static void _junction_error(int err, char xvValue){
+    if(err == -1)
+	Rf_error("failed to allocate memory for junction counting");
+    else if(err == XV_MISSING)
+	Rf_error("XV tag missing but needed for allele-specific counting");
+    else if(err == XV_INVALID)
+	Rf_error("'%c' is not a valid XV tag value; should be one of 'U','R' or 'A'", xvValue);
+}
+
+
+/*! @function
+  @abstract  check the common parameters of the junction counting functions
+ */
+static void _verify_junction_parameters(SEXP allelic, SEXP includeSecondary, SEXP mapqMin, SEXP mapqMax,
+                                        SEXP nthreads){
+    if(!Rf_isLogical(allelic) || Rf_length(allelic) != 1)
+        Rf_error("'allelic' must be of type logical(1)");
+    if(!Rf_isLogical(includeSecondary) || Rf_length(includeSecondary) != 1)
+        Rf_error("'includeSecondary' must be of type logical(1)");
+    if(!Rf_isInteger(mapqMin) || Rf_length(mapqMin) !=1 || INTEGER(mapqMin)[0] < 0 || INTEGER(mapqMin)[0] > 255)
+        Rf_error("'mapqMin' must be of type integer(1) and have a value between 0 and 255");
+    if(!Rf_isInteger(mapqMax) || Rf_length(mapqMax) !=1 || INTEGER(mapqMax)[0] < 0 || INTEGER(mapqMax)[0] > 255)
+        Rf_error("'mapqMax' must be of type integer(1) and have a value between 0 and 255");
+    if(INTEGER(mapqMin)[0] > INTEGER(mapqMax)[0])
+	Rf_error("'mapqMin' must not be greater than 'mapqMax'");
+    if(!Rf_isInteger(nthreads) || Rf_length(nthreads) != 1 || INTEGER(nthreads)[0] < 1)
+        Rf_error("'nthreads' must be of type integer(1) and have a value greater than zero");
+}
+
+
 /*! @function
-  @abstract  enumerates and counts all introns (alignment-insertions) observed in a bam file
+  @abstract  enumerates and counts all introns (alignment-insertions) observed in a bam file. The regions of each
+             target are processed by a single thread with its own file handle and junction table, and the
+             junction tables of the threads are merged at the end.
   @param   bamfile   Name of the bamfile
   @param   tid       integer vector of target identifiers
   @param   start     integer vector of target region start coordinates
-  @param   end       integer vector of target region end coordinates
+  @param   end       integer vector of target region end coordinates (overlapping regions are merged,
+                     each alignment is counted at most once)
   @param   allelic   logical(1) to indicate allelic/non-allelic counting
   @param   mapqMin   minimal mapping quality to count alignment (MAPQ >= mapqMin)
   @param   mapqMax   maximum mapping quality to count alignment (MAPQ <= mapqMax)
-  @return            allelic==FALSE: named vector of the junctions counts (names of the form "chromosome:first_intronic_base:last_intronic_base:strand")
-                     allelic==TRUE: list of length 4 (names, R, U and A junction counts)
+  @param   nthreads  number of threads used to process the targets in parallel
+  @return            list with one element per column, see _junctionTable
  */
-SEXP count_junctions(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP allelic, SEXP includeSecondary, SEXP mapqMin, SEXP mapqMax) {
+static SEXP _count_junctions(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP allelic, SEXP includeSecondary,
+                             SEXP mapqMin, SEXP mapqMax, SEXP nthreads) {
     // check parameters
     if(!Rf_isString(bamfile) || Rf_length(bamfile) != 1)
         Rf_error("'bamfile' must be of type character(1)");
     if(!Rf_isInteger(tid))
         Rf_error("'tid' must be of type integer");
-    if(!Rf_isInteger(start))
-        Rf_error("'start' must be of type integer");
-    if(!Rf_isInteger(end))
-        Rf_error("'end' must be of type integer");
-    if(!Rf_isLogical(allelic) || Rf_length(allelic) != 1)
-        Rf_error("'allelic' must be of type logical(1)");
-    if(!Rf_isLogical(includeSecondary) || Rf_length(includeSecondary) != 1)
-        Rf_error("'includeSecondary' must be of type logical(1)");
-    if(!Rf_isInteger(mapqMin) || Rf_length(mapqMin) !=1 || INTEGER(mapqMin)[0] < 0 || INTEGER(mapqMin)[0] > 255)
-        Rf_error("'mapqMin' must be of type integer(1) and have a value between 0 and 255");
-    if(!Rf_isInteger(mapqMax) || Rf_length(mapqMax) !=1 || INTEGER(mapqMax)[0] < 0 || INTEGER(mapqMax)[0] > 255)
-        Rf_error("'mapqMax' must be of type integer(1) and have a value between 0 and 255");
-    if(INTEGER(mapqMin)[0] > INTEGER(mapqMax)[0])
-	Rf_error("'mapqMin' must not be greater than 'mapqMax'");
+    if(!Rf_isInteger(start) || Rf_length(start) != Rf_length(tid))
+        Rf_error("'start' must be of type integer and have the same length as 'tid'");
+    if(!Rf_isInteger(end) || Rf_length(end) != Rf_length(tid))
+        Rf_error("'end' must be of type integer and have the same length as 'tid'");
+    _verify_junction_parameters(allelic, includeSecondary, mapqMin, mapqMax, nthreads);
 
-    // open bam file
-    samfile_t *fin = 0;
-    fin = samopen(Rf_translateChar(STRING_ELT(bamfile, 0)), "rb", NULL);
-    if (fin == 0)
-        Rf_error("failed to open BAM file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (fin->header == 0 || fin->header->n_targets == 0) {
-        samclose(fin);
-        Rf_error("BAM header missing or empty of file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    }
-    // open bam index
-    bam_index_t *idx = 0; 
-    idx = bam_index_load(Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (idx == 0){
-        samclose(fin);
-        Rf_error("failed to open BAM index file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
+    // open one bam file handle per thread (at most one per region) and get the shared bam index from the cache,
+    // before allocating anything that would leak if the bam file cannot be opened
+    int num_regions = Rf_length(tid), nt = _get_nthreads(nthreads, num_regions), err = 0;
+    char xvValue = 0;
+    bamCacheEntry *bce = NULL;
+    samfile_t **fin = _bam_open_handles(Rf_translateChar(STRING_ELT(bamfile, 0)), nt, &bce);
+
+    // count in a block, so that the containers are released before an error is raised
+    SEXP count = R_NilValue;
+    {
+	// regions and the number of targets they are on
+	vector<bamRegion> reg(num_regions);
+	vector<int> tids(INTEGER(tid), INTEGER(tid) + num_regions);
+	for(int i = 0; i < num_regions; i++){
+	    reg[i].tid = INTEGER(tid)[i];
+	    reg[i].beg = INTEGER(start)[i]; // 0-based inclusive start
+	    reg[i].end = INTEGER(end)[i];   // 0-based exclusive end
+	}
+	sort(tids.begin(), tids.end());
+	int num_targets = (int)(unique(tids.begin(), tids.end()) - tids.begin());
+
+	// use at most one thread per target, and close the surplus handles
+	for(int t = _get_nthreads(nthreads, num_targets); t < nt; t++)
+	    samclose(fin[t]);
+	nt = _get_nthreads(nthreads, num_targets);
+
+	// initialise the junction table of each thread, and count
+	vector<fetch_param> jinfo(nt);
+	if(_init_junction_tables(jinfo, allelic, includeSecondary, mapqMin, mapqMax) != 0) {
+	    err = -1;
+	} else {
+	    _count_junctions_threads(fin, bce->idx, reg, jinfo);
+	    err = _junction_tables_error(jinfo, &xvValue);
+	}
+
+	// merge the junction tables
+	if(err == 0) {
+	    vector<const junctionHash*> tables(nt);
+	    vector<const vector<int>*> counts(nt);
+	    for(int t = 0; t < nt; t++) {
+		tables[t] = &jinfo[t].junctions;
+		counts[t] = &jinfo[t].counts;
+	    }
+	    const bam_header_t *header = fin[0]->header;
+	    SEXP levels, countnames;
+	    PROTECT(levels = Rf_allocVector(STRSXP, header->n_targets));
+	    for(int t = 0; t < header->n_targets; t++)
+		SET_STRING_ELT(levels, t, Rf_mkChar(header->target_name[t]));
+	    if(jinfo[0].allelic) {
+		PROTECT(countnames = Rf_allocVector(STRSXP, 3));
+		SET_STRING_ELT(countnames, 0, Rf_mkChar("R"));
+		SET_STRING_ELT(countnames, 1, Rf_mkChar("U"));
+		SET_STRING_ELT(countnames, 2, Rf_mkChar("A"));
+	    } else {
+		PROTECT(countnames = Rf_mkString("count"));
+	    }
+	    count = _junctionTable(tables, counts, Rf_length(countnames), levels, countnames);
+	    UNPROTECT(2);
+	}
+	PROTECT(count);
+
+	for(int t = 0; t < nt; t++)
+	    _junction_hash_free(&jinfo[t].junctions);
     }
 
-    // initialise junction map
-    fetch_param jinfo;
-    if(Rf_asLogical(allelic))
-	jinfo.allelic = 1;
-    else
-	jinfo.allelic = 0;
-    if(Rf_asLogical(includeSecondary))
-	jinfo.skipSecondary = 0;
-    else
-	jinfo.skipSecondary = 1;
-    jinfo.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    jinfo.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
-
-    // select bam_fetch callback function
-    bam_fetch_f fetch_func = _addJunction;
-    
-    // loop over query regions
-    int num_regions = Rf_length(tid);
-    for(int i = 0; i < num_regions; i++){
-	// set tname
-	jinfo.tname = fin->header->target_name[INTEGER(tid)[i]];
-
-        // process alignments that overlap region
-        bam_fetch(fin->x.bam, idx, INTEGER(tid)[i], 
-                  INTEGER(start)[i], // 0-based inclusive start
-                  INTEGER(end)[i],   // 0-based exclusive end
-                  &jinfo, fetch_func);
+    // clean up
+    _bam_close_handles(fin, nt, bce);
+    _junction_error(err, xvValue);
+
+    UNPROTECT(1);
+
+    return count;
+}
+
+
+/*! @function
+  @abstract  enumerates and counts all introns (alignment-insertions) observed in multiple bam files, and returns
+             the complete junction count matrix (junctions x bamfiles). Each bamfile is processed as in
+             count_junctions, and its junction tables are merged into a global junction table, identifying the
+             targets of the bamfiles by their names.
+  @param   bamfiles  Names of the bamfiles
+  @param   allelic   logical(1) to indicate allelic/non-allelic counting
+  @param   mapqMin   minimal mapping quality to count alignment (MAPQ >= mapqMin)
+  @param   mapqMax   maximum mapping quality to count alignment (MAPQ <= mapqMax)
+  @param   nthreads  number of threads used to process the targets of a bamfile in parallel
+  @return            list with elements "seqnames" (factor with the targets of all bamfiles as levels), "start",
+                     "end", "strand" and "counts" (matrix with one column per bamfile, or three columns R, U and
+                     A per bamfile if allelic), see _junctionTable
+ */
+static SEXP _count_junctions_multiple(SEXP bamfiles, SEXP allelic, SEXP includeSecondary, SEXP mapqMin,
+                                      SEXP mapqMax, SEXP nthreads) {
+    // check parameters
+    if(!Rf_isString(bamfiles) || Rf_length(bamfiles) < 1)
+        Rf_error("'bamfiles' must be of type character and have at least one element");
+    _verify_junction_parameters(allelic, includeSecondary, mapqMin, mapqMax, nthreads);
+
+    // count in a block, so that the containers are released before an error is raised; bamfiles that cannot be
+    // opened are reported after the clean up
+    int nfiles = Rf_length(bamfiles), ncol = Rf_asLogical(allelic) ? 3 : 1, width = ncol * nfiles;
+    int err = 0, status = BAM_CACHE_OK;
+    char xvValue = 0;
+    const char *fname = NULL;
+    junctionHash global;
+    if(_junction_hash_init(&global) != 0)
+	Rf_error("failed to allocate memory for junction counting");
+    SEXP count = R_NilValue;
+    {
+	// global junction table, with ncol counts per junction and bamfile
+	vector<int> gcounts;
+	vector<string> gnames;    // target names by global target identifier
+	map<string,int> gtids;    // global target identifiers by target name
+
+	for(int f = 0; f < nfiles && err == 0 && status == BAM_CACHE_OK; f++) {
+	    fname = Rf_translateChar(STRING_ELT(bamfiles, f));
+
+	    // open one bam file handle per thread and get the shared bam index from the cache
+	    bamCacheEntry *bce = NULL;
+	    int nt = _get_nthreads(nthreads, INT_MAX);
+	    samfile_t **fin = _bam_acquire_handles(fname, nt, &bce, &status);
+	    if(fin == NULL)
+		break;
+
+	    // regions (complete targets) and global target identifiers
+	    const bam_header_t *header = fin[0]->header;
+	    int num_targets = header->n_targets;
+	    vector<bamRegion> reg(num_targets);
+	    vector<int> gtid(num_targets);
+	    for(int i = 0; i < num_targets; i++) {
+		reg[i].tid = i;
+		reg[i].beg = 0;
+		reg[i].end = (int)header->target_len[i];
+		map<string,int>::iterator it = gtids.find(header->target_name[i]);
+		if(it == gtids.end()) {
+		    gtid[i] = (int)gnames.size();
+		    gtids[header->target_name[i]] = gtid[i];
+		    gnames.push_back(header->target_name[i]);
+		} else {
+		    gtid[i] = it->second;
+		}
+	    }
+
+	    // use at most one thread per target, and close the surplus handles
+	    for(int t = _get_nthreads(nthreads, num_targets); t < nt; t++)
+		samclose(fin[t]);
+	    nt = _get_nthreads(nthreads, num_targets);
+
+	    // count with one junction table per thread
+	    vector<fetch_param> jinfo(nt);
+	    if(_init_junction_tables(jinfo, allelic, includeSecondary, mapqMin, mapqMax) != 0) {
+		err = -1;
+	    } else {
+		_count_junctions_threads(fin, bce->idx, reg, jinfo);
+		err = _junction_tables_error(jinfo, &xvValue);
+	    }
+	    _bam_close_handles(fin, nt, bce);
+
+	    // add the junction tables of the threads to the global junction table
+	    for(int t = 0; t < nt && err == 0; t++) {
+		const junctionHash *h = &jinfo[t].junctions;
+		for(int j = 0; j < h->n && err == 0; j++) {
+		    junctionKey k = h->keys[j];
+		    int g = _junction_hash_index(&global, _junction_key(gtid[_junction_key_tid(k)],
+		                                                        _junction_key_first(k), _junction_key_last(k),
+		                                                        _junction_key_minus(k)));
+		    if(g < 0) {
+			err = -1;
+			break;
+		    }
+		    if((size_t)g * width >= gcounts.size()) {
+			try {
+			    gcounts.resize(((size_t)g + 1) * width, 0);
+			} catch(std::bad_alloc &e) {
+			    err = -1;
+			    break;
+			}
+		    }
+		    for(int c = 0; c < ncol; c++)
+			gcounts[(size_t)g * width + f * ncol + c] += jinfo[t].counts[(size_t)j * ncol + c];
+		}
+	    }
+	    for(int t = 0; t < nt; t++)
+		_junction_hash_free(&jinfo[t].junctions);
+	}
+
+	// sort the global junction table
+	if(err == 0 && status == BAM_CACHE_OK) {
+	    SEXP levels;
+	    PROTECT(levels = Rf_allocVector(STRSXP, (R_xlen_t)gnames.size()));
+	    for(size_t i = 0; i < gnames.size(); i++)
+		SET_STRING_ELT(levels, i, Rf_mkChar(gnames[i].c_str()));
+	    vector<const junctionHash*> tables(1, &global);
+	    vector<const vector<int>*> counts(1, &gcounts);
+	    count = _junctionTable(tables, counts, width, levels, R_NilValue);
+	    UNPROTECT(1);
+	}
+	PROTECT(count);
     }
 
     // clean up
-    samclose(fin);
-    bam_index_destroy(idx);
-
-    SEXP count,  attrib;
-    R_xlen_t n;
-    int i;
-    if(jinfo.allelic == 1) {
-	// store results in list SEXP
-	//    get complete set of unique junctions
-	set<string> uniqueJunctions;
-	for(map<string,int>::iterator it=jinfo.junctionsU.begin(); it!=jinfo.junctionsU.end(); ++it)
-	    uniqueJunctions.insert(it->first);
-	for(map<string,int>::iterator it=jinfo.junctionsR.begin(); it!=jinfo.junctionsR.end(); ++it)
-	    uniqueJunctions.insert(it->first);
-	for(map<string,int>::iterator it=jinfo.junctionsA.begin(); it!=jinfo.junctionsA.end(); ++it)
-	    uniqueJunctions.insert(it->first);
-	n = (R_xlen_t)(uniqueJunctions.size());
-	SEXP junctionNames, countR, countU, countA;
-	PROTECT(junctionNames = Rf_allocVector(STRSXP, n));
-	PROTECT(countR = Rf_allocVector(INTSXP, n));
-	PROTECT(countU = Rf_allocVector(INTSXP, n));
-	PROTECT(countA = Rf_allocVector(INTSXP, n));
-
-	//    allocate and fill in count vectors
-	i=0;
-	map<string,int>::iterator cit;
-	for(set<string>::iterator it=uniqueJunctions.begin(); it!=uniqueJunctions.end(); ++it) {
-	    // id
-	    SET_STRING_ELT(junctionNames, i, Rf_mkChar((*it).c_str()));
-	    // R
-	    cit = jinfo.junctionsR.find(*it);
-	    INTEGER(countR)[i] = (cit == jinfo.junctionsR.end()) ? 0 : cit->second;
-	    // U
-	    cit = jinfo.junctionsU.find(*it);
-	    INTEGER(countU)[i] = (cit == jinfo.junctionsU.end()) ? 0 : cit->second;
-	    // A
-	    cit = jinfo.junctionsA.find(*it);
-	    INTEGER(countA)[i] = (cit == jinfo.junctionsA.end()) ? 0 : cit->second;
+    _junction_hash_free(&global);
+    _bam_cache_error(fname, status);
+    _junction_error(err, xvValue);
 
-	    i++;
+    UNPROTECT(1);
+
+    return count;
+}
+
+
+/*! @function
+  @abstract  counts the alignments of annotated junctions (known introns) in multiple bam files, aggregating the
+             alignments of all other junctions by the gene locus that contains them. Only the counts of the
+             known introns and loci are stored, so that memory does not depend on the number of novel
+             junctions. Each bamfile is processed as in count_junctions, with per-thread counts that are summed.
+  @param   bamfiles    Names of the bamfiles
+  @param   seqlevels   character vector with the sequence names of the annotation
+  @param   knownSeq    sequence of the known introns (0-based index into seqlevels)
+  @param   knownStart  first intronic base of the known introns (1-based)
+  @param   knownEnd    last intronic base of the known introns (1-based)
+  @param   lociSeq     sequence of the gene loci (0-based index into seqlevels)
+  @param   lociStart   first base of the gene loci (1-based)
+  @param   lociEnd     last base of the gene loci (1-based)
+  @param   allelic, includeSecondary, mapqMin, mapqMax, nthreads    see count_junctions_multiple
+  @return            integer matrix with one row per known intron followed by one row per gene locus, and one
+                     column per bamfile (or three columns R, U and A per bamfile if allelic)
+ */
+static SEXP _count_junctions_annotated(SEXP bamfiles, SEXP seqlevels, SEXP knownSeq, SEXP knownStart,
+                                       SEXP knownEnd, SEXP lociSeq, SEXP lociStart, SEXP lociEnd, SEXP allelic,
+                                       SEXP includeSecondary, SEXP mapqMin, SEXP mapqMax, SEXP nthreads) {
+    // check parameters
+    if(!Rf_isString(bamfiles) || Rf_length(bamfiles) < 1)
+        Rf_error("'bamfiles' must be of type character and have at least one element");
+    if(!Rf_isString(seqlevels))
+        Rf_error("'seqlevels' must be of type character");
+    if(!Rf_isInteger(knownSeq) || !Rf_isInteger(knownStart) || !Rf_isInteger(knownEnd) ||
+       Rf_length(knownStart) != Rf_length(knownSeq) || Rf_length(knownEnd) != Rf_length(knownSeq))
+        Rf_error("'knownSeq', 'knownStart' and 'knownEnd' must be integer vectors of equal length");
+    if(!Rf_isInteger(lociSeq) || !Rf_isInteger(lociStart) || !Rf_isInteger(lociEnd) ||
+       Rf_length(lociStart) != Rf_length(lociSeq) || Rf_length(lociEnd) != Rf_length(lociSeq))
+        Rf_error("'lociSeq', 'lociStart' and 'lociEnd' must be integer vectors of equal length");
+    _verify_junction_parameters(allelic, includeSecondary, mapqMin, mapqMax, nthreads);
+    int nseq = Rf_length(seqlevels), nknown = Rf_length(knownSeq), nloci = Rf_length(lociSeq), i;
+    for(i = 0; i < nknown; i++)
+	if(INTEGER(knownSeq)[i] < 0 || INTEGER(knownSeq)[i] >= nseq)
+	    Rf_error("'knownSeq' must contain indices into 'seqlevels'");
+    for(i = 0; i < nloci; i++)
+	if(INTEGER(lociSeq)[i] < 0 || INTEGER(lociSeq)[i] >= nseq || INTEGER(lociStart)[i] > INTEGER(lociEnd)[i])
+	    Rf_error("'lociSeq' must contain indices into 'seqlevels' and 'lociStart' must not be greater than 'lociEnd'");
+
+    // count in a block, so that the containers are released before an error is raised; duplicated known introns
+    // and bamfiles that cannot be opened are reported after the clean up
+    int nfiles = Rf_length(bamfiles), ncol = Rf_asLogical(allelic) ? 3 : 1, nrow = nknown + nloci;
+    int err = 0, status = BAM_CACHE_OK, dup = -1, dupOf = -1;
+    char xvValue = 0;
+    const char *fname = NULL;
+
+    // count matrix (column-major, one column per bamfile and allele)
+    SEXP count;
+    PROTECT(count = Rf_allocMatrix(INTSXP, nrow, ncol * nfiles));
+    int *count_c = INTEGER(count);
+    for(size_t r = 0; r < (size_t)nrow * ncol * nfiles; r++)
+	count_c[r] = 0;
+
+    {
+	// annotation sequences by name
+	map<string,int> seqids;
+	for(i = 0; i < nseq; i++)
+	    seqids[Rf_translateChar(STRING_ELT(seqlevels, i))] = i;
+
+	// index the gene loci by sequence and start
+	junctionAnnotation annot;
+	annot.nknown = nknown;
+	vector<int> lorder(nloci);
+	for(i = 0; i < nloci; i++)
+	    lorder[i] = i;
+	const int *lseq_c = INTEGER(lociSeq), *lstart_c = INTEGER(lociStart), *lend_c = INTEGER(lociEnd);
+	sort(lorder.begin(), lorder.end(), [lseq_c, lstart_c](int a, int b) {
+	    return lseq_c[a] < lseq_c[b] || (lseq_c[a] == lseq_c[b] && lstart_c[a] < lstart_c[b]);
+	});
+	annot.loffset.assign(nseq + 1, 0);
+	annot.lstart.resize(nloci);
+	annot.lend.resize(nloci);
+	annot.lmaxend.resize(nloci);
+	annot.lrow.resize(nloci);
+	for(i = 0; i < nloci; i++) {
+	    int l = lorder[i];
+	    annot.loffset[lseq_c[l] + 1]++;
+	    annot.lstart[i] = lstart_c[l];
+	    annot.lend[i] = lend_c[l];
+	    annot.lmaxend[i] = (i > 0 && lseq_c[lorder[i-1]] == lseq_c[l] && annot.lmaxend[i-1] > lend_c[l]) ?
+		annot.lmaxend[i-1] : lend_c[l];
+	    annot.lrow[i] = nknown + l;
 	}
+	for(i = 0; i < nseq; i++)
+	    annot.loffset[i + 1] += annot.loffset[i];
 
-	//    build list
-	PROTECT(count = Rf_allocVector(VECSXP, 4));
-	PROTECT(attrib = Rf_allocVector(STRSXP, 4));
-
-	SET_STRING_ELT(attrib, 0, Rf_mkChar("id"));
-	SET_STRING_ELT(attrib, 1, Rf_mkChar("R"));
-	SET_STRING_ELT(attrib, 2, Rf_mkChar("U"));
-	SET_STRING_ELT(attrib, 3, Rf_mkChar("A"));
-	SET_VECTOR_ELT(count, 0, junctionNames);
-	SET_VECTOR_ELT(count, 1, countR);
-	SET_VECTOR_ELT(count, 2, countU);
-	SET_VECTOR_ELT(count, 3, countA);
-	Rf_setAttrib(count, R_NamesSymbol, attrib);
-	UNPROTECT(6);
+	// hash the known introns
+	if(_junction_hash_init(&annot.known) != 0)
+	    err = -1;
+	for(i = 0; i < nknown && err == 0 && dup < 0; i++) {
+	    int k = _junction_hash_index(&annot.known, _junction_key(INTEGER(knownSeq)[i], INTEGER(knownStart)[i],
+	                                                             INTEGER(knownEnd)[i], 0));
+	    if(k < 0)
+		err = -1;
+	    else if(k != i) {
+		dup = i;
+		dupOf = k;
+	    }
+	}
 
-    } else {
-	// store results in named vector SEXP
-	n = (R_xlen_t)(jinfo.junctionsU.size());
-	i=0;
-	PROTECT(count = Rf_allocVector(INTSXP, n));
-	PROTECT(attrib = Rf_allocVector(STRSXP, n));
-	for(map<string,int>::iterator it=jinfo.junctionsU.begin(); it!=jinfo.junctionsU.end(); ++it) {
-	    INTEGER(count)[i] = it->second;
-	    SET_STRING_ELT(attrib, i, Rf_mkChar(it->first.c_str()));
-	    i++;
+	for(int f = 0; f < nfiles && err == 0 && dup < 0 && status == BAM_CACHE_OK; f++) {
+	    fname = Rf_translateChar(STRING_ELT(bamfiles, f));
+
+	    // open one bam file handle per thread and get the shared bam index from the cache
+	    bamCacheEntry *bce = NULL;
+	    int nt = _get_nthreads(nthreads, INT_MAX);
+	    samfile_t **fin = _bam_acquire_handles(fname, nt, &bce, &status);
+	    if(fin == NULL)
+		break;
+
+	    // regions (complete targets) and annotation sequences of the targets
+	    const bam_header_t *header = fin[0]->header;
+	    int num_targets = header->n_targets;
+	    vector<bamRegion> reg;
+	    annot.seqmap.assign(num_targets, -1);
+	    for(int t = 0; t < num_targets; t++) {
+		map<string,int>::iterator it = seqids.find(header->target_name[t]);
+		if(it != seqids.end()) {
+		    annot.seqmap[t] = it->second;
+		    bamRegion r = {t, 0, (int)header->target_len[t]};
+		    reg.push_back(r);
+		}
+	    }
+
+	    // use at most one thread per target, and close the surplus handles
+	    for(int t = _get_nthreads(nthreads, (int)reg.size()); t < nt; t++)
+		samclose(fin[t]);
+	    nt = _get_nthreads(nthreads, (int)reg.size());
+
+	    // count with per-thread counts of the annotated junctions and loci
+	    vector<fetch_param> jinfo(nt);
+	    if(_init_junction_tables(jinfo, allelic, includeSecondary, mapqMin, mapqMax) != 0) {
+		err = -1;
+	    } else {
+		for(int t = 0; t < nt; t++) {
+		    jinfo[t].annot = &annot;
+		    jinfo[t].counts.assign((size_t)nrow * ncol, 0);
+		}
+		_count_junctions_threads(fin, bce->idx, reg, jinfo);
+		err = _junction_tables_error(jinfo, &xvValue);
+	    }
+	    _bam_close_handles(fin, nt, bce);
+
+	    // sum the counts of the threads
+	    for(int t = 0; t < nt && err == 0; t++)
+		for(int r = 0; r < nrow; r++)
+		    for(int c = 0; c < ncol; c++)
+			count_c[(size_t)(f * ncol + c) * nrow + r] += jinfo[t].counts[(size_t)r * ncol + c];
+	    for(int t = 0; t < nt; t++)
+		_junction_hash_free(&jinfo[t].junctions);
 	}
-	Rf_setAttrib(count, R_NamesSymbol, attrib);
-	UNPROTECT(2);
+	_junction_hash_free(&annot.known);
     }
 
+    // report errors after the clean up
+    if(dup >= 0)
+	Rf_error("known intron %d is a duplicate of known intron %d", dup + 1, dupOf + 1);
+    _bam_cache_error(fname, status);
+    _junction_error(err, xvValue);
+
+    UNPROTECT(1);
+
     return count;
 }
+
+
+/*! @function
+  @abstract  call the body of a .Call entry point and convert a C++ exception that it throws into an R error,
+             which is raised after the exception has been handled (an R error must not unwind C++ frames that
+             are handling an exception, and an exception must not reach the C caller)
+  @param  body   the body of the entry point
+  @return        the result of body
+ */
+template<typename F>
+static SEXP _call_catching_exceptions(F body){
+    char msg[256];
+    try {
+	return body();
+    } catch(std::exception &e) {
+	snprintf(msg, sizeof(msg), "%s", e.what());
+    } catch(...) {
+	snprintf(msg, sizeof(msg), "unknown exception");
+    }
+    Rf_error("failed to count junctions: %s", msg);
+    return R_NilValue;
+}
+
+
+/*! @function
+  @abstract  .Call entry points of the junction counting functions (see _count_junctions, _count_junctions_multiple
+             and _count_junctions_annotated)
+ */
+SEXP count_junctions(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP allelic, SEXP includeSecondary, SEXP mapqMin,
+                     SEXP mapqMax, SEXP nthreads) {
+    return _call_catching_exceptions([&]() {
+	return _count_junctions(bamfile, tid, start, end, allelic, includeSecondary, mapqMin, mapqMax, nthreads);
+    });
+}
+
+SEXP count_junctions_multiple(SEXP bamfiles, SEXP allelic, SEXP includeSecondary, SEXP mapqMin, SEXP mapqMax,
+                              SEXP nthreads) {
+    return _call_catching_exceptions([&]() {
+	return _count_junctions_multiple(bamfiles, allelic, includeSecondary, mapqMin, mapqMax, nthreads);
+    });
+}
+
+SEXP count_junctions_annotated(SEXP bamfiles, SEXP seqlevels, SEXP knownSeq, SEXP knownStart, SEXP knownEnd,
+                               SEXP lociSeq, SEXP lociStart, SEXP lociEnd, SEXP allelic, SEXP includeSecondary,
+                               SEXP mapqMin, SEXP mapqMax, SEXP nthreads) {
+    return _call_catching_exceptions([&]() {
+	return _count_junctions_annotated(bamfiles, seqlevels, knownSeq, knownStart, knownEnd, lociSeq, lociStart,
+	                                  lociEnd, allelic, includeSecondary, mapqMin, mapqMax, nthreads);
+    });
+}
@@ -2,5 +2,22 @@
 #include <R_ext/Boolean.h>
 #include <Rdefines.h>
 #include <samtools-1.7-compat.h>
+#include "bam_cache.h"
 
-SEXP count_junctions(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP allelic, SEXP includeSecondary, SEXP mapqMin, SEXP mapqMax);
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "utilities.h"
+#ifdef __cplusplus
+}
+#endif
+
+SEXP count_junctions(SEXP bamfile, SEXP tid, SEXP start, SEXP end, SEXP allelic, SEXP includeSecondary, SEXP mapqMin,
+                     SEXP mapqMax, SEXP nthreads);
+
+SEXP count_junctions_multiple(SEXP bamfiles, SEXP allelic, SEXP includeSecondary, SEXP mapqMin, SEXP mapqMax,
+                              SEXP nthreads);
+
+SEXP count_junctions_annotated(SEXP bamfiles, SEXP seqlevels, SEXP knownSeq, SEXP knownStart, SEXP knownEnd,
+                               SEXP lociSeq, SEXP lociStart, SEXP lociEnd, SEXP allelic, SEXP includeSecondary,
+                               SEXP mapqMin, SEXP mapqMax, SEXP nthreads);
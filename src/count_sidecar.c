@@ -0,0 +1,402 @@
+/*!
+  @header
+
+  Count sidecars: files written next to a bamfile that store the anchor positions (shifted biological
+  start or end) of all alignments that pass a set of filters, separately for each target and strand, as
+  sorted distinct positions with cumulative counts. The number of alignments anchored in a region is the
+  difference of two prefix sums, found by binary search in the memory-mapped file without touching the
+  bamfile. A sidecar is identified by its filter parameters (part of the file name and the header), and
+  is only used if the size and checksum of the bamfile match the values recorded when it was created.
+
+  None of the functions call the R API; they can be used from worker threads.
+ */
+
+#include "count_sidecar.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "zlib.h"
+#include <htslib/sam.h>
+#include "utilities.h"
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+static const char sidecarMagic[8] = "QuasRCS";
+
+
+/*! @function
+  @abstract  initialise the filter parameters of a count sidecar (unused bits of readBitMask are cleared)
+  @param     key                 the sidecarKey to initialise
+  @param     shift               shift size
+  @param     selectReadPosition  alignment anchored at "s"tart or "e"nd
+  @param     readBitMask         select first/second/any read in a paired-end experiment; select secondary alignments;
+                                 skip duplicated alignments
+  @param     mapqMin             minimal mapping quality (MAPQ >= mapqMin)
+  @param     mapqMax             maximum mapping quality (MAPQ <= mapqMax)
+  @param     absIsizeMin         minimal absolute insert size (or NO_ISIZE_FILTER)
+  @param     absIsizeMax         maximal absolute insert size (or NO_ISIZE_FILTER)
+  @param     includeSpliced      also count spliced alignments
+ */
+void _sidecar_key_init(sidecarKey *key, int shift, char selectReadPosition, int readBitMask, int mapqMin, int mapqMax,
+                       int absIsizeMin, int absIsizeMax, int includeSpliced){
+    memset(key, 0, sizeof(sidecarKey));
+    key->shift = shift;
+    key->selectReadPosition = selectReadPosition;
+    key->readBitMask = readBitMask & (BAM_FREAD1 | BAM_FREAD2 | BAM_FSECONDARY | REMOVE_DUPLICATES);
+    key->mapqMin = mapqMin;
+    key->mapqMax = mapqMax;
+    key->absIsizeMin = absIsizeMin;
+    key->absIsizeMax = absIsizeMax;
+    key->includeSpliced = (includeSpliced ? 1 : 0);
+}
+
+
+/*! @function
+  @abstract  get the name of the count sidecar of a bamfile: "<bamfile>.<CRC32 of the filter parameters>.qcs"
+  @param     bamfile   name of the bamfile
+  @param     key       filter parameters
+  @return    file name (release with free()), or NULL if memory could not be allocated
+ */
+char * _sidecar_path(const char *bamfile, const sidecarKey *key){
+    uLong crc = crc32(0L, (const Bytef*)key, sizeof(sidecarKey));
+    size_t len = strlen(bamfile) + 16 + strlen(SIDECAR_SUFFIX);
+    char *path = (char*) malloc(len);
+    if(path == NULL)
+        return NULL;
+    snprintf(path, len, "%s.%08lx%s", bamfile, (unsigned long)(crc & 0xffffffffUL), SIDECAR_SUFFIX);
+    return path;
+}
+
+
+/*! @function
+  @abstract  calculate the size and the checksum of a bamfile (CRC32 of the first and the last
+             SIDECAR_CHECKSUM_BYTES bytes, which contain the bam header and the last alignments)
+  @param     bamfile   name of the bamfile
+  @param     size      returns the file size
+  @param     checksum  returns the checksum
+  @return    0 if successful, -1 if the file could not be read (or memory could not be allocated)
+ */
+static int _bam_checksum(const char *bamfile, int64_t *size, uint32_t *checksum){
+    FILE *fp;
+    struct stat st;
+    unsigned char *buf;
+    size_t n;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    int ret = 0;
+
+    if(stat(bamfile, &st) != 0 || (fp = fopen(bamfile, "rb")) == NULL)
+        return -1;
+    *size = (int64_t)st.st_size;
+    buf = (unsigned char*) malloc(SIDECAR_CHECKSUM_BYTES);
+    if(buf == NULL){
+        fclose(fp);
+        return -1;
+    }
+    n = fread(buf, 1, SIDECAR_CHECKSUM_BYTES, fp);
+    crc = crc32(crc, buf, (uInt)n);
+    if(*size > 2 * (int64_t)SIDECAR_CHECKSUM_BYTES){
+        if(fseek(fp, -(long)SIDECAR_CHECKSUM_BYTES, SEEK_END) != 0)
+            ret = -1;
+        else {
+            n = fread(buf, 1, SIDECAR_CHECKSUM_BYTES, fp);
+            crc = crc32(crc, buf, (uInt)n);
+        }
+    }
+    free(buf);
+    fclose(fp);
+    *checksum = (uint32_t)crc;
+
+    return ret;
+}
+
+
+/*! @function
+  @abstract  open the count sidecar of a bamfile for the given filter parameters
+  @param     bamfile   name of the bamfile
+  @param     key       filter parameters
+  @return    the open sidecar, or NULL if there is no valid sidecar (missing, corrupt or out of date)
+ */
+countSidecar * _sidecar_open(const char *bamfile, const sidecarKey *key){
+    char *path = _sidecar_path(bamfile, key);
+    struct stat st;
+    countSidecar *sc = NULL;
+    char *data = NULL;
+    size_t size;
+    int64_t bamSize;
+    uint32_t bamChecksum;
+    int i, ok;
+
+    // map sidecar file
+    if(path == NULL)
+        return NULL;
+    if(stat(path, &st) != 0 || (size_t)st.st_size < sizeof(sidecarHeader)){
+        free(path);
+        return NULL;
+    }
+    size = (size_t)st.st_size;
+#ifdef _WIN32
+    FILE *fp = fopen(path, "rb");
+    if(fp != NULL){
+        data = (char*) malloc(size);
+        if(data != NULL && fread(data, 1, size, fp) != size){
+            free(data);
+            data = NULL;
+        }
+        fclose(fp);
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd >= 0){
+        data = (char*) mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED)
+            data = NULL;
+        close(fd);
+    }
+#endif
+    free(path);
+    if(data == NULL)
+        return NULL;
+
+    sc = (countSidecar*) malloc(sizeof(countSidecar));
+    if(sc == NULL){
+#ifdef _WIN32
+        free(data);
+#else
+        munmap(data, size);
+#endif
+        return NULL;
+    }
+    sc->data = data;
+    sc->size = size;
+    sc->header = (const sidecarHeader*)data;
+    sc->runs = (const sidecarRun*)(data + sizeof(sidecarHeader));
+
+    // validate header, run table and bamfile
+    ok = (memcmp(sc->header->magic, sidecarMagic, sizeof(sidecarMagic)) == 0 &&
+          sc->header->version == SIDECAR_VERSION &&
+          sc->header->byteOrder == 0x01020304 &&
+          memcmp(&sc->header->key, key, sizeof(sidecarKey)) == 0 &&
+          sc->header->nTargets >= 0 &&
+          sizeof(sidecarHeader) + 2 * (size_t)sc->header->nTargets * sizeof(sidecarRun) <= size);
+    for(i = 0; ok && i < 2 * sc->header->nTargets; i++)
+        ok = (sc->runs[i].offset >= 0 && sc->runs[i].n >= 0 &&
+              sc->runs[i].offset + 2 * sc->runs[i].n * (int64_t)sizeof(int32_t) <= (int64_t)size);
+    ok = ok && (_bam_checksum(bamfile, &bamSize, &bamChecksum) == 0 &&
+                bamSize == sc->header->bamSize && bamChecksum == sc->header->bamChecksum);
+    if(!ok){
+        _sidecar_close(sc);
+        return NULL;
+    }
+
+    return sc;
+}
+
+
+/*! @function
+  @abstract  count the alignments anchored at positions < pos in a run
+  @param     sc    the count sidecar
+  @param     run   the run
+  @param     pos   0-based position
+  @return    number of alignments
+ */
+static uint32_t _sidecar_prefix(const countSidecar *sc, const sidecarRun *run, int pos){
+    const int32_t *p = (const int32_t*)(sc->data + run->offset);
+    const uint32_t *cum = (const uint32_t*)(p + run->n);
+    int64_t lo = 0, hi = run->n, mid;
+
+    // find first anchor position >= pos
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(p[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (lo > 0 ? cum[lo - 1] : 0);
+}
+
+
+/*! @function
+  @abstract  count the alignments anchored in a region
+  @param     sc      the count sidecar
+  @param     tid     target identifier
+  @param     start   0-based inclusive start
+  @param     end     0-based exclusive end
+  @param     strand  strand of the region ('+', '-' or '*')
+  @return    number of alignments
+ */
+uint32_t _sidecar_count(const countSidecar *sc, int tid, int start, int end, char strand){
+    const sidecarRun *run;
+    uint32_t n = 0;
+
+    if(tid < 0 || tid >= sc->header->nTargets || start >= end)
+        return 0;
+    run = sc->runs + 2 * tid;
+    if(strand != '-')
+        n += _sidecar_prefix(sc, run, end) - _sidecar_prefix(sc, run, start);
+    if(strand != '+')
+        n += _sidecar_prefix(sc, run + 1, end) - _sidecar_prefix(sc, run + 1, start);
+
+    return n;
+}
+
+
+/*! @function
+  @abstract  close a count sidecar
+  @param     sc   the count sidecar (may be NULL)
+ */
+void _sidecar_close(countSidecar *sc){
+    if(sc == NULL)
+        return;
+#ifdef _WIN32
+    free(sc->data);
+#else
+    munmap(sc->data, sc->size);
+#endif
+    free(sc);
+}
+
+
+/*! @function
+  @abstract  start writing the count sidecar of a bamfile; runs are added with _sidecar_writer_add() and the
+             sidecar is completed by _sidecar_writer_close()
+  @param     bamfile    name of the bamfile
+  @param     key        filter parameters
+  @param     nTargets   number of targets in the bam header
+  @return    the writer, or NULL if the bamfile could not be read or the sidecar could not be created
+ */
+sidecarWriter * _sidecar_writer_open(const char *bamfile, const sidecarKey *key, int nTargets){
+    sidecarWriter *w = (sidecarWriter*) calloc(1, sizeof(sidecarWriter));
+    size_t len;
+
+    if(w == NULL)
+        return NULL;
+    memcpy(w->header.magic, sidecarMagic, sizeof(sidecarMagic));
+    w->header.version = SIDECAR_VERSION;
+    w->header.byteOrder = 0x01020304;
+    w->header.nTargets = nTargets;
+    w->header.key = *key;
+    if(_bam_checksum(bamfile, &w->header.bamSize, &w->header.bamChecksum) != 0){
+        free(w);
+        return NULL;
+    }
+
+    if((w->path = _sidecar_path(bamfile, key)) == NULL){
+        _sidecar_writer_close(w, 0);
+        return NULL;
+    }
+    len = strlen(w->path) + 32;
+    w->tmppath = (char*) malloc(len);
+    w->runs = (sidecarRun*) calloc(2 * (size_t)(nTargets > 0 ? nTargets : 1), sizeof(sidecarRun));
+    if(w->tmppath == NULL || w->runs == NULL){
+        _sidecar_writer_close(w, 0);
+        return NULL;
+    }
+    snprintf(w->tmppath, len, "%s.%d.tmp", w->path, (int)getpid());
+
+    // reserve space for header and run table
+    w->offset = (int64_t)(sizeof(sidecarHeader) + 2 * (size_t)nTargets * sizeof(sidecarRun));
+    if((w->fp = fopen(w->tmppath, "wb")) == NULL ||
+       fwrite(&w->header, sizeof(sidecarHeader), 1, w->fp) != 1 ||
+       (nTargets > 0 && fwrite(w->runs, sizeof(sidecarRun), 2 * (size_t)nTargets, w->fp) != 2 * (size_t)nTargets)){
+        _sidecar_writer_close(w, 0);
+        return NULL;
+    }
+
+    return w;
+}
+
+
+static int _compareAnchors(const void *a, const void *b){
+    int32_t x = *(const int32_t*)a, y = *(const int32_t*)b;
+    return (x > y) - (x < y);
+}
+
+
+/*! @function
+  @abstract  add the anchor positions of one target and strand to a count sidecar
+  @param     w        the writer
+  @param     tid      target identifier (each tid and strand can only be added once)
+  @param     minus    anchors of minus strand alignments true(1) or false(0)
+  @param     anchors  anchor positions (one per alignment, in any order; sorted in place)
+  @param     n        number of anchor positions
+  @return    0 if successful, -1 on write errors (or if memory could not be allocated)
+ */
+int _sidecar_writer_add(sidecarWriter *w, int tid, int minus, int32_t *anchors, int64_t n){
+    int64_t i, m = 0;
+    uint32_t *cum;
+
+    if(tid < 0 || tid >= w->header.nTargets || n == 0)
+        return 0;
+
+    // sort and collapse identical positions into cumulative counts
+    qsort(anchors, (size_t)n, sizeof(int32_t), _compareAnchors);
+    cum = (uint32_t*) malloc((size_t)n * sizeof(uint32_t));
+    if(cum == NULL)
+        return -1;
+    for(i = 0; i < n; i++){
+        if(m > 0 && anchors[m - 1] == anchors[i])
+            cum[m - 1]++;
+        else {
+            anchors[m] = anchors[i];
+            cum[m] = (m > 0 ? cum[m - 1] : 0) + 1;
+            m++;
+        }
+    }
+
+    // write run
+    w->runs[2 * tid + (minus ? 1 : 0)].offset = w->offset;
+    w->runs[2 * tid + (minus ? 1 : 0)].n = m;
+    if(fwrite(anchors, sizeof(int32_t), (size_t)m, w->fp) != (size_t)m ||
+       fwrite(cum, sizeof(uint32_t), (size_t)m, w->fp) != (size_t)m){
+        free(cum);
+        return -1;
+    }
+    w->offset += 2 * m * (int64_t)sizeof(int32_t);
+    free(cum);
+
+    return 0;
+}
+
+
+/*! @function
+  @abstract  finish writing a count sidecar: write the run table and rename the temporary file to the
+             sidecar file name (commit), or remove the temporary file; the writer is freed
+  @param     w        the writer
+  @param     commit   complete the sidecar true(1) or discard it false(0)
+  @return    0 if successful, -1 if the sidecar could not be written
+ */
+int _sidecar_writer_close(sidecarWriter *w, int commit){
+    int ret = (commit ? 0 : -1);
+    size_t nruns = 2 * (size_t)w->header.nTargets;
+
+    if(w->fp != NULL){
+        if(commit && (fseek(w->fp, (long)sizeof(sidecarHeader), SEEK_SET) != 0 ||
+                      (nruns > 0 && fwrite(w->runs, sizeof(sidecarRun), nruns, w->fp) != nruns)))
+            ret = -1;
+        if(fclose(w->fp) != 0)
+            ret = -1;
+        if(ret == 0){
+#ifdef _WIN32
+            remove(w->path); // rename() does not replace existing files on Windows
+#endif
+            if(rename(w->tmppath, w->path) != 0)
+                ret = -1;
+        }
+        if(ret != 0)
+            remove(w->tmppath);
+    }
+    free(w->path);
+    free(w->tmppath);
+    free(w->runs);
+    free(w);
+
+    return (commit ? ret : 0);
+}
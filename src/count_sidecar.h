@@ -0,0 +1,115 @@
+#ifndef QUASR_COUNT_SIDECAR_H
+#define QUASR_COUNT_SIDECAR_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIDECAR_SUFFIX ".qcs"               // file name suffix of count sidecars
+#define SIDECAR_VERSION 1                   // version of the count sidecar format
+#define SIDECAR_CHECKSUM_BYTES (1 << 20)    // bytes at the start and at the end of the bamfile used for the checksum
+
+/*! @typedef
+  @abstract Filter parameters that determine the anchor positions stored in a count sidecar.
+  @field shift               shift size of the reads (not SMART_SHIFT)
+  @field selectReadPosition  alignment anchored at "s"tart or "e"nd
+  @field readBitMask         BAM_FREAD1, BAM_FREAD2, BAM_FSECONDARY and REMOVE_DUPLICATES bits of the read selection
+  @field mapqMin             minimum mapping quality (MAPQ >= mapqMin)
+  @field mapqMax             maximum mapping quality (MAPQ <= mapqMax)
+  @field absIsizeMin         minimum absolute insert size (or NO_ISIZE_FILTER)
+  @field absIsizeMax         maximum absolute insert size (or NO_ISIZE_FILTER)
+  @field includeSpliced      also count spliced alignments true(1) or false(0)
+*/
+typedef struct {
+    int32_t shift;
+    int32_t selectReadPosition;
+    int32_t readBitMask;
+    int32_t mapqMin;
+    int32_t mapqMax;
+    int32_t absIsizeMin;
+    int32_t absIsizeMax;
+    int32_t includeSpliced;
+} sidecarKey;
+
+/*! @typedef
+  @abstract Header of a count sidecar file, followed by a table of 2 * nTargets sidecarRun (plus and minus
+            strand of each target) and the runs: n int32_t anchor positions (sorted, distinct) and n uint32_t
+            cumulative alignment counts (number of alignments anchored at or before the position).
+  @field magic        "QuasRCS" and a terminating zero
+  @field version      SIDECAR_VERSION
+  @field byteOrder    0x01020304 as written by the creating machine
+  @field bamSize      size of the bamfile
+  @field bamChecksum  CRC32 of the first and last SIDECAR_CHECKSUM_BYTES of the bamfile
+  @field nTargets     number of targets in the bam header
+  @field key          filter parameters
+*/
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    int64_t bamSize;
+    uint32_t bamChecksum;
+    int32_t nTargets;
+    sidecarKey key;
+} sidecarHeader;
+
+/*! @typedef
+  @abstract Location of the anchor positions of one target and strand in a count sidecar file.
+  @field offset   file offset of the positions (the cumulative counts follow)
+  @field n        number of distinct anchor positions
+*/
+typedef struct {
+    int64_t offset;
+    int64_t n;
+} sidecarRun;
+
+/*! @typedef
+  @abstract Open (memory-mapped) count sidecar.
+  @field data     file contents
+  @field size     file size
+  @field header   file header
+  @field runs     run table
+*/
+typedef struct {
+    char *data;
+    size_t size;
+    const sidecarHeader *header;
+    const sidecarRun *runs;
+} countSidecar;
+
+/*! @typedef
+  @abstract Count sidecar that is being written.
+  @field fp       temporary output file
+  @field path     name of the sidecar file
+  @field tmppath  name of the temporary output file (renamed to path when complete)
+  @field header   file header
+  @field runs     run table
+  @field offset   current file offset
+*/
+typedef struct {
+    FILE *fp;
+    char *path;
+    char *tmppath;
+    sidecarHeader header;
+    sidecarRun *runs;
+    int64_t offset;
+} sidecarWriter;
+
+void _sidecar_key_init(sidecarKey *key, int shift, char selectReadPosition, int readBitMask, int mapqMin, int mapqMax,
+                       int absIsizeMin, int absIsizeMax, int includeSpliced);
+char * _sidecar_path(const char *bamfile, const sidecarKey *key);
+countSidecar * _sidecar_open(const char *bamfile, const sidecarKey *key);
+uint32_t _sidecar_count(const countSidecar *sc, int tid, int start, int end, char strand);
+void _sidecar_close(countSidecar *sc);
+sidecarWriter * _sidecar_writer_open(const char *bamfile, const sidecarKey *key, int nTargets);
+int _sidecar_writer_add(sidecarWriter *w, int tid, int minus, int32_t *anchors, int64_t n);
+int _sidecar_writer_close(sidecarWriter *w, int commit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
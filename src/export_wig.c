@@ -4,9 +4,6 @@
 #include "export_wig.h"
 
 
-#define NO_ISIZE_FILTER -1   // disabled insert size-based alignment filtering
-
-
 typedef struct {
     int bs;              // binsize
     int32_t cTid;        // current target id
@@ -15,14 +12,10 @@ typedef struct {
     long unsigned int *count; // bin counts for current target
     int shift;           // shift for alignments
     int paired;          // paired experiment
-    const char * strand; // alignment strand
+    alignmentStrand strand; // alignment strand
     int log2p1;          // output log2(x+1)?
-    int skipSecondary;   // skip secondary alignments true(1) or false(0)
-    uint8_t mapqMin;     // minimum mapping quality (MAPQ >= mapqMin)
-    uint8_t mapqMax;     // maximum mapping quality (MAPQ <= mapqMax)
-    int32_t absIsizeMin; // minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
-    int32_t absIsizeMax; // maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
-    int readBitMask;     // select first/last read from a multi-read experiment
+    alignmentFilter filter; // secondary, MAPQ, ISIZE and read selection filters
+    positionHash *dups;  // alignments of the current target and bam file (duplicate removal), or NULL
 } targetCoverage;
 
 
@@ -33,25 +26,15 @@ static int _addHitToCoverage(const bam1_t *hit, void *data){
     static int32_t hitBin;
 
     // skip alignment if region is not * and the strand of alignment or region is not the same
-    if(strcmp(tcov->strand, "*")
-       && (((hit->core.flag & BAM_FREVERSE) == 0) != (strcmp(tcov->strand, "+") == 0)))
+    if(!_strand_pass(tcov->strand, hit))
         return 0;
 
-    // skip alignment if mapping quality not in specified range
-    if(hit->core.qual < tcov->mapqMin || hit->core.qual > tcov->mapqMax)
+    // skip alignment if it does not pass the secondary, MAPQ, ISIZE or read selection filters
+    if(!_filter_pass(&tcov->filter, hit))
         return 0;
 
-    // skip alignment if secondary and skipSecondary==true
-    if((hit->core.flag & BAM_FSECONDARY) && tcov->skipSecondary)
-	return 0;
-
-    // skip alignment if insert size not in specified range
-    if((tcov->absIsizeMin != NO_ISIZE_FILTER && llabs(hit->core.isize) < tcov->absIsizeMin) ||
-       (tcov->absIsizeMax != NO_ISIZE_FILTER && llabs(hit->core.isize) > tcov->absIsizeMax))
-        return 0;
-
-    // skip alignment if read1 or read2 flag is set (=paired-end) and if wrong readBitMask
-    if((hit->core.flag & (BAM_FREAD1 + BAM_FREAD2)) && (hit->core.flag & tcov->readBitMask) == 0)
+    // skip duplicated alignments
+    if(!_dedup_pass(tcov->dups, hit))
         return 0;
 
     if(tcov->paired) {
@@ -190,29 +173,31 @@ SEXP bamfile_to_wig(SEXP _bam_in, SEXP _wig_out, SEXP _paired, SEXP _binsize, SE
     tcov.shift = INTEGER(_shift)[0];
     tcov.paired = Rf_asLogical(_paired);
     tcov.count = NULL;
-    tcov.strand = Rf_translateChar(STRING_ELT(_strand, 0));
+    tcov.strand = _strand_from_string(Rf_translateChar(STRING_ELT(_strand, 0)));
     tcov.log2p1 = Rf_asLogical(_log2p1);
-    tcov.skipSecondary = (Rf_asLogical(includeSecondary) ? 0 : 1);
-    tcov.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    tcov.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
-    tcov.absIsizeMin = (uint32_t)(INTEGER(absIsizeMin)[0]);
-    tcov.absIsizeMax = (uint32_t)(INTEGER(absIsizeMax)[0]);
-    tcov.readBitMask = (INTEGER(readBitMask)[0] & (BAM_FREAD1 + BAM_FREAD2));
+    _filter_init(&tcov.filter,
+                 (INTEGER(readBitMask)[0] & (BAM_FREAD1 + BAM_FREAD2 + REMOVE_DUPLICATES)) | (Rf_asLogical(includeSecondary) ? BAM_FSECONDARY : 0),
+                 INTEGER(mapqMin)[0], INTEGER(mapqMax)[0], INTEGER(absIsizeMin)[0], INTEGER(absIsizeMax)[0], 1);
+    positionHash dups;
+    tcov.dups = NULL;
+    if(tcov.filter.dedup){
+        if(_position_hash_init(&dups) != 0){
+            R_Free(bam_in);
+            Rf_error("failed to allocate memory for duplicate removal");
+        }
+        tcov.dups = &dups;
+    }
 
 
     // open bam input files
+    bamCacheEntry **bce = (bamCacheEntry**) R_Calloc(n, bamCacheEntry*);
     samfile_t **fin = (samfile_t**) R_Calloc(n, samfile_t*);
     bam_index_t **idx = (bam_index_t**) R_Calloc(n, bam_index_t*);
     bam1_t *hit = bam_init1();
     for(i=0; i<n; i++) {
-        fin[i] = _bam_tryopen(bam_in[i], "rb", NULL);
-    	if (fin[i]->header == 0) {
-	    samclose(fin[i]);
-	    Rf_error("invalid bam file header for %s", bam_in[i]);
-	}
-        idx[i] = bam_index_load(bam_in[i]);
-	if (idx == 0) // index is unavailable
-	    Rf_error("bam index unavailable for %s", bam_in[i]);
+        bce[i] = _bam_cache_tryopen(bam_in[i]); // get bam file and index from the cache
+        fin[i] = bce[i]->fin;
+        idx[i] = bce[i]->idx;
     }
 
 
@@ -241,14 +226,17 @@ SEXP bamfile_to_wig(SEXP _bam_in, SEXP _wig_out, SEXP _paired, SEXP _binsize, SE
     //bam_fetch_f fetch_func = _addHitToCoverage;
 
     // loop over targets
-    for(t=0; t<fin[0]->header->n_targets; t++) {
+    for(t=0; t<fin[0]->header->n_targets && (tcov.dups == NULL || tcov.dups->full == 0); t++) {
         // start new target
         tcov.cTid = t; // is always first in a sorted bam file
         start_new_target(&tcov, fin[0]->header, compress, gzfout, fout);
 
         // loop over input bam files for current target --> sum coverage
-        for(i=0; i<n; i++)
+        for(i=0; i<n; i++) {
+            if(tcov.dups != NULL)
+                _position_hash_reset(tcov.dups);
             bam_fetch(fin[i]->x.bam, idx[i], t, 0, tcov.cTlen, &tcov, (bam_fetch_f)_addHitToCoverage);
+        }
 	//            bam_fetch(fin[i]->x.bam, idx[i], t, 0, tcov.cTlen, &tcov, fetch_func);
 
         // output current target
@@ -264,14 +252,22 @@ SEXP bamfile_to_wig(SEXP _bam_in, SEXP _wig_out, SEXP _paired, SEXP _binsize, SE
 
     // clean up
     bam_destroy1(hit);
-    for(i=0; i<n; i++) {
-        bam_index_destroy(idx[i]);
-    	samclose(fin[i]);
-    }
+    for(i=0; i<n; i++)
+        _bam_cache_release(bce[i]);
     R_Free(tcov.count);
+    int dups_full = 0;
+    if(tcov.dups != NULL){
+        dups_full = tcov.dups->full;
+        _position_hash_free(tcov.dups);
+    }
     R_Free(bam_in);
     R_Free(fin);
     R_Free(idx);
+    R_Free(bce);
+    if(dups_full){
+        remove(wig_out);
+        Rf_error("too many overlapping alignments for duplicate removal");
+    }
 
     return R_NilValue;
 }
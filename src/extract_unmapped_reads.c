@@ -151,6 +151,7 @@ SEXP extract_unmapped_reads(SEXP inBam, SEXP outFile, SEXP fastq, SEXP rcRead2)
         samclose(fin);
         Rf_error("SAM/BAM header missing or empty file: '%s'", Rf_translateChar(STRING_ELT(inBam, 0)));
     }
+    _bam_attach_pool(fin);
 
     FILE * fout = NULL;
     fout = fopen(Rf_translateChar(STRING_ELT(outFile, 0)), "wb");
@@ -2,6 +2,7 @@
 #include <R_ext/Boolean.h>
 #include <Rdefines.h>
 #include <samtools-1.7-compat.h>
+#include "utilities.h"
 #include <stdio.h>
 
 SEXP extract_unmapped_reads(SEXP inBam, SEXP outFile, SEXP fastq, SEXP rcRead2);
@@ -0,0 +1,139 @@
+/*!
+  @header
+
+  Hash map of junctions (introns of spliced alignments) packed into 128-bit integer keys, used to
+  count junctions without formatting and comparing a name string for each spliced alignment. The
+  junctions get consecutive indices in order of insertion, and names are only built once for the
+  output.
+
+  @author:    Michael Stadler
+  @copyright: Friedrich Miescher Institute for Biomedical Research, Switzerland
+  @license: GPLv3
+ */
+
+#include "junction_hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/*! @function
+  @abstract  slot of a key (mixing the two halves of the key, splitmix64 finalizer)
+ */
+static inline int _junction_hash_home(int size, junctionKey key){
+    uint64_t z = key.hi * 0x9E3779B97F4A7C15ULL ^ key.lo;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (int)(z & (uint64_t)(size - 1));
+}
+
+
+/*! @function
+  @abstract  allocate the slots of an empty junction hash
+  @param     h      the junction hash
+  @return    0 if successful
+ */
+int _junction_hash_init(junctionHash *h){
+    h->size = JUNCTION_HASH_MIN_SIZE;
+    h->n = 0;
+    h->cap = JUNCTION_HASH_MIN_SIZE / 2;
+    h->slots = (junctionHashSlot*) calloc((size_t)h->size, sizeof(junctionHashSlot));
+    h->keys = (junctionKey*) malloc((size_t)h->cap * sizeof(junctionKey));
+    if(h->slots == NULL || h->keys == NULL){
+        _junction_hash_free(h);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*! @function
+  @abstract  free the slots and keys of a junction hash
+  @param     h      the junction hash
+ */
+void _junction_hash_free(junctionHash *h){
+    free(h->slots);
+    free(h->keys);
+    h->slots = NULL;
+    h->keys = NULL;
+    h->size = h->n = h->cap = 0;
+}
+
+
+/*! @function
+  @abstract  double the number of slots of a junction hash
+  @param     h      the junction hash
+  @return    0 if successful
+ */
+static int _junction_hash_grow(junctionHash *h){
+    int i, j, size = 2 * h->size;
+    junctionHashSlot *slots = (junctionHashSlot*) calloc((size_t)size, sizeof(junctionHashSlot));
+    if(slots == NULL)
+        return 1;
+
+    // the keys are re-inserted in order of their index
+    for(i = 0; i < h->n; i++){
+        for(j = _junction_hash_home(size, h->keys[i]); slots[j].idx != 0; j = (j + 1) & (size - 1))
+            ;
+        slots[j].key = h->keys[i];
+        slots[j].idx = i + 1;
+    }
+    free(h->slots);
+    h->slots = slots;
+    h->size = size;
+
+    return 0;
+}
+
+
+/*! @function
+  @abstract  get the index of a junction, inserting it if not yet present
+  @param     h      the junction hash
+  @param     key    the junction
+  @return    index of the junction (0 to h->n-1), or -1 if memory could not be allocated
+ */
+int _junction_hash_index(junctionHash *h, junctionKey key){
+    int i, mask = h->size - 1;
+
+    for(i = _junction_hash_home(h->size, key); h->slots[i].idx != 0; i = (i + 1) & mask)
+        if(h->slots[i].key.hi == key.hi && h->slots[i].key.lo == key.lo)
+            return h->slots[i].idx - 1;
+
+    // insert new junction, keeping the load factor at or below 1/2
+    if(h->n == h->cap){
+        junctionKey *keys = (junctionKey*) realloc(h->keys, 2 * (size_t)h->cap * sizeof(junctionKey));
+        if(keys == NULL)
+            return -1;
+        h->keys = keys;
+        h->cap *= 2;
+    }
+    if(2 * (h->n + 1) > h->size){
+        if(_junction_hash_grow(h) != 0)
+            return -1;
+        mask = h->size - 1;
+        for(i = _junction_hash_home(h->size, key); h->slots[i].idx != 0; i = (i + 1) & mask)
+            ;
+    }
+    h->keys[h->n] = key;
+    h->slots[i].key = key;
+    h->slots[i].idx = ++(h->n);
+
+    return h->n - 1;
+}
+
+
+/*! @function
+  @abstract  get the index of a junction
+  @param     h      the junction hash
+  @param     key    the junction
+  @return    index of the junction (0 to h->n-1), or -1 if it is not present
+ */
+int _junction_hash_find(const junctionHash *h, junctionKey key){
+    int i, mask = h->size - 1;
+
+    for(i = _junction_hash_home(h->size, key); h->slots[i].idx != 0; i = (i + 1) & mask)
+        if(h->slots[i].key.hi == key.hi && h->slots[i].key.lo == key.lo)
+            return h->slots[i].idx - 1;
+
+    return -1;
+}
@@ -0,0 +1,79 @@
+#ifndef QUASR_JUNCTION_HASH_H
+#define QUASR_JUNCTION_HASH_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JUNCTION_HASH_MIN_SIZE (1 << 12)    // initial number of slots of a junction hash
+
+/*! @typedef
+  @abstract Junction (intron of a spliced alignment), packed into a 128-bit key.
+  @field hi    target identifier (upper 32 bits) and first intronic base (1-based, lower 32 bits)
+  @field lo    last intronic base (1-based, upper 32 bits) and strand (lowest bit, 0 for '+' and 1 for '-')
+*/
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} junctionKey;
+
+/*! @typedef
+  @abstract Slot of a junction hash.
+  @field key   the junction
+  @field idx   index of the junction plus one (0 for an empty slot)
+*/
+typedef struct {
+    junctionKey key;
+    int idx;
+} junctionHashSlot;
+
+/*! @typedef
+  @abstract Open-addressing hash map of junctions to consecutive indices (in order of insertion), so that the
+            caller can keep the counts of the junctions in arrays. Does not call the R API and can be used in
+            worker threads (one hash per thread).
+  @field slots     slots (linear probing)
+  @field size      number of slots (a power of 2)
+  @field keys      junctions by index
+  @field n         number of junctions
+  @field cap       allocated number of keys
+*/
+typedef struct {
+    junctionHashSlot *slots;
+    int size;
+    junctionKey *keys;
+    int n;
+    int cap;
+} junctionHash;
+
+int _junction_hash_init(junctionHash *h);
+void _junction_hash_free(junctionHash *h);
+int _junction_hash_index(junctionHash *h, junctionKey key);
+int _junction_hash_find(const junctionHash *h, junctionKey key);
+
+/*! @function
+  @abstract  pack a junction into its key
+  @param     tid     target identifier
+  @param     first   first intronic base (1-based)
+  @param     last    last intronic base (1-based)
+  @param     minus   true(1) for the minus strand, false(0) for the plus strand
+  @return    the junction key
+ */
+static inline junctionKey _junction_key(int tid, int first, int last, int minus){
+    junctionKey k;
+    k.hi = ((uint64_t)(uint32_t)tid << 32) | (uint64_t)(uint32_t)first;
+    k.lo = ((uint64_t)(uint32_t)last << 32) | (uint64_t)(minus != 0);
+    return k;
+}
+
+static inline int _junction_key_tid(junctionKey k)   { return (int)(uint32_t)(k.hi >> 32); }
+static inline int _junction_key_first(junctionKey k) { return (int)(uint32_t)(k.hi); }
+static inline int _junction_key_last(junctionKey k)  { return (int)(uint32_t)(k.lo >> 32); }
+static inline int _junction_key_minus(junctionKey k) { return (int)(k.lo & 1); }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,24 +1,32 @@
 #include "merge_reorder_sam.h"
 //#include "merge_reorder_sam_standalone.h"
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <utility>
+#include <vector>
 
 using namespace std;
 #define MAX_NM 10000 // nm tag value if read is not mapped 
+#define SAM_READ_BLOCK (1 << 22) // initial size of the read buffer of a sam file (bytes read at once)
 
 class idLine { // stores a single alignment with integer identifier, flag and boolean isMapped 
 public:
     int id;        // integer id prefix
     int bisQueue;  // which queue did the alignment come from (0..3)
     bool isMapped; // read(-pair) mapped?
+    int nm;        // sum of the nm tags of line and line2 (MAX_NM if not mapped)
     string line;   // SAM line (first read)
     string line2;  // SAM line (second read)
-    idLine() {id=-1; bisQueue=-1; isMapped=false; line=""; line2=""; }
+    idLine() {id=-1; bisQueue=-1; isMapped=false; nm=MAX_NM; line=""; line2=""; }
     idLine(const int &newid, const int &newbisQueue, const bool newIsMapped, const string &newline, const string &newline2)
-    {id=newid; bisQueue=newbisQueue; isMapped=newIsMapped; line=newline; line2=newline2; }
+    {id=newid; bisQueue=newbisQueue; isMapped=newIsMapped; nm=MAX_NM; line=newline; line2=newline2; }
     idLine(const int &newid, const bool newIsMapped, const string &newline, const string &newline2)
-    {id=newid; bisQueue=-1; isMapped=newIsMapped; line=newline; line2=newline2; }
+    {id=newid; bisQueue=-1; isMapped=newIsMapped; nm=MAX_NM; line=newline; line2=newline2; }
+    idLine(const int &newid, const bool newIsMapped, string &&newline, string &&newline2, const int newnm)
+    {id=newid; bisQueue=-1; isMapped=newIsMapped; nm=newnm; line=std::move(newline); line2=std::move(newline2); }
     bool operator() (const idLine& lhs, const idLine&rhs) const {return (lhs.id>rhs.id);}
     void print() { cerr << "  " << id << ":" << line; if(line2 != "") cerr << "; " << line2; cerr << endl; }
 };
@@ -34,19 +42,28 @@ int _get_nm_tag(const idLine&);
 
 class SAMFile { // handles a sam file
     static int nTotal; // number of SAMFile instances created
-    static int nEof;   // number of SAMFile instances that reached fh.eof()
+    static int nEof;   // number of SAMFile instances that reached the end of file
 
     const char *fname; // file name
-    ifstream fh;       // input file stream
+    FILE *fh;          // input file
+    vector<char> buf;  // read buffer (lines are parsed in place)
+    size_t bufPos;     // start of the unparsed data in buf
+    size_t bufEnd;     // end of the data in buf
+    bool fileEof;      // all data of fh is in buf
+    bool eof;          // all alignments have been read
 
     string readbuffer; // current alignment line
     string readbuffer2;// current alignment line2 (paired reads)
     int readid;        // current alignment identifier
+    int readnm;        // current alignment edit distance (sum of nm tags)
     bool readIsMapped; // current alignment is mapped
     bool readIsPaired; // current alignment is paired
+    bool readAhead;    // current alignment was read ahead and not yet stored
 
     priority_queue<idLine, vector<idLine>, idLine> queue; // stores alignment until .flush()
 
+    void fillBuffer(); // append the next block of the file to buf
+    bool nextLine(const char**, size_t*); // get the next line from buf
     int getNextAln(); // read next (pair of) alignment, extract readid and flag
 public:
     SAMFile(const char*);
@@ -66,17 +83,28 @@ int SAMFile::nTotal=0;
 int SAMFile::nEof=0;
 
 // constructor
-SAMFile::SAMFile (const char* myfname) {
+SAMFile::SAMFile (const char* myfname) : buf(SAM_READ_BLOCK) {
+    static const char *line;
+    static size_t len;
+
     fname = myfname;
+    bufPos = bufEnd = 0;
+    fileEof = eof = readAhead = false;
 
     // open file
-    fh.open(fname, ifstream::in | ifstream::binary);
-    if(! fh.good()) {
+    fh = fopen(fname, "rb");
+    if(fh == NULL) {
 	Rf_error("error opening file '%s'\n",fname);
     } else {
 	// skip header
-	while(fh.peek()=='@' && fh.good())
-	    fh.ignore(INT_MAX, '\n');
+	while(true) {
+	    if(bufPos == bufEnd && !fileEof)
+		fillBuffer();
+	    if(bufPos < bufEnd && buf[bufPos] == '@')
+		nextLine(&line, &len);
+	    else
+		break;
+	}
     }
 
     nTotal++;
@@ -84,82 +112,153 @@ SAMFile::SAMFile (const char* myfname) {
 
 // destructor
 SAMFile::~SAMFile () {
-    if(fh.is_open())
-        fh.close();
+    if(fh != NULL)
+        fclose(fh);
+}
+
+
+// move the unparsed data to the start of buf and append the next block of the file
+void SAMFile::fillBuffer() {
+    static size_t n;
+
+    if(bufPos > 0) {
+	memmove(buf.data(), buf.data() + bufPos, bufEnd - bufPos);
+	bufEnd -= bufPos;
+	bufPos = 0;
+    }
+    if(bufEnd == buf.size()) // a single line fills buf
+	buf.resize(2 * buf.size());
+
+    n = fread(buf.data() + bufEnd, 1, buf.size() - bufEnd, fh);
+    if(n < buf.size() - bufEnd) {
+	if(ferror(fh))
+	    Rf_error("error reading from %s\n", fname);
+	fileEof = true;
+    }
+    bufEnd += n;
 }
 
+// get the next line (without '\n' or '\r\n') as a view into buf, valid until the next call
+// returns false if there are no more lines
+bool SAMFile::nextLine(const char **line, size_t *len) {
+    static char *eol;
+
+    while((eol = (char*)memchr(buf.data() + bufPos, '\n', bufEnd - bufPos)) == NULL) {
+	if(fileEof) {
+	    if(bufPos == bufEnd)
+		return false;
+	    eol = buf.data() + bufEnd; // last line without '\n'
+	    break;
+	}
+	fillBuffer();
+    }
+
+    *line = buf.data() + bufPos;
+    *len = (size_t)(eol - *line);
+    bufPos = (eol == buf.data() + bufEnd) ? bufEnd : bufPos + *len + 1;
 
-// read next (pair of) alignment, extract readid and flag
+    // remove \r if exists (for windows)
+    if(*len > 0 && (*line)[*len-1] == '\r')
+	(*len)--;
+
+    return true;
+}
+
+// parse the integer identifier prefix and the flag of a sam line
+// returns the start of the sam line after the identifier prefix
+static const char* _parse_sam_line(const char *line, size_t len, int *id, int *flag) {
+    static const char *p, *end;
+
+    // extract id
+    end = line + len;
+    *id = 0;
+    for(p = line; p < end && *p >= '0' && *p <= '9'; p++)
+	*id = *id * 10 + (*p - '0');
+    if(p == line || p == end || *p != '_')
+	Rf_error("no integer identifier found in '%.*s'\n", (int)len, line);
+    line = p + 1;
+
+    // extract flag
+    p = (const char*)memchr(line, '\t', (size_t)(end - line));
+    if(p == NULL || p + 1 == end || p[1] < '0' || p[1] > '9')
+	Rf_error("failed to find sam flag in '%.*s'\n", (int)(end - line), line);
+    *flag = 0;
+    for(p++; p < end && *p >= '0' && *p <= '9'; p++)
+	*flag = *flag * 10 + (*p - '0');
+
+    return line;
+}
+
+// get the value of the nm tag of a sam line (0 if there is none)
+static int _parse_nm_tag(const char *line, size_t len) {
+    static const char *p, *end;
+    static int nm;
+
+    end = line + len;
+    nm = 0;
+    for(p = line; (p = (const char*)memchr(p, '\t', (size_t)(end - p))) != NULL; p++) {
+	if(end - p > 6 && memcmp(p + 1, "NM:i:", 5) == 0) {
+	    for(p += 6; p < end && *p >= '0' && *p <= '9'; p++)
+		nm = nm * 10 + (*p - '0');
+	    break;
+	}
+    }
+
+    return nm;
+}
+
+// read next (pair of) alignment, extract readid, flag and nm tag
 int SAMFile::getNextAln() {
-    static size_t start_pos, end_pos;
+    static const char *line, *start;
+    static size_t len;
     static int readflag, readid2, readflag2;
     static bool readIsMapped2;
 
+    // alignment already read by the last advance()
+    if(readAhead) {
+	readAhead = false;
+	return 0;
+    }
+
     // read line
-    getline (fh, readbuffer, '\n');
-    if(fh.eof()) {
+    if(!nextLine(&line, &len)) {
+	eof = true;
 	nEof++;
 	return 1;
-    } else if(!fh.good()) {
-	Rf_error("error reading from %s\n", fname);
     }
 
-    // remove \r if exists (for windows)
-    if(readbuffer[readbuffer.size()-1] == '\r')
-        readbuffer.erase(readbuffer.size()-1, 1);
-
-    // extract id
-    end_pos = readbuffer.find('_');
-    if(end_pos != string::npos)
-	readid = atoi(readbuffer.substr(0, end_pos).c_str());
-    else
-	Rf_error("no integer identifier found in '%s'\n",readbuffer.c_str());
-    readbuffer.erase(0, end_pos+1);
-
-    // extract flag
-    start_pos = readbuffer.find('\t', end_pos+1) + 1;
-    end_pos = readbuffer.find('\t', start_pos);
-    if(end_pos == string::npos)
-	Rf_error("failed to find sam flag in '%s'\n", readbuffer.c_str());
-    readflag = atoi(readbuffer.substr(start_pos, end_pos-start_pos).c_str());
+    // extract id and flag
+    start = _parse_sam_line(line, len, &readid, &readflag);
+    len -= (size_t)(start - line);
 
     // set readIsMapped and readIsPaired
     readIsMapped = !(readflag & BAM_FUNMAP);
     readIsPaired = (readflag & BAM_FPAIRED);
     readIsMapped2 = !(readflag & BAM_FMUNMAP);
 
+    // store line without id prefix (buf may be refilled when reading the second of a pair)
+    readbuffer.assign(start, len);
+    readnm = readIsMapped ? _parse_nm_tag(start, len) : MAX_NM;
+
     // read second if paired and mate is mapped
     if((readIsMapped && readIsPaired && readIsMapped2) ||
        (!readIsMapped && readIsPaired && !readIsMapped2)) {
 	// read line
-	getline (fh, readbuffer2, '\n');
-	if(fh.eof() || !fh.good())
+	if(!nextLine(&line, &len))
 	    Rf_error("error reading second alignment of pair from %s\n", fname);
 
-        // remove \r if exists (for windows)
-        if(readbuffer2[readbuffer2.size()-1] == '\r')
-            readbuffer2.erase(readbuffer2.size()-1, 1);
-
-	// extract id
-	end_pos = readbuffer2.find('_');
-	if(end_pos != string::npos)
-	    readid2 = atoi(readbuffer2.substr(0, end_pos).c_str());
-	else
-	    Rf_error("no integer identifier found in '%s'\n",readbuffer2.c_str());
-	readbuffer2.erase(0, end_pos+1);
-
-	// extract flag
-	start_pos = readbuffer2.find('\t', end_pos+1) + 1;
-	end_pos = readbuffer2.find('\t', start_pos);
-	if(end_pos == string::npos)
-	    Rf_error("failed to find sam flag in '%s'\n", readbuffer2.c_str());
-	readflag2 = atoi(readbuffer2.substr(start_pos, end_pos-start_pos).c_str());
+	// extract id and flag
+	start = _parse_sam_line(line, len, &readid2, &readflag2);
+	len -= (size_t)(start - line);
 
 	// check if paired
 	if(readid!=readid2 || !(readflag2 & BAM_FPAIRED)) {
 	    Rf_error("unexpected alignment when reading second of a pair\n");
 
 	} else {
+	    readbuffer2.assign(start, len);
+	    if(readIsMapped)
+		readnm += _parse_nm_tag(start, len);
 	    // adjust readIsMapped
 	    readIsMapped = (readIsMapped || readIsMapped2);
 	}
@@ -176,47 +275,40 @@ int SAMFile::advance(int id) {
     //cout << "advancing(" << id << "), top: " << (queue.empty() ? -1 : queue.top().id) << endl;
 
     static int nr;
-    static streampos filePos;
 
-    if(!fh.eof() && (queue.empty() || queue.top().id != id)) {
+    nr = 0;
+    if(!eof && (queue.empty() || queue.top().id != id)) {
 	// do nothing if EOF reached or id is already on queue.top()
 
-	readid = -1;
-	nr = 0;
-	while (readid != id) {
-	    // read next alignment
+	do {
+	    // read next alignment (or the one read ahead by the last call)
 	    if(this->getNextAln())
 		break;
 
 	    // store in queue
-	    queue.push(idLine(readid, readIsMapped, readbuffer, readbuffer2));
+	    queue.push(idLine(readid, readIsMapped, std::move(readbuffer), std::move(readbuffer2), readnm));
 	    //cout << "\tjust stored " << readid << endl;
 	    nr++;
-	}
+	} while (readid != id);
 
 	// read all alignments with that id
 	while (readid == id) {
 	    // read next alignment
-	    filePos = fh.tellg();
 	    if(this->getNextAln())
 		break;
 
 	    if(readid == id) { // same id
 		// store in queue
-		queue.push(idLine(readid, readIsMapped, readbuffer, readbuffer2));
+		queue.push(idLine(readid, readIsMapped, std::move(readbuffer), std::move(readbuffer2), readnm));
 		//cout << "\tjust stored " << readid << endl;
 		nr++;
 
 	    } else {
-		// next id found; undo last getline
-		//cout << "\tjust ignored " << readid << endl;
-		fh.seekg(filePos);
-		if(fh.fail() || fh.bad())
-		    Rf_error("failed to seek to new position in sam file");
+		// next id found; keep it for the next call
+		//cout << "\tjust kept " << readid << endl;
+		readAhead = true;
 	    }
 	}
-    } else {
-	nr = 0;
     }
 
     //cout << "\t" << nr << " alignments parsed, new top: " << (queue.empty() ? -1 : queue.top().id) << endl;
@@ -413,21 +505,8 @@ int SAMFile::get_nm_tag(int id){
 }
 
 int _get_nm_tag(const idLine &alignment){
-    static int nm;
-    nm = MAX_NM;
-    static size_t pos;
-
-    // get edit distance
-    pos = alignment.line.find("NM:i:")+5;
-    // Rprintf("pos: %d, looking for integers in: %s\n", pos, alignment.line.substr(pos, string::npos).c_str());
-    nm = atoi(alignment.line.substr(pos, std::string::npos).c_str());
-    // if paired then get edit distance of pair and add up
-    if(!alignment.line2.empty()){
-	pos = alignment.line2.find("NM:i:")+5;
-	nm = nm + atoi(alignment.line2.substr(pos, std::string::npos).c_str());
-    }
-
-    return nm;
+    // edit distance was parsed when reading the alignment
+    return alignment.nm;
 }
 
 inline char complement(char element) {
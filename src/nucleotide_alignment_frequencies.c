@@ -187,21 +187,10 @@ SEXP nucleotide_alignment_frequencies(SEXP bamfile, SEXP refSequence, SEXP refCh
     if(!Rf_isInteger(chunkSize) || Rf_length(refChr) != 1)
         Rf_error("'chunkSize' must be integer(1)");
 
-    // open bam file
-    samfile_t *fp = 0;
-    fp = samopen(bam_in, "rb", NULL);
-    if (fp == 0)
-	Rf_error("failed to open BAM file: '%s'", bam_in);
-    if (fp->header == 0 || fp->header->n_targets == 0)
-	Rf_error("BAM header missing or empty of file: '%s'", bam_in);
-
-    // open index file
-    bam_index_t *idx = 0;
-    idx = bam_index_load(bam_in);
-    if (idx == 0){
-	samclose(fp);
-	Rf_error("failed to open BAM index file: '%s.bai'", bam_in);
-    }
+    // get bam file and index from the bam handle cache
+    bamCacheEntry *bce = _bam_cache_tryopen(bam_in);
+    samfile_t *fp = bce->fin;
+    bam_index_t *idx = bce->idx;
 
     // create fetch data structure
     fetch_param fparam;
@@ -240,8 +229,7 @@ SEXP nucleotide_alignment_frequencies(SEXP bamfile, SEXP refSequence, SEXP refCh
     uniqueness[1] += fparam.count_aln;
 
     // clean up
-    samclose(fp);
-    bam_index_destroy(idx);
+    _bam_cache_release(bce);
     for(int i = 0; i < fparam.count_aln; i++)
         R_Free(fparam.pos_lst[i]);
     R_Free(fparam.pos_lst);
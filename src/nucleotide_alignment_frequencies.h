@@ -2,5 +2,6 @@
 #include <R_ext/Boolean.h>
 #include <Rdefines.h>
 #include "htslib/sam.h"
+#include "bam_cache.h"
 
 SEXP nucleotide_alignment_frequencies(SEXP bamfile, SEXP refSequence, SEXP refChr, SEXP refStart, SEXP mmDist, SEXP chunkSize);
@@ -0,0 +1,210 @@
+/*!
+  @header
+
+  Bounded hash set of keys attached to positions of a sorted alignment stream, used to pair
+  mates of paired-end fragments and to recognize duplicated alignments while counting. An
+  entry is only needed until the stream has passed its position, so that the number of
+  live entries is proportional to the insert size (or read length) rather than to the
+  size of the bam file. Stale entries are removed when the hash fills up.
+
+  @author:    Michael Stadler
+  @copyright: Friedrich Miescher Institute for Biomedical Research, Switzerland
+  @license: GPLv3
+ */
+
+#include "position_hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static int maxSize = POSITION_HASH_MAX_SIZE;  // maximal number of slots (see _position_hash_max_size)
+
+
+/*! @function
+  @abstract  calculate the key of an alignment from its name and two positions (FNV-1a)
+  @param     name   read name (or NULL)
+  @param     a      first position or other integer property
+  @param     b      second position or other integer property
+  @return    64-bit key
+ */
+uint64_t _position_hash_key(const char *name, int a, int b){
+    uint64_t h = FNV_OFFSET;
+    uint32_t v[2];
+    const unsigned char *p;
+    size_t i;
+
+    if(name != NULL)
+        for(p = (const unsigned char*)name; *p != '\0'; p++)
+            h = (h ^ (uint64_t)(*p)) * FNV_PRIME;
+    v[0] = (uint32_t)a;
+    v[1] = (uint32_t)b;
+    p = (const unsigned char*)v;
+    for(i = 0; i < sizeof(v); i++)
+        h = (h ^ (uint64_t)p[i]) * FNV_PRIME;
+
+    return h;
+}
+
+
+/*! @function
+  @abstract  slot of a key
+ */
+static inline int _position_hash_home(const positionHash *h, uint64_t key){
+    return (int)((key ^ (key >> 29)) & (uint64_t)(h->size - 1));
+}
+
+
+/*! @function
+  @abstract  allocate the slots of an empty position hash
+  @param     h      the position hash
+  @return    0 if successful
+ */
+int _position_hash_init(positionHash *h){
+    h->size = (POSITION_HASH_MIN_SIZE < maxSize ? POSITION_HASH_MIN_SIZE : maxSize);
+    h->n = 0;
+    h->gen = 1;
+    h->full = 0;
+    h->entries = (positionHashEntry*) calloc((size_t)h->size, sizeof(positionHashEntry));
+    return (h->entries == NULL);
+}
+
+
+/*! @function
+  @abstract  free the slots of a position hash
+  @param     h      the position hash
+ */
+void _position_hash_free(positionHash *h){
+    free(h->entries);
+    h->entries = NULL;
+    h->size = 0;
+    h->n = 0;
+}
+
+
+/*! @function
+  @abstract  remove all entries (in constant time)
+  @param     h      the position hash
+ */
+void _position_hash_reset(positionHash *h){
+    h->n = 0;
+    if(++(h->gen) == 0){
+        memset(h->entries, 0, (size_t)h->size * sizeof(positionHashEntry));
+        h->gen = 1;
+    }
+}
+
+
+/*! @function
+  @abstract  rebuild the hash with all entries that are still needed at curpos, doubling its size if more than
+             half of the slots remain in use (up to maxSize)
+  @param     h       the position hash
+  @param     curpos  current position of the sorted alignment stream
+  @return    0 if successful
+ */
+static int _position_hash_rebuild(positionHash *h, int curpos){
+    positionHashEntry *old = h->entries;
+    int i, j, live = 0, oldsize = h->size;
+
+    for(i = 0; i < oldsize; i++)
+        if(old[i].gen == h->gen && old[i].pos >= curpos)
+            live++;
+    if(2 * live >= oldsize && oldsize < maxSize)
+        h->size = 2 * oldsize;
+    h->entries = (positionHashEntry*) calloc((size_t)h->size, sizeof(positionHashEntry));
+    if(h->entries == NULL){
+        h->entries = old;
+        h->size = oldsize;
+        return 1;
+    }
+
+    h->n = 0;
+    for(i = 0; i < oldsize; i++)
+        if(old[i].gen == h->gen && old[i].pos >= curpos){
+            for(j = _position_hash_home(h, old[i].key); h->entries[j].gen == h->gen; j = (j + 1) & (h->size - 1))
+                ;
+            h->entries[j] = old[i];
+            h->n++;
+        }
+    free(old);
+
+    return 0;
+}
+
+
+/*! @function
+  @abstract  insert a key into the position hash
+  @param     h       the position hash
+  @param     key     the key
+  @param     pos     position after which the entry is no longer needed
+  @param     curpos  current position of the sorted alignment stream (entries with pos < curpos may be removed)
+  @return    1 if the key was inserted, 0 if it was already present, -1 if the hash is full (sets the full flag)
+ */
+int _position_hash_insert(positionHash *h, uint64_t key, int pos, int curpos){
+    int i;
+
+    // keep the load factor below 3/4
+    if(4 * (h->n + 1) > 3 * h->size){
+        if(_position_hash_rebuild(h, curpos) != 0 || 4 * (h->n + 1) > 3 * h->size){
+            h->full = 1;
+            return -1;
+        }
+    }
+
+    for(i = _position_hash_home(h, key); h->entries[i].gen == h->gen; i = (i + 1) & (h->size - 1))
+        if(h->entries[i].key == key)
+            return 0;
+    h->entries[i].key = key;
+    h->entries[i].pos = pos;
+    h->entries[i].gen = h->gen;
+    h->n++;
+
+    return 1;
+}
+
+
+/*! @function
+  @abstract  remove a key from the position hash (backward shift deletion)
+  @param     h      the position hash
+  @param     key    the key
+  @return    1 if the key was found and removed, 0 otherwise
+ */
+int _position_hash_remove(positionHash *h, uint64_t key){
+    int i, j, k, mask = h->size - 1;
+
+    for(i = _position_hash_home(h, key); h->entries[i].gen == h->gen; i = (i + 1) & mask)
+        if(h->entries[i].key == key)
+            break;
+    if(h->entries[i].gen != h->gen)
+        return 0;
+
+    // move following entries of the probe sequence into the gap
+    for(j = (i + 1) & mask; h->entries[j].gen == h->gen; j = (j + 1) & mask){
+        k = _position_hash_home(h, h->entries[j].key);
+        if((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)){
+            h->entries[i] = h->entries[j];
+            i = j;
+        }
+    }
+    h->entries[i].gen = h->gen - 1;
+    h->n--;
+
+    return 1;
+}
+
+
+/*! @function
+  @abstract  get and optionally set the maximal number of slots of position hashes that are initialized later
+             (must not be called while hashes are in use, e.g. to test the handling of full hashes)
+  @param     size   new maximal number of slots (a power of 2 greater or equal to 2), or 0
+  @return    previous maximal number of slots
+ */
+int _position_hash_max_size(int size){
+    int old = maxSize;
+
+    if(size > 0)
+        maxSize = size;
+
+    return old;
+}
@@ -0,0 +1,58 @@
+#ifndef QUASR_POSITION_HASH_H
+#define QUASR_POSITION_HASH_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POSITION_HASH_MIN_SIZE (1 << 12)    // initial number of slots of a position hash
+#define POSITION_HASH_MAX_SIZE (1 << 22)    // default maximal number of slots of a position hash
+
+/*! @typedef
+  @abstract Slot of a position hash.
+  @field key   64-bit key (e.g. hash of a read name and positions)
+  @field pos   position after which the entry is no longer needed (alignments arrive sorted by position)
+  @field gen   generation of the entry (the slot is empty if gen differs from the generation of the hash)
+*/
+typedef struct {
+    uint64_t key;
+    int pos;
+    unsigned int gen;
+} positionHashEntry;
+
+/*! @typedef
+  @abstract Bounded open-addressing hash set of keys that are only needed up to a position of a sorted
+            alignment stream. Entries whose position has been passed are removed when the hash fills up,
+            and the hash grows up to POSITION_HASH_MAX_SIZE slots (see _position_hash_max_size). A key
+            that cannot be inserted into a full hash sets the full flag, which is kept until the hash
+            is freed, so that the caller can report the error after processing the stream. Does not
+            call the R API and can be used in worker threads (one hash per thread).
+  @field entries   slots (linear probing)
+  @field size      number of slots (a power of 2)
+  @field n         number of entries
+  @field gen       current generation (incremented by _position_hash_reset)
+  @field full      true(1) if a key could not be inserted because the hash was full
+*/
+typedef struct {
+    positionHashEntry *entries;
+    int size;
+    int n;
+    unsigned int gen;
+    int full;
+} positionHash;
+
+uint64_t _position_hash_key(const char *name, int a, int b);
+int _position_hash_init(positionHash *h);
+void _position_hash_free(positionHash *h);
+void _position_hash_reset(positionHash *h);
+int _position_hash_insert(positionHash *h, uint64_t key, int pos, int curpos);
+int _position_hash_remove(positionHash *h, uint64_t key);
+int _position_hash_max_size(int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,10 +10,30 @@
  */
 
 #include "profile_alignments.h"
+#include "region_mask.h"
 #include <stdlib.h>
+#include <string.h>
 
 #define SMART_SHIFT -1000000 // for half insert size shift towards the mate read
-#define NO_ISIZE_FILTER -1   // disabled insert size-based alignment filtering
+#define XV_MISSING 1         // XV tag missing in an alignment (allelic profiling)
+#define XV_INVALID 2         // invalid value of the XV tag in an alignment (allelic profiling)
+
+/*! @typedef
+  @abstract Sparse (non-allelic) profile counts, collected as one (profile, bin) entry per counted alignment.
+  @field prof         profile of the entries
+  @field bin          bin of the entries
+  @field n            number of entries
+  @field cap          allocated number of entries
+  @field failed       true(1) if an entry could not be stored (out of memory)
+*/
+typedef struct {
+    int *prof;
+    int *bin;
+    size_t n;
+    size_t cap;
+    int failed;
+} sparseCounts;
+
 
 /*! @typedef
   @abstract Structure to provid the data to the bam_fetch() functions.
@@ -28,16 +48,15 @@
   @field selstrand    strand of the fetch region (used to select alignments; have to be on the same strand)
   @field regstrand    strand of the fetch region (controls calculation of relative position: from the left(+,*) or the right(-)
   @field shift        shift size for alignment
-  @field readBitMask  select first/last read from a multi-read experiment
-  @field skipSecondary  skip secondary alignments true(1) or false(0)
   @field selectReadPosition  weight of alignment on "s"tart or "e"nd
   @field allelic      allelic true(1) or false(0)
-  @field includeSpliced  count spliced alignments true(1) or false(0)
-  @field mapqMin      minimum mapping quality (MAPQ >= mapqMin)
-  @field mapqMax      maximum mapping quality (MAPQ <= mapqMax)
-  @field absIsizeMin  minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
-  @field absIsizeMax  maximum absolute insert size (abs(ISIZE) <= absIsizeMax)
+  @field filter       compiled region-independent alignment filter (spliced, MAPQ, ISIZE, read and secondary flags)
   @field binSize      size of counting bins that tile the region
+  @field dups         alignments of the current fetch region (duplicate removal, see _dedup_pass), or NULL
+  @field mask         masked intervals of the target of the fetch region (alignments with a masked position are
+                      skipped), or NULL
+  @field sparse       sparse counts (used instead of sumU if not NULL, non-allelic only), or NULL
+  @field profile      profile of the fetch region (for sparse counts)
 */
 typedef struct {
     int *sumU;
@@ -48,22 +67,149 @@ typedef struct {
     int start;
     int end;
     int ref;
-    const char *selstrand;
-    const char *regstrand;
+    alignmentStrand selstrand;
+    alignmentStrand regstrand;
     int shift;
-    int readBitMask;
-    int skipSecondary;
     char selectReadPosition;
     int allelic;
-    int includeSpliced;
-    uint8_t mapqMin;
-    uint8_t mapqMax;
-    int32_t absIsizeMin;
-    int32_t absIsizeMax;
+    alignmentFilter filter;
     uint32_t binSize;
+    positionHash *dups;
+    maskCursor *mask;
+    sparseCounts *sparse;
+    int profile;
 } regionProfile;
 
 
+/*! @function
+  @abstract  add an entry to sparse profile counts; does not call the R API and can be used from worker threads
+  @param     sc      the sparse counts
+  @param     prof    profile
+  @param     bin     bin
+ */
+static void _sparse_add(sparseCounts *sc, int prof, int bin){
+    if(sc->n == sc->cap){
+        size_t cap = (sc->cap == 0) ? 4096 : 2 * sc->cap;
+        int *p = (int*) realloc(sc->prof, cap * sizeof(int));
+        if(p != NULL)
+            sc->prof = p;
+        int *b = (int*) realloc(sc->bin, cap * sizeof(int));
+        if(b != NULL)
+            sc->bin = b;
+        if(p == NULL || b == NULL){
+            sc->failed = 1;
+            return;
+        }
+        sc->cap = cap;
+    }
+    sc->prof[sc->n] = prof;
+    sc->bin[sc->n] = bin;
+    sc->n++;
+}
+
+
+/*! @function
+  @abstract  release the entries of sparse profile counts
+  @param     sc      the sparse counts
+ */
+static void _sparse_free(sparseCounts *sc){
+    free(sc->prof);
+    free(sc->bin);
+    sc->prof = sc->bin = NULL;
+    sc->n = sc->cap = 0;
+}
+
+
+static int _compareInts(const void *a, const void *b){
+    int ia = *(const int*)a, ib = *(const int*)b;
+    return (ia < ib) ? -1 : (ia > ib);
+}
+
+
+/*! @function
+  @abstract  compress sparse profile counts into a compressed sparse column (CSC) matrix with profiles in rows and
+             bins in columns, the layout of a Matrix::dgCMatrix (entries of the same profile and bin are summed)
+  @param     sc      sparse counts from nsc sources (e.g. threads)
+  @param     nsc     number of sparse counts
+  @param     nprof   number of profiles (rows)
+  @param     nbins   number of bins (columns)
+  @return    list with elements "i" (0-based row of the non-zero elements), "p" (0-based offsets of the columns in i
+             and x), "x" (counts of the non-zero elements) and "Dim"
+ */
+static SEXP _sparse_to_csc(sparseCounts *sc, int nsc, int nprof, int nbins){
+    size_t k, j, n = 0;
+    int c, b;
+    for(c = 0; c < nsc; c++)
+        n += sc[c].n;
+
+    // group entries by bin (counting sort)
+    size_t *boff = (size_t*) R_Calloc(nbins + 1, size_t);
+    for(c = 0; c < nsc; c++)
+        for(k = 0; k < sc[c].n; k++)
+            boff[sc[c].bin[k] + 1]++;
+    for(b = 0; b < nbins; b++)
+        boff[b + 1] += boff[b];
+    int *rows = (int*) R_Calloc(n > 0 ? n : 1, int);
+    size_t *bpos = (size_t*) R_Calloc(nbins > 0 ? nbins : 1, size_t);
+    for(b = 0; b < nbins; b++)
+        bpos[b] = boff[b];
+    for(c = 0; c < nsc; c++)
+        for(k = 0; k < sc[c].n; k++)
+            rows[bpos[sc[c].bin[k]]++] = sc[c].prof[k];
+
+    // sort the profiles of each bin and count the distinct ones
+    size_t nnz = 0;
+    for(b = 0; b < nbins; b++){
+        qsort(rows + boff[b], boff[b + 1] - boff[b], sizeof(int), _compareInts);
+        for(k = boff[b]; k < boff[b + 1]; k++)
+            if(k == boff[b] || rows[k] != rows[k - 1])
+                nnz++;
+    }
+
+    // fill CSC vectors
+    SEXP res, resnames, i_r, p_r, x_r, dim_r;
+    PROTECT(i_r = allocVector(INTSXP, nnz));
+    PROTECT(p_r = allocVector(INTSXP, nbins + 1));
+    PROTECT(x_r = allocVector(INTSXP, nnz));
+    PROTECT(dim_r = allocVector(INTSXP, 2));
+    int *i_c = INTEGER(i_r), *p_c = INTEGER(p_r), *x_c = INTEGER(x_r);
+    INTEGER(dim_r)[0] = nprof;
+    INTEGER(dim_r)[1] = nbins;
+    for(b = 0, j = 0; b < nbins; b++){
+        p_c[b] = (int)j;
+        for(k = boff[b]; k < boff[b + 1]; k++){
+            if(k == boff[b] || rows[k] != rows[k - 1]){
+                i_c[j] = rows[k];
+                x_c[j] = 0;
+                j++;
+            }
+            x_c[j - 1] += 1;
+        }
+    }
+    p_c[nbins] = (int)j;
+    R_Free(boff);
+    R_Free(bpos);
+    R_Free(rows);
+
+    // pack results into list
+    PROTECT(res = allocVector(VECSXP, 4));
+    PROTECT(resnames = allocVector(STRSXP, 4));
+    SET_STRING_ELT(resnames, 0, mkChar("i"));
+    SET_STRING_ELT(resnames, 1, mkChar("p"));
+    SET_STRING_ELT(resnames, 2, mkChar("x"));
+    SET_STRING_ELT(resnames, 3, mkChar("Dim"));
+    SET_VECTOR_ELT(res, 0, i_r);
+    SET_VECTOR_ELT(res, 1, p_r);
+    SET_VECTOR_ELT(res, 2, x_r);
+    SET_VECTOR_ELT(res, 3, dim_r);
+    setAttrib(res, R_NamesSymbol, resnames);
+
+    UNPROTECT(6);
+
+    return res;
+}
+
+
 /*! @function
   @abstract  increase allele specific counts.
   @param     hit     the alignment
@@ -99,41 +245,14 @@ static int _sum_allelic(const bam1_t *hit, regionProfile *rinfo, int relpos){
 
 
 /*! @function
-  @abstract  callback for bam_fetch(); sums alignments by position if correct strand and shifted biological start/end position overlap fetch region
-  @param  hit   the alignment
-  @param  data  user provided data
-  @return       0 if successful
+  @abstract  calculate the shifted biological start/end position of an alignment
+  @param  hit    the alignment
+  @param  rinfo  regionProfile with the shift and selectReadPosition
+  @return        0-based position
  */
-static int _addValidHitToSums(const bam1_t *hit, void *data){
-    regionProfile *rinfo = (regionProfile*)data;
-    static double shift = 0;
-    static int pos = 0, relpos = 0, relposBin = 0;
-
-    // skip alignment if rinfo->includeSpliced == false and alignmend is spliced
-    if(rinfo->includeSpliced == 0 && _isSpliced(hit) == 1)
-        return 0;
-
-    // skip alignment if mapping quality not in specified range
-    if(hit->core.qual < rinfo->mapqMin || hit->core.qual > rinfo->mapqMax)
-        return 0;
-
-    // skip alignment if insert size not in specified range
-    if((rinfo->absIsizeMin != NO_ISIZE_FILTER && llabs(hit->core.isize) < rinfo->absIsizeMin) ||
-       (rinfo->absIsizeMax != NO_ISIZE_FILTER && llabs(hit->core.isize) > rinfo->absIsizeMax))
-        return 0;
-
-    // skip alignment if read1 or read2 flag is set (=paired-end) and if wrong readBitMask
-    if((hit->core.flag & (BAM_FREAD1 + BAM_FREAD2)) && (hit->core.flag & rinfo->readBitMask) == 0)
-        return 0;
-
-    // skip alignment if secondary and skipSecondary==true
-    if((hit->core.flag & BAM_FSECONDARY) && rinfo->skipSecondary)
-	return 0;
-
-    // skip alignment if region is not * and the strand of alignment or region is not the same
-    if(strcmp(rinfo->selstrand, "*")
-       && (((hit->core.flag & BAM_FREVERSE) == 0) != (strcmp(rinfo->selstrand, "+") == 0)))
-        return 0;
+static int _profilePosition(const bam1_t *hit, const regionProfile *rinfo){
+    double shift = 0;
+    int pos = 0;
 
     // set shift
     if(rinfo->shift == SMART_SHIFT){
@@ -161,8 +280,39 @@ static int _addValidHitToSums(const bam1_t *hit, void *data){
         // --> position on the right side of the read
         pos = (int)((double)bam_calend(&hit->core, bam1_cigar(hit)) - 1 + shift); // 0-based exclusive end --> -1
 
+    return pos;
+}
+
+
+/*! @function
+  @abstract  callback for bam_fetch(); sums alignments by position if correct strand and shifted biological start/end position overlap fetch region
+  @param  hit   the alignment
+  @param  data  user provided data
+  @return       0 if successful
+ */
+static int _addValidHitToSums(const bam1_t *hit, void *data){
+    regionProfile *rinfo = (regionProfile*)data;
+    static int pos = 0, relpos = 0, relposBin = 0;
+
+    // skip alignment if it does not pass the region-independent filters
+    if(!_filter_pass(&rinfo->filter, hit))
+        return 0;
+
+    // skip duplicated alignments
+    if(!_dedup_pass(rinfo->dups, hit))
+        return 0;
+
+    // skip alignment if region is not * and the strand of alignment or region is not the same
+    if(!_strand_pass(rinfo->selstrand, hit))
+        return 0;
+
+    // skip alignment if its position is masked
+    pos = _profilePosition(hit, rinfo);
+    if(rinfo->mask != NULL && _mask_cursor_test(rinfo->mask, pos))
+        return 0;
+
     // calculate relative position
-    if(strcmp(rinfo->regstrand, "-"))
+    if(rinfo->regstrand != MINUS_STRAND)
 	// plus-strand or unstranded region --> measure from the left
 	relpos = pos - rinfo->ref + rinfo->offset;
     else
@@ -173,7 +323,9 @@ static int _addValidHitToSums(const bam1_t *hit, void *data){
     if(rinfo->start <= pos && pos < rinfo->end &&
        relpos >= 0 && relpos < rinfo->len){
         relposBin = relpos / rinfo->binSize; // integer-division
-        if (rinfo->allelic == 0)
+        if (rinfo->sparse != NULL)
+            _sparse_add(rinfo->sparse, rinfo->profile, relposBin);
+        else if (rinfo->allelic == 0)
             rinfo->sumU[relposBin] += 1;
         else
             _sum_allelic(hit, rinfo, relposBin);
@@ -183,6 +335,460 @@ static int _addValidHitToSums(const bam1_t *hit, void *data){
 }
 
 
+/*! @typedef
+  @abstract Aggregates of the sorted profile sweep (see profile_alignments_aggregate): the counts of each active
+            region are collected in its own window of mw bins, which is added to the profile sums and sums of
+            squares when the region is retired, so that memory grows with the number of simultaneously active
+            regions instead of the number of regions.
+  @field sum          sums over the regions of each profile (mw per profile)
+  @field sumSq        sums of squares over the regions of each profile (mw per profile)
+  @field total        total count of each region (unsorted; each region is written by a single thread)
+  @field win          windows of the active regions (mw per position in the active regions; malloc'ed)
+  @field cap          number of allocated windows
+  @field failed       true(1) if a window could not be allocated (out of memory)
+*/
+typedef struct {
+    int *sum;
+    double *sumSq;
+    int *total;
+    int *win;
+    int cap;
+    int failed;
+} profileAggregate;
+
+
+/*! @typedef
+  @abstract Structure to provide the data to the bam_fetch() function of the sorted profile sweep, which
+            processes the alignments of all regions in a single sorted stream and adds each alignment to all
+            active regions (regions with a fetch window that overlaps the alignment).
+  @field rprof        regionProfile with the alignment filter, shift, selectReadPosition, window and bin parameters
+  @field tid          target of the regions (unsorted)
+  @field start        start of the regions (0-based inclusive, unsorted)
+  @field end          end of the regions (0-based exclusive, unsorted)
+  @field ref          reference position of the regions (unsorted)
+  @field selstrand    strand of the regions used to select alignments (unsorted)
+  @field regstrand    strand of the regions used to calculate relative positions (unsorted)
+  @field profId       profile of the regions (unsorted; the counts of profile p start at mw*p)
+  @field mw           number of bins per profile
+  @field order        region indices sorted by (tid, start)
+  @field next         position in order of the next region that is not yet active
+  @field last         position in order after the last region
+  @field active       indices of the active regions
+  @field nactive      number of active regions
+  @field fwidth       extension of the fetch windows on either side of the regions (shift + broaden)
+  @field curtid       target of the previous alignment
+  @field rmask        masked intervals (rprof->mask is set to the current target), or NULL
+  @field xvError      first XV tag error (0, XV_MISSING or XV_INVALID), reported after profiling
+  @field xvValue      invalid XV tag value (if xvError == XV_INVALID)
+  @field agg          aggregates (the counts of the active regions are collected in agg->win), or NULL
+*/
+typedef struct {
+    regionProfile *rprof;
+    const int *tid;
+    const int *start;
+    const int *end;
+    const int *ref;
+    const alignmentStrand *selstrand;
+    const alignmentStrand *regstrand;
+    const int *profId;
+    int mw;
+    const int *order;
+    int next;
+    int last;
+    int *active;
+    int nactive;
+    int fwidth;
+    int curtid;
+    const regionMask *rmask;
+    int xvError;
+    char xvValue;
+    profileAggregate *agg;
+} profileSweep;
+
+
+/*! @typedef
+  @abstract Structure used to sort regions by (tid, start).
+*/
+typedef struct {
+    int tid;
+    int start;
+    int idx;
+} profileKey;
+
+static int _compareProfileKeys(const void *a, const void *b){
+    const profileKey *ra = (const profileKey*)a, *rb = (const profileKey*)b;
+    if(ra->tid != rb->tid)
+        return (ra->tid < rb->tid) ? -1 : 1;
+    if(ra->start != rb->start)
+        return (ra->start < rb->start) ? -1 : 1;
+    return (ra->idx < rb->idx) ? -1 : (ra->idx > rb->idx);
+}
+
+
+/*! @function
+  @abstract  add the window of an active region to the aggregates of its profile and to its total count
+  @param  sweep     profileSweep (with aggregates)
+  @param  i         position of the region in the active regions
+ */
+static void _profile_aggregate_flush(profileSweep *sweep, int i){
+    profileAggregate *agg = sweep->agg;
+    int j, r = sweep->active[i], *win = agg->win + (size_t)i * sweep->mw;
+    int *sum = agg->sum + (size_t)sweep->mw * sweep->profId[r];
+    double *sumSq = agg->sumSq + (size_t)sweep->mw * sweep->profId[r];
+
+    for(j = 0; j < sweep->mw; j++){
+        sum[j] += win[j];
+        sumSq[j] += (double)win[j] * (double)win[j];
+        agg->total[r] += win[j];
+    }
+}
+
+
+/*! @function
+  @abstract  provide a cleared window for the next active region (position nactive in the active regions)
+  @param  sweep     profileSweep (with aggregates)
+  @return           0 if successful, -1 if memory could not be allocated (agg->failed is set)
+ */
+static int _profile_aggregate_reserve(profileSweep *sweep){
+    profileAggregate *agg = sweep->agg;
+    int *win;
+
+    if(sweep->nactive >= agg->cap){
+        int cap = (agg->cap > 0) ? 2 * agg->cap : 16;
+        if((win = (int*) realloc(agg->win, (size_t)cap * sweep->mw * sizeof(int))) == NULL){
+            agg->failed = 1;
+            return -1;
+        }
+        agg->win = win;
+        agg->cap = cap;
+    }
+    memset(agg->win + (size_t)sweep->nactive * sweep->mw, 0, (size_t)sweep->mw * sizeof(int));
+
+    return 0;
+}
+
+
+/*! @function
+  @abstract  update the active regions of the sorted profile sweep for the next alignment (the windows of retired
+             regions are added to the aggregates, if any)
+  @param  sweep     profileSweep
+  @param  hitTid    target of the alignment
+  @param  hitStart  0-based inclusive start of the alignment
+  @param  hitEnd    0-based exclusive end of the alignment
+ */
+static void _profile_sweep_update_active(profileSweep *sweep, int hitTid, int hitStart, int hitEnd){
+    int i;
+
+    // new target: retire all regions, skip regions on previous targets and move the mask to the target
+    if(hitTid != sweep->curtid){
+        if(sweep->agg != NULL)
+            for(i = 0; i < sweep->nactive; i++)
+                _profile_aggregate_flush(sweep, i);
+        sweep->nactive = 0;
+        while(sweep->next < sweep->last && sweep->tid[sweep->order[sweep->next]] < hitTid)
+            sweep->next++;
+        sweep->curtid = hitTid;
+        if(sweep->rmask != NULL)
+            _mask_cursor_set(sweep->rprof->mask, sweep->rmask, hitTid, hitStart);
+    }
+
+    // retire regions with a fetch window that ends before the alignment (alignments arrive sorted by position)
+    for(i = 0; i < sweep->nactive; ){
+        if(sweep->end[sweep->active[i]] + sweep->fwidth <= hitStart){
+            --(sweep->nactive);
+            if(sweep->agg != NULL){
+                _profile_aggregate_flush(sweep, i);
+                if(i < sweep->nactive)
+                    memcpy(sweep->agg->win + (size_t)i * sweep->mw,
+                           sweep->agg->win + (size_t)sweep->nactive * sweep->mw, (size_t)sweep->mw * sizeof(int));
+            }
+            sweep->active[i] = sweep->active[sweep->nactive];
+        } else
+            i++;
+    }
+
+    // activate regions with a fetch window that starts before the end of the alignment
+    while(sweep->next < sweep->last && sweep->tid[sweep->order[sweep->next]] == hitTid &&
+          sweep->start[sweep->order[sweep->next]] - sweep->fwidth < hitEnd){
+        if(sweep->agg != NULL && _profile_aggregate_reserve(sweep) != 0)
+            break;
+        sweep->active[(sweep->nactive)++] = sweep->order[(sweep->next)++];
+    }
+}
+
+
+/*! @function
+  @abstract  callback for bam_fetch() of the sorted profile sweep; adds an alignment to all active regions that
+             select its strand and contain its shifted biological start/end position
+  @param  hit   the alignment
+  @param  data  user provided data (profileSweep)
+  @return       0 if successful
+ */
+static int _addValidHitToActiveProfiles(const bam1_t *hit, void *data){
+    profileSweep *sweep = (profileSweep*)data;
+    regionProfile *rprof = sweep->rprof;
+    int i, r, pos, relpos, hitStart, hitEnd, *sum;
+    uint8_t *xv_ptr = 0;
+
+    // skip alignment if it does not pass the region-independent filters (or if the aggregates failed)
+    if(!_filter_pass(&rprof->filter, hit) || (sweep->agg != NULL && sweep->agg->failed))
+        return 0;
+
+    // alignment span as used by bam_fetch() for overlap tests
+    hitStart = (int)hit->core.pos;
+    hitEnd = (int)bam_endpos(hit);
+    _profile_sweep_update_active(sweep, (int)hit->core.tid, hitStart, hitEnd);
+
+    // skip alignment if its position is masked
+    pos = _profilePosition(hit, rprof);
+    if(rprof->mask != NULL && _mask_cursor_test(rprof->mask, pos))
+        return 0;
+
+    // select the counts of the XV tag value
+    sum = rprof->sumU;
+    if(rprof->allelic != 0){
+        xv_ptr = bam_aux_get(hit,"XV");
+        if(xv_ptr == 0){
+            if(sweep->xvError == 0)
+                sweep->xvError = XV_MISSING;
+            return 0;
+        }
+        switch(bam_aux2A(xv_ptr)){
+        case 'U':
+            sum = rprof->sumU;
+            break;
+        case 'R':
+            sum = rprof->sumR;
+            break;
+        case 'A':
+            sum = rprof->sumA;
+            break;
+        default:
+            if(sweep->xvError == 0){
+                sweep->xvError = XV_INVALID;
+                sweep->xvValue = bam_aux2A(xv_ptr);
+            }
+            return 0;
+        }
+    }
+
+    // add alignment to the active regions
+    for(i = 0; i < sweep->nactive; i++){
+        r = sweep->active[i];
+        if(sweep->start[r] <= pos && pos < sweep->end[r] &&
+           sweep->start[r] - sweep->fwidth < hitEnd && hitStart < sweep->end[r] + sweep->fwidth &&
+           _strand_pass(sweep->selstrand[r], hit)){
+            if(sweep->regstrand[r] != MINUS_STRAND)
+                relpos = pos - sweep->ref[r] + rprof->offset;
+            else
+                relpos = sweep->ref[r] - pos + rprof->offset;
+            if(relpos >= 0 && relpos < rprof->len){
+                if(sweep->agg != NULL)
+                    sweep->agg->win[(size_t)i * sweep->mw + relpos / (int)rprof->binSize] += 1;
+                else if(rprof->sparse != NULL)
+                    _sparse_add(rprof->sparse, sweep->profId[r], relpos / (int)rprof->binSize);
+                else
+                    sum[sweep->mw * sweep->profId[r] + relpos / (int)rprof->binSize] += 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/*! @function
+  @abstract  Profiles all regions in sorted sweeps over the alignments that overlap their fetch windows (overlapping
+             fetch windows are coalesced, see _bam_fetch_regions), instead of one bam_fetch() per region, so that
+             alignments in overlapping regions are decoded only once. The sorted regions are split into chunks of
+             neighboring regions that are distributed over nthreads threads, each with its own file handle and
+             private counts (the counts of the master thread are the result counts, the private counts of the
+             other threads are added to them at the end). The counts are identical to the ones of one bam_fetch()
+             per region; duplicate removal is not supported (the duplicates are recognized per region).
+             If agg is not NULL, the aggregates over the regions of each profile are collected instead of the
+             counts (with private sums and sums of squares of each thread, added to agg at the end).
+  @param  fin         one bam file handle per thread (see _bam_open_handles)
+  @param  idx         bam index
+  @param  nt          number of threads (at most the number of regions)
+  @param  rprof       regionProfile with the parameters and the counts (sumU, sumR and sumA point to the counts of
+                      the first profile)
+  @param  tid         target region identifier
+  @param  start       target region start
+  @param  end         target region end
+  @param  refpos      target region anchor position
+  @param  selstrand   target region strand (used to select alignments)
+  @param  regstrand   target region strand (controls calculation of relative position)
+  @param  profId      profile of each region (0-based)
+  @param  mw          number of bins per profile
+  @param  profIdNum   number of profiles
+  @param  fwidth      extension of the fetch windows on either side of the regions (shift + broaden)
+  @param  rmask       masked intervals, or NULL
+  @param  agg         aggregates (with sum, sumSq and total cleared; agg->failed is set if memory could not be
+                      allocated), or NULL (non-aggregate and allelic profiles)
+  @param  xvValue     returns the invalid XV tag value (for XV_INVALID)
+  @return             0 if successful, or the first XV tag error (XV_MISSING or XV_INVALID)
+ */
+static int _profile_sweep(samfile_t **fin, bam_index_t *idx, int nt, regionProfile *rprof, SEXP tid, SEXP start,
+                          SEXP end, SEXP refpos, SEXP selstrand, SEXP regstrand, const int *profId, int mw,
+                          int profIdNum, int fwidth, const regionMask *rmask, profileAggregate *agg,
+                          char *xvValue){
+    int i, c, t, num_regions = Rf_length(tid);
+    int *tid_c = INTEGER(tid), *start_c = INTEGER(start), *end_c = INTEGER(end);
+
+    // sort regions by (tid, start) and collect their fetch windows
+    profileKey *keys = (profileKey*) R_Calloc(num_regions, profileKey);
+    int *order = (int*) R_Calloc(num_regions, int);
+    int *active = (int*) R_Calloc(num_regions, int);
+    bamRegion *breg = (bamRegion*) R_Calloc(num_regions, bamRegion);
+    alignmentStrand *selstrand_c = (alignmentStrand*) R_Calloc(num_regions, alignmentStrand);
+    alignmentStrand *regstrand_c = (alignmentStrand*) R_Calloc(num_regions, alignmentStrand);
+    for(i = 0; i < num_regions; i++){
+        keys[i].tid = tid_c[i];
+        keys[i].start = start_c[i];
+        keys[i].idx = i;
+        selstrand_c[i] = _strand_from_string(Rf_translateChar(STRING_ELT(selstrand, i)));
+        regstrand_c[i] = _strand_from_string(Rf_translateChar(STRING_ELT(regstrand, i)));
+    }
+    qsort(keys, (size_t)num_regions, sizeof(profileKey), _compareProfileKeys);
+    for(i = 0; i < num_regions; i++){
+        order[i] = keys[i].idx;
+        breg[i].tid = tid_c[order[i]];
+        breg[i].beg = start_c[order[i]] - fwidth;
+        breg[i].end = end_c[order[i]] + fwidth;
+    }
+
+    // split the sorted regions into chunks (several per thread for load balancing)
+    int nchunks = (nt > 1) ? 4 * nt : 1;
+    if(nchunks > num_regions)
+        nchunks = num_regions;
+
+    // private regionProfile, mask cursor and counts (dense or sparse) of each thread (thread 0 uses the result
+    // counts)
+    int nsums = (rprof->allelic != 0) ? 3 : 1;
+    size_t plen = (size_t)mw * profIdNum;
+    regionProfile *tprof = (regionProfile*) R_Calloc(nt, regionProfile);
+    maskCursor *tcursor = (maskCursor*) R_Calloc(nt, maskCursor);
+    int **tsums = (int**) R_Calloc(nt, int*);
+    sparseCounts *tsparse = (sparseCounts*) R_Calloc(nt, sparseCounts);
+    profileAggregate *tagg = (profileAggregate*) R_Calloc(nt, profileAggregate);
+    for(t = 0; t < nt; t++){
+        tprof[t] = *rprof;
+        tprof[t].mask = (rmask != NULL ? &tcursor[t] : NULL);
+        if(agg != NULL){
+            tagg[t].sum = (t > 0) ? (int*) R_Calloc(plen, int) : agg->sum;
+            tagg[t].sumSq = (t > 0) ? (double*) R_Calloc(plen, double) : agg->sumSq;
+            tagg[t].total = agg->total;
+        } else if(t > 0 && rprof->sparse != NULL){
+            tprof[t].sparse = &tsparse[t];
+        } else if(t > 0){
+            tsums[t] = (int*) R_Calloc(plen * nsums, int);
+            tprof[t].sumU = tsums[t];
+            if(rprof->allelic != 0){
+                tprof[t].sumR = tsums[t] + plen;
+                tprof[t].sumA = tsums[t] + 2 * plen;
+            }
+        }
+    }
+    int *xvError = (int*) R_Calloc(nchunks > 0 ? nchunks : 1, int);
+    char *xvValues = (char*) R_Calloc(nchunks > 0 ? nchunks : 1, char);
+
+    // process the alignments of the fetch windows of each chunk in a single sorted stream
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nt) schedule(dynamic, 1)
+#endif
+    for(c = 0; c < nchunks; c++){
+        int first = (int)((long long)num_regions * c / nchunks);
+        int last = (int)((long long)num_regions * (c + 1) / nchunks);
+        profileSweep sweep;
+        sweep.rprof = &tprof[_thread_num()];
+        sweep.tid = tid_c;
+        sweep.start = start_c;
+        sweep.end = end_c;
+        sweep.ref = INTEGER(refpos);
+        sweep.selstrand = selstrand_c;
+        sweep.regstrand = regstrand_c;
+        sweep.profId = profId;
+        sweep.mw = mw;
+        sweep.order = order;
+        sweep.next = first;
+        sweep.last = last;
+        sweep.active = active + first;
+        sweep.nactive = 0;
+        sweep.fwidth = fwidth;
+        sweep.curtid = -1;
+        sweep.rmask = rmask;
+        sweep.xvError = 0;
+        sweep.xvValue = 0;
+        sweep.agg = (agg != NULL ? &tagg[_thread_num()] : NULL);
+        _bam_fetch_regions(fin[_thread_num()], idx, breg + first, last - first, &sweep,
+                           _addValidHitToActiveProfiles);
+        if(sweep.agg != NULL){
+            int k;
+            for(k = 0; k < sweep.nactive; k++)
+                _profile_aggregate_flush(&sweep, k);
+        }
+        xvError[c] = sweep.xvError;
+        xvValues[c] = sweep.xvValue;
+    }
+
+    // add the private counts (or aggregates) of the threads to the result counts
+    for(t = 0; t < nt && agg != NULL; t++){
+        if(t > 0){
+            for(i = 0; i < (int)plen; i++){
+                agg->sum[i] += tagg[t].sum[i];
+                agg->sumSq[i] += tagg[t].sumSq[i];
+            }
+            R_Free(tagg[t].sum);
+            R_Free(tagg[t].sumSq);
+        }
+        agg->failed |= tagg[t].failed;
+        free(tagg[t].win);
+    }
+    for(t = 1; t < nt && agg == NULL; t++){
+        if(rprof->sparse != NULL){
+            size_t k;
+            for(k = 0; k < tsparse[t].n; k++)
+                _sparse_add(rprof->sparse, tsparse[t].prof[k], tsparse[t].bin[k]);
+            rprof->sparse->failed |= tsparse[t].failed;
+            _sparse_free(&tsparse[t]);
+            continue;
+        }
+        for(i = 0; i < (int)plen; i++){
+            rprof->sumU[i] += tprof[t].sumU[i];
+            if(rprof->allelic != 0){
+                rprof->sumR[i] += tprof[t].sumR[i];
+                rprof->sumA[i] += tprof[t].sumA[i];
+            }
+        }
+        R_Free(tsums[t]);
+    }
+
+    // first XV tag error (in the order of the chunks)
+    int err = 0;
+    for(c = 0; c < nchunks && err == 0; c++){
+        err = xvError[c];
+        *xvValue = xvValues[c];
+    }
+
+    // clean up
+    R_Free(keys);
+    R_Free(order);
+    R_Free(active);
+    R_Free(breg);
+    R_Free(selstrand_c);
+    R_Free(regstrand_c);
+    R_Free(tprof);
+    R_Free(tcursor);
+    R_Free(tsums);
+    R_Free(tsparse);
+    R_Free(tagg);
+    R_Free(xvError);
+    R_Free(xvValues);
+
+    return err;
+}
+
+
 /*! @function
   @abstract  verify the parameters of the profile_alignments_non_allelic and profile_alignments_allelic function
   @return       0 if successful
@@ -267,6 +873,24 @@ int _verify_profile_parameters(SEXP bamfile, SEXP profileids, SEXP tid,  SEXP st
     return 0;
 }
 
+/*! @function
+  @abstract  index the masked intervals of a call by the targets of a bamfile. The number of targets is taken
+             from the header of the cached bam file, which is released again before _mask_init() can raise an
+             R error, so that the caller can acquire its bam file handles afterwards without leaking them.
+  @param  filename  name of the bamfile
+  @param  mask      masked intervals (see _mask_init), or R_NilValue
+  @return           the regionMask (release with _mask_free), or NULL if mask is R_NilValue
+ */
+static regionMask *_profile_mask_init(const char *filename, SEXP mask){
+    if(mask == R_NilValue)
+        return NULL;
+    bamCacheEntry *bce = _bam_cache_tryopen(filename);
+    int n_targets = bce->fin->header->n_targets;
+    _bam_cache_release(bce);
+
+    return _mask_init(mask, n_targets);
+}
+
 /*! @function
   @abstract  Counts alignments by position in regions (orientation in regstrand), selecting on selstrand and shift
   @param  bamfile   name of the bamfile
@@ -295,36 +919,48 @@ int _verify_profile_parameters(SEXP bamfile, SEXP profileids, SEXP tid,  SEXP st
   @param  absIsizeMin         minimum absolute insert size (abs(ISIZE) >= absIsizeMin)
   @param  absIsizeMax         maximum absolute isnert size (abs(ISIZE) <= absIsizeMax)
   @param  binSize             size of counting bins that tile the region
+  @param  binNames            names of the bins
+  @param  mask                masked intervals (list of target identifiers, 0-based starts and exclusive ends, sorted
+                              and non-overlapping, see _mask_init), or R_NilValue; alignments with a masked
+                              position are not counted
+  @param  nthreads            number of threads used to profile the regions (without duplicate removal)
+  @param  sparse              if true(1), collect the counts as one entry per counted alignment instead of a dense
+                              matrix, and return them in compressed sparse column layout (see _sparse_to_csc)
   @return          vector of length maxWidth with alignment counts per relative position in regions
+                   (or the list returned by _sparse_to_csc if sparse is true)
  */
 SEXP profile_alignments_non_allelic(SEXP bamfile, SEXP profileids, SEXP tid, SEXP start, SEXP end, SEXP refpos,
                                     SEXP selstrand, SEXP regstrand, SEXP selectReadPosition, SEXP readBitMask,
                                     SEXP shift, SEXP broaden, SEXP maxUp, SEXP maxDown, SEXP maxUpBin, SEXP maxDownBin,
                                     SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
-                                    SEXP binSize, SEXP binNames){
+                                    SEXP binSize, SEXP binNames, SEXP mask, SEXP nthreads, SEXP sparse){
 
     // check parameters
     _verify_profile_parameters(bamfile, profileids, tid, start, end, refpos, selstrand, regstrand,
                                selectReadPosition, readBitMask, shift, broaden, maxUp, maxDown,
                                maxUpBin, maxDownBin, includeSpliced,
 			                   mapqMin, mapqMax, absIsizeMin, absIsizeMax, binSize, binNames);
+    if(!Rf_isInteger(nthreads) || Rf_length(nthreads) != 1 || INTEGER(nthreads)[0] < 1)
+        Rf_error("'nthreads' must be of type integer(1) and have a value greater than zero");
+    if(!Rf_isLogical(sparse) || Rf_length(sparse) != 1)
+        Rf_error("'sparse' must be of type logical(1)");
+    int sparse_c = (Rf_asLogical(sparse) == 1);
 
-    // open bam file
-    samfile_t *fin = 0;
-    fin = samopen(Rf_translateChar(STRING_ELT(bamfile, 0)), "rb", NULL);
-    if (fin == 0)
-        Rf_error("failed to open BAM file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (fin->header == 0 || fin->header->n_targets == 0) {
-        samclose(fin);
-        Rf_error("BAM header missing or empty in file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    }
-    // open bam index
-    bam_index_t *idx = 0;
-    idx = bam_index_load(Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (idx == 0){
-        samclose(fin);
-        Rf_error("failed to open BAM index for file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
+    // index the masked intervals by target, then open one bam file handle per thread (a single one for duplicate
+    // removal, which profiles the regions one by one) and get the shared bam index from the cache, before
+    // allocating anything that would leak on an error
+    const char *fname = Rf_translateChar(STRING_ELT(bamfile, 0));
+    regionMask *rmask = _profile_mask_init(fname, mask);
+    maskCursor mcursor;
+    int nt = (INTEGER(readBitMask)[0] & REMOVE_DUPLICATES) ? 1 : _get_nthreads(nthreads, Rf_length(tid));
+    int status;
+    bamCacheEntry *bce = 0;
+    samfile_t **fin = _bam_acquire_handles(fname, nt, &bce, &status);
+    if(fin == NULL){
+        _mask_free(rmask);
+        _bam_cache_error(fname, status);
     }
+    bam_index_t *idx = bce->idx;
 
     // initialise regionProfile
     int i, *profU_c;
@@ -335,25 +971,34 @@ SEXP profile_alignments_non_allelic(SEXP bamfile, SEXP profileids, SEXP tid, SEX
     int mu = INTEGER(maxUpBin)[0], md = INTEGER(maxDownBin)[0];
     int mw = mu+md+1;
     SEXP profU;
-    PROTECT(profU = allocMatrix(INTSXP, mw, profIdNum));
+    PROTECT(profU = allocMatrix(INTSXP, sparse_c ? 0 : mw, sparse_c ? 0 : profIdNum)); // no dense counts if sparse
     profU_c = INTEGER(profU);
-    for(i=0; i<mw*profIdNum; i++)
+    for(i=0; i<(sparse_c ? 0 : mw*profIdNum); i++)
         profU_c[i] = 0;
+    sparseCounts sc = {NULL, NULL, 0, 0, 0};
 
     regionProfile rprof;
     rprof.offset = INTEGER(maxUp)[0]; // base-space
     rprof.len = INTEGER(maxUp)[0] + INTEGER(maxDown)[0] + 1; // base-space
     rprof.shift = INTEGER(shift)[0];
-    rprof.readBitMask = (INTEGER(readBitMask)[0] & (BAM_FREAD1 + BAM_FREAD2));
-    rprof.skipSecondary = ((INTEGER(readBitMask)[0] & BAM_FSECONDARY) ? 0 : 1);
     rprof.selectReadPosition = Rf_translateChar(STRING_ELT(selectReadPosition, 0))[0];
     rprof.allelic = 0;
-    rprof.includeSpliced = (Rf_asLogical(includeSpliced) ? 1 : 0);
-    rprof.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    rprof.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
-    rprof.absIsizeMin = (uint32_t)(INTEGER(absIsizeMin)[0]);
-    rprof.absIsizeMax = (uint32_t)(INTEGER(absIsizeMax)[0]);
+    _filter_init(&rprof.filter, INTEGER(readBitMask)[0], INTEGER(mapqMin)[0], INTEGER(mapqMax)[0],
+                 INTEGER(absIsizeMin)[0], INTEGER(absIsizeMax)[0], Rf_asLogical(includeSpliced));
     rprof.binSize = (uint32_t)(INTEGER(binSize)[0]);
+    rprof.mask = (rmask != NULL ? &mcursor : NULL);
+    rprof.sparse = (sparse_c ? &sc : NULL);
+    rprof.profile = 0;
+    positionHash dups;
+    rprof.dups = NULL;
+    if(rprof.filter.dedup){
+        if(_position_hash_init(&dups) != 0){
+            _bam_close_handles(fin, nt, bce);
+            _mask_free(rmask);
+            Rf_error("failed to allocate memory for duplicate removal");
+        }
+        rprof.dups = &dups;
+    }
 
     // set shift for fetch to zero if smart shift
     int shift_f = abs(INTEGER(shift)[0]);
@@ -363,21 +1008,64 @@ SEXP profile_alignments_non_allelic(SEXP bamfile, SEXP profileids, SEXP tid, SEX
     // select bam_fetch callback function
     bam_fetch_f fetch_func = _addValidHitToSums;
 
-    // loop over query regions
-    for(i=0; i < Rf_length(tid); i++){
-        // setup region in rprof
-        rprof.sumU = profU_c + mw*profId[i];
-        rprof.start = INTEGER(start)[i];
-        rprof.end = INTEGER(end)[i];
-        rprof.ref = INTEGER(refpos)[i];
-        rprof.selstrand = Rf_translateChar(STRING_ELT(selstrand, i));
-        rprof.regstrand = Rf_translateChar(STRING_ELT(regstrand, i));
+    // profile all regions in a single sorted sweep, or with one bam_fetch() per region for duplicate removal
+    // (duplicates are recognized per region)
+    if(rprof.dups == NULL){
+        char xvValue;
+        rprof.sumU = profU_c;
+        _profile_sweep(fin, idx, nt, &rprof, tid, start, end, refpos, selstrand, regstrand, profId, mw,
+                       profIdNum, shift_f + INTEGER(broaden)[0], rmask, NULL, &xvValue);
+    } else {
+        // loop over query regions
+        for(i=0; i < Rf_length(tid); i++){
+            // setup region in rprof
+            if(sparse_c)
+                rprof.profile = profId[i];
+            else
+                rprof.sumU = profU_c + mw*profId[i];
+            rprof.start = INTEGER(start)[i];
+            rprof.end = INTEGER(end)[i];
+            rprof.ref = INTEGER(refpos)[i];
+            rprof.selstrand = _strand_from_string(Rf_translateChar(STRING_ELT(selstrand, i)));
+            rprof.regstrand = _strand_from_string(Rf_translateChar(STRING_ELT(regstrand, i)));
+            if(rprof.dups != NULL)
+                _position_hash_reset(rprof.dups);
+            if(rmask != NULL)
+                _mask_cursor_set(&mcursor, rmask, INTEGER(tid)[i], INTEGER(start)[i]-shift_f-INTEGER(broaden)[0]);
+
+            // process alignments that overlap region
+            bam_fetch(fin[0]->x.bam, idx, INTEGER(tid)[i],
+                      INTEGER(start)[i]-shift_f-INTEGER(broaden)[0], // 0-based inclusive start
+                      INTEGER(end)[i]+shift_f+INTEGER(broaden)[0],   // 0-based exclusive end
+                      &rprof, fetch_func);
+        }
+    }
 
-        // process alignments that overlap region
-        bam_fetch(fin->x.bam, idx, INTEGER(tid)[i],
-                  INTEGER(start)[i]-shift_f-INTEGER(broaden)[0], // 0-based inclusive start
-                  INTEGER(end)[i]+shift_f+INTEGER(broaden)[0],   // 0-based exclusive end
-                  &rprof, fetch_func);
+    // clean up
+    _bam_close_handles(fin, nt, bce);
+    int dups_full = 0;
+    if(rprof.dups != NULL){
+        dups_full = rprof.dups->full;
+        _position_hash_free(rprof.dups);
+    }
+    _mask_free(rmask);
+    if(dups_full){
+        if(sparse_c)
+            _sparse_free(&sc);
+        Rf_error("too many overlapping alignments for duplicate removal");
+    }
+
+    // compress sparse counts (profU is empty)
+    if(sparse_c){
+        if(sc.failed){
+            _sparse_free(&sc);
+            Rf_error("failed to allocate memory for sparse profiles");
+        }
+        SEXP res;
+        PROTECT(res = _sparse_to_csc(&sc, 1, profIdNum, mw));
+        _sparse_free(&sc);
+        UNPROTECT(2);
+        return res;
     }
 
     // set dim names
@@ -387,42 +1075,330 @@ SEXP profile_alignments_non_allelic(SEXP bamfile, SEXP profileids, SEXP tid, SEX
     SET_VECTOR_ELT(dimnames, 1, R_NilValue);
     setAttrib(profU, R_DimNamesSymbol, dimnames);
 
-    // clean up
-    samclose(fin);
-    bam_index_destroy(idx);
-
     UNPROTECT(2);
 
     return profU;
 }
 
+/*! @function
+  @abstract  Calculates the coverage of the profiles, i.e. the number of (non-masked) regions that contribute to
+             each profile and relative position, summed over the bins of binSize positions. The regions and
+             masked pieces of each profile are added to a difference array over the relative positions, which
+             is integrated and binned before moving to the next profile, so that memory does not grow with the
+             number of regions or profiles.
+  @param  profileids  profile of each region (1-based)
+  @param  upstream    number of positions upstream of the anchor covered by each region
+  @param  downstream  number of positions downstream of the anchor covered by each region
+  @param  maskquery   region of each masked piece (1-based)
+  @param  maskstart   first masked relative position of each masked piece (0-based, maxUp is the anchor)
+  @param  maskend     last masked relative position of each masked piece (0-based inclusive)
+  @param  maxUp       maximal upstream length of regions
+  @param  maxDown     maximal downstream length of regions
+  @param  binSize     size of counting bins that tile the relative positions
+  @return             integer matrix with one row per profile and one column per bin
+ */
+SEXP profile_coverage(SEXP profileids, SEXP upstream, SEXP downstream, SEXP maskquery, SEXP maskstart,
+                      SEXP maskend, SEXP maxUp, SEXP maxDown, SEXP binSize){
+    // check parameters
+    if(!Rf_isInteger(profileids) || !Rf_isInteger(upstream) || !Rf_isInteger(downstream))
+        Rf_error("'profileids', 'upstream' and 'downstream' must be of type integer");
+    int i, j, p, n = Rf_length(profileids);
+    if(Rf_length(upstream) != n || Rf_length(downstream) != n)
+        Rf_error("'profileids', 'upstream' and 'downstream' must have equal length");
+    if(!Rf_isInteger(maskquery) || !Rf_isInteger(maskstart) || !Rf_isInteger(maskend))
+        Rf_error("'maskquery', 'maskstart' and 'maskend' must be of type integer");
+    int nm = Rf_length(maskquery);
+    if(Rf_length(maskstart) != nm || Rf_length(maskend) != nm)
+        Rf_error("'maskquery', 'maskstart' and 'maskend' must have equal length");
+    if(!Rf_isInteger(maxUp) || Rf_length(maxUp) != 1 || !Rf_isInteger(maxDown) || Rf_length(maxDown) != 1 ||
+       INTEGER(maxUp)[0] < 0 || INTEGER(maxDown)[0] < 0)
+        Rf_error("'maxUp' and 'maxDown' must be of type integer(1) and not negative");
+    if(!Rf_isInteger(binSize) || Rf_length(binSize) != 1 || INTEGER(binSize)[0] < 1)
+        Rf_error("'binSize' must be a single value of type integer");
+    int width = INTEGER(maxUp)[0] + INTEGER(maxDown)[0] + 1, bs = INTEGER(binSize)[0], nbins = width / bs;
+    const int *pid_c = INTEGER(profileids), *up_c = INTEGER(upstream), *down_c = INTEGER(downstream);
+    const int *mq_c = INTEGER(maskquery), *ms_c = INTEGER(maskstart), *me_c = INTEGER(maskend);
+    int nprof = 0;
+    for(i = 0; i < n; i++){
+        if(pid_c[i] < 1)
+            Rf_error("'profileids' must be positive");
+        if(pid_c[i] > nprof)
+            nprof = pid_c[i];
+    }
+    for(i = 0; i < nm; i++)
+        if(mq_c[i] < 1 || mq_c[i] > n)
+            Rf_error("'maskquery' must refer to regions");
+
+    // group regions and masked pieces by profile (counting sort)
+    int *roff = (int*) R_Calloc(nprof + 2, int), *moff = (int*) R_Calloc(nprof + 2, int);
+    int *ridx = (int*) R_Calloc(n > 0 ? n : 1, int), *midx = (int*) R_Calloc(nm > 0 ? nm : 1, int);
+    for(i = 0; i < n; i++)
+        roff[pid_c[i] + 1]++;
+    for(i = 0; i < nm; i++)
+        moff[pid_c[mq_c[i] - 1] + 1]++;
+    for(p = 1; p <= nprof; p++){
+        roff[p + 1] += roff[p];
+        moff[p + 1] += moff[p];
+    }
+    for(i = 0; i < n; i++)
+        ridx[roff[pid_c[i]]++] = i;
+    for(i = 0; i < nm; i++)
+        midx[moff[pid_c[mq_c[i] - 1]]++] = i;
+    // (each offset now points to the end of its group: the group of profile p is roff[p-1] to roff[p]-1)
+
+    // integrate the difference array of each profile and sum into bins
+    SEXP cvg;
+    PROTECT(cvg = allocMatrix(INTSXP, nprof, nbins));
+    int *cvg_c = INTEGER(cvg);
+    int *diff = (int*) R_Calloc(width + 1, int);
+    int a, b, cur;
+    for(p = 1; p <= nprof; p++){
+        for(j = 0; j <= width; j++)
+            diff[j] = 0;
+        for(j = (p > 1 ? roff[p - 1] : 0); j < roff[p]; j++){
+            i = ridx[j];
+            a = INTEGER(maxUp)[0] - up_c[i];
+            b = INTEGER(maxUp)[0] + down_c[i];
+            if(a < 0) a = 0;
+            if(b > width - 1) b = width - 1;
+            if(a <= b){
+                diff[a] += 1;
+                diff[b + 1] -= 1;
+            }
+        }
+        for(j = (p > 1 ? moff[p - 1] : 0); j < moff[p]; j++){
+            i = midx[j];
+            a = ms_c[i] < 0 ? 0 : ms_c[i];
+            b = me_c[i] > width - 1 ? width - 1 : me_c[i];
+            if(a <= b){
+                diff[a] -= 1;
+                diff[b + 1] += 1;
+            }
+        }
+        for(j = 0; j < nbins; j++)
+            cvg_c[(size_t)j * nprof + (p - 1)] = 0;
+        for(j = 0, cur = 0; j < width; j++){
+            cur += diff[j];
+            if(j / bs < nbins)
+                cvg_c[(size_t)(j / bs) * nprof + (p - 1)] += cur;
+        }
+    }
+
+    // clean up
+    R_Free(roff);
+    R_Free(moff);
+    R_Free(ridx);
+    R_Free(midx);
+    R_Free(diff);
+
+    UNPROTECT(1);
+
+    return cvg;
+}
+
+/*! @function
+  @abstract  Counts alignments by position in regions like profile_alignments_non_allelic, but only returns the
+             aggregates over the regions of each profile: the counts of a region are collected in a window of
+             maxUpBin+maxDownBin+1 bins that is added to the profile sums and sums of squares when the region is
+             done, so that memory does not grow with the number of regions per profile (except for the total
+             count of each region, which is part of the result). The regions are profiled in the sorted sweep of
+             profile_alignments_non_allelic (with private aggregates of each thread), or with one bam_fetch() per
+             region for duplicate removal.
+  @param  bamfile ... nthreads    identical to profile_alignments_non_allelic
+  @return          list with elements "sum" (integer matrix with bins in rows and profiles in columns, as returned
+                   by profile_alignments_non_allelic), "sumSq" (numeric matrix with the sums of squared counts
+                   of the individual regions) and "total" (integer vector with the total count of each region)
+ */
+SEXP profile_alignments_aggregate(SEXP bamfile, SEXP profileids, SEXP tid, SEXP start, SEXP end, SEXP refpos,
+                                  SEXP selstrand, SEXP regstrand, SEXP selectReadPosition, SEXP readBitMask,
+                                  SEXP shift, SEXP broaden, SEXP maxUp, SEXP maxDown, SEXP maxUpBin, SEXP maxDownBin,
+                                  SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
+                                  SEXP binSize, SEXP binNames, SEXP mask, SEXP nthreads){
+
+    // check parameters
+    _verify_profile_parameters(bamfile, profileids, tid, start, end, refpos, selstrand, regstrand,
+                               selectReadPosition, readBitMask, shift, broaden, maxUp, maxDown,
+                               maxUpBin, maxDownBin, includeSpliced,
+			                   mapqMin, mapqMax, absIsizeMin, absIsizeMax, binSize, binNames);
+    if(!Rf_isInteger(nthreads) || Rf_length(nthreads) != 1 || INTEGER(nthreads)[0] < 1)
+        Rf_error("'nthreads' must be of type integer(1) and have a value greater than zero");
+
+    // index the masked intervals by target, then open one bam file handle per thread (a single one for duplicate
+    // removal, which profiles the regions one by one) and get the shared bam index from the cache, before
+    // allocating anything that would leak on an error
+    const char *fname = Rf_translateChar(STRING_ELT(bamfile, 0));
+    regionMask *rmask = _profile_mask_init(fname, mask);
+    maskCursor mcursor;
+    int nt = (INTEGER(readBitMask)[0] & REMOVE_DUPLICATES) ? 1 : _get_nthreads(nthreads, Rf_length(tid));
+    int status;
+    bamCacheEntry *bce = 0;
+    samfile_t **fin = _bam_acquire_handles(fname, nt, &bce, &status);
+    if(fin == NULL){
+        _mask_free(rmask);
+        _bam_cache_error(fname, status);
+    }
+    bam_index_t *idx = bce->idx;
+
+    // initialise aggregates
+    int i, j, *sum_c, *total_c;
+    double *sumSq_c;
+    int *profId = INTEGER(profileids);
+    for(i=Rf_length(tid)-1; i>=0; i--)
+        profId[i] = profId[i] - profId[0];
+    int profIdNum = profId[Rf_length(tid)-1] + 1;
+    int mu = INTEGER(maxUpBin)[0], md = INTEGER(maxDownBin)[0];
+    int mw = mu+md+1;
+    SEXP sum, sumSq, total;
+    PROTECT(sum = allocMatrix(INTSXP, mw, profIdNum));
+    PROTECT(sumSq = allocMatrix(REALSXP, mw, profIdNum));
+    PROTECT(total = allocVector(INTSXP, Rf_length(tid)));
+    sum_c = INTEGER(sum);
+    sumSq_c = REAL(sumSq);
+    total_c = INTEGER(total);
+    for(i=0; i<mw*profIdNum; i++){
+        sum_c[i] = 0;
+        sumSq_c[i] = 0.0;
+    }
+    for(i=0; i<Rf_length(tid); i++)
+        total_c[i] = 0;
+
+    // initialise regionProfile (with a single window that is reused for all regions by the bam_fetch() loop)
+    regionProfile rprof;
+    rprof.sumU = (int*) R_Calloc(mw, int);
+    rprof.offset = INTEGER(maxUp)[0]; // base-space
+    rprof.len = INTEGER(maxUp)[0] + INTEGER(maxDown)[0] + 1; // base-space
+    rprof.shift = INTEGER(shift)[0];
+    rprof.selectReadPosition = Rf_translateChar(STRING_ELT(selectReadPosition, 0))[0];
+    rprof.allelic = 0;
+    _filter_init(&rprof.filter, INTEGER(readBitMask)[0], INTEGER(mapqMin)[0], INTEGER(mapqMax)[0],
+                 INTEGER(absIsizeMin)[0], INTEGER(absIsizeMax)[0], Rf_asLogical(includeSpliced));
+    rprof.binSize = (uint32_t)(INTEGER(binSize)[0]);
+    rprof.mask = (rmask != NULL ? &mcursor : NULL);
+    rprof.sparse = NULL;
+    positionHash dups;
+    rprof.dups = NULL;
+    if(rprof.filter.dedup){
+        if(_position_hash_init(&dups) != 0){
+            _bam_close_handles(fin, nt, bce);
+            _mask_free(rmask);
+            R_Free(rprof.sumU);
+            Rf_error("failed to allocate memory for duplicate removal");
+        }
+        rprof.dups = &dups;
+    }
+
+    // set shift for fetch to zero if smart shift
+    int shift_f = abs(INTEGER(shift)[0]);
+    if(INTEGER(shift)[0] == SMART_SHIFT)
+        shift_f = 0;
+
+    // select bam_fetch callback function
+    bam_fetch_f fetch_func = _addValidHitToSums;
+
+    // aggregate all regions in a single sorted sweep, or with one bam_fetch() per region for duplicate removal
+    // (duplicates are recognized per region)
+    int agg_failed = 0;
+    if(rprof.dups == NULL){
+        char xvValue;
+        profileAggregate agg = {sum_c, sumSq_c, total_c, NULL, 0, 0};
+        _profile_sweep(fin, idx, nt, &rprof, tid, start, end, refpos, selstrand, regstrand, profId, mw,
+                       profIdNum, shift_f + INTEGER(broaden)[0], rmask, &agg, &xvValue);
+        agg_failed = agg.failed;
+    } else {
+        // loop over query regions
+        for(i=0; i < Rf_length(tid); i++){
+            // setup region in rprof
+            rprof.start = INTEGER(start)[i];
+            rprof.end = INTEGER(end)[i];
+            rprof.ref = INTEGER(refpos)[i];
+            rprof.selstrand = _strand_from_string(Rf_translateChar(STRING_ELT(selstrand, i)));
+            rprof.regstrand = _strand_from_string(Rf_translateChar(STRING_ELT(regstrand, i)));
+            _position_hash_reset(rprof.dups);
+            if(rmask != NULL)
+                _mask_cursor_set(&mcursor, rmask, INTEGER(tid)[i], INTEGER(start)[i]-shift_f-INTEGER(broaden)[0]);
+
+            // process alignments that overlap region
+            bam_fetch(fin[0]->x.bam, idx, INTEGER(tid)[i],
+                      INTEGER(start)[i]-shift_f-INTEGER(broaden)[0], // 0-based inclusive start
+                      INTEGER(end)[i]+shift_f+INTEGER(broaden)[0],   // 0-based exclusive end
+                      &rprof, fetch_func);
+
+            // add the window of the region to the aggregates of its profile and clear it
+            for(j=0; j<mw; j++){
+                sum_c[mw*profId[i] + j] += rprof.sumU[j];
+                sumSq_c[mw*profId[i] + j] += (double)rprof.sumU[j] * (double)rprof.sumU[j];
+                total_c[i] += rprof.sumU[j];
+                rprof.sumU[j] = 0;
+            }
+        }
+    }
+
+    // set dim names
+    SEXP dimnames, res, resnames;
+    PROTECT(dimnames = allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, binNames);
+    SET_VECTOR_ELT(dimnames, 1, R_NilValue);
+    setAttrib(sum, R_DimNamesSymbol, dimnames);
+    setAttrib(sumSq, R_DimNamesSymbol, dimnames);
+
+    // pack results into list
+    PROTECT(res = allocVector(VECSXP, 3));
+    PROTECT(resnames = allocVector(STRSXP, 3));
+    SET_STRING_ELT(resnames, 0, mkChar("sum"));
+    SET_STRING_ELT(resnames, 1, mkChar("sumSq"));
+    SET_STRING_ELT(resnames, 2, mkChar("total"));
+    SET_VECTOR_ELT(res, 0, sum);
+    SET_VECTOR_ELT(res, 1, sumSq);
+    SET_VECTOR_ELT(res, 2, total);
+    setAttrib(res, R_NamesSymbol, resnames);
+
+    // clean up
+    _bam_close_handles(fin, nt, bce);
+    int dups_full = 0;
+    if(rprof.dups != NULL){
+        dups_full = rprof.dups->full;
+        _position_hash_free(rprof.dups);
+    }
+    _mask_free(rmask);
+    R_Free(rprof.sumU);
+    if(dups_full)
+        Rf_error("too many overlapping alignments for duplicate removal");
+    if(agg_failed)
+        Rf_error("failed to allocate memory for aggregate profiles");
+
+    UNPROTECT(6);
+
+    return res;
+}
+
 SEXP profile_alignments_allelic(SEXP bamfile, SEXP profileids, SEXP tid, SEXP start, SEXP end, SEXP refpos,
                                 SEXP selstrand, SEXP regstrand, SEXP selectReadPosition, SEXP readBitMask,
                                 SEXP shift, SEXP broaden, SEXP maxUp, SEXP maxDown, SEXP maxUpBin, SEXP maxDownBin,
                                 SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
-                                SEXP binSize, SEXP binNames){
+                                SEXP binSize, SEXP binNames, SEXP mask, SEXP nthreads){
     // check parameters
     _verify_profile_parameters(bamfile, profileids, tid, start, end, refpos, selstrand, regstrand,
                                selectReadPosition, readBitMask, shift, broaden, maxUp, maxDown,
                                maxUpBin, maxDownBin, includeSpliced,
 			                   mapqMin, mapqMax, absIsizeMin, absIsizeMax, binSize, binNames);
+    if(!Rf_isInteger(nthreads) || Rf_length(nthreads) != 1 || INTEGER(nthreads)[0] < 1)
+        Rf_error("'nthreads' must be of type integer(1) and have a value greater than zero");
 
-    // open bam file
-    samfile_t *fin = 0;
-    fin = samopen(Rf_translateChar(STRING_ELT(bamfile, 0)), "rb", NULL);
-    if (fin == 0)
-        Rf_error("failed to open BAM file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (fin->header == 0 || fin->header->n_targets == 0) {
-        samclose(fin);
-        Rf_error("BAM header missing or empty in file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
-    }
-    // open bam index
-    bam_index_t *idx = 0;
-    idx = bam_index_load(Rf_translateChar(STRING_ELT(bamfile, 0)));
-    if (idx == 0){
-        samclose(fin);
-        Rf_error("failed to open BAM index for file: '%s'", Rf_translateChar(STRING_ELT(bamfile, 0)));
+    // index the masked intervals by target, then open one bam file handle per thread (a single one for duplicate
+    // removal, which profiles the regions one by one) and get the shared bam index from the cache, before
+    // allocating anything that would leak on an error
+    const char *fname = Rf_translateChar(STRING_ELT(bamfile, 0));
+    regionMask *rmask = _profile_mask_init(fname, mask);
+    maskCursor mcursor;
+    int nt = (INTEGER(readBitMask)[0] & REMOVE_DUPLICATES) ? 1 : _get_nthreads(nthreads, Rf_length(tid));
+    int status;
+    bamCacheEntry *bce = 0;
+    samfile_t **fin = _bam_acquire_handles(fname, nt, &bce, &status);
+    if(fin == NULL){
+        _mask_free(rmask);
+        _bam_cache_error(fname, status);
     }
+    bam_index_t *idx = bce->idx;
 
     // initialise regionProfile
     int i, *profU_c, *profR_c, *profA_c;
@@ -446,16 +1422,23 @@ SEXP profile_alignments_allelic(SEXP bamfile, SEXP profileids, SEXP tid, SEXP st
     rprof.offset = INTEGER(maxUp)[0]; // base-space
     rprof.len = INTEGER(maxUp)[0] + INTEGER(maxDown)[0] + 1; // base-space
     rprof.shift = INTEGER(shift)[0];
-    rprof.readBitMask = (INTEGER(readBitMask)[0] & (BAM_FREAD1 + BAM_FREAD2));
-    rprof.skipSecondary = ((INTEGER(readBitMask)[0] & BAM_FSECONDARY) ? 0 : 1);
     rprof.selectReadPosition = Rf_translateChar(STRING_ELT(selectReadPosition, 0))[0];
     rprof.allelic = 1;
-    rprof.includeSpliced = (Rf_asLogical(includeSpliced) ? 1 : 0);
-    rprof.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    rprof.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
-    rprof.absIsizeMin = (uint32_t)(INTEGER(absIsizeMin)[0]);
-    rprof.absIsizeMax = (uint32_t)(INTEGER(absIsizeMax)[0]);
+    _filter_init(&rprof.filter, INTEGER(readBitMask)[0], INTEGER(mapqMin)[0], INTEGER(mapqMax)[0],
+                 INTEGER(absIsizeMin)[0], INTEGER(absIsizeMax)[0], Rf_asLogical(includeSpliced));
     rprof.binSize = (uint32_t)(INTEGER(binSize)[0]);
+    rprof.mask = (rmask != NULL ? &mcursor : NULL);
+    rprof.sparse = NULL;
+    positionHash dups;
+    rprof.dups = NULL;
+    if(rprof.filter.dedup){
+        if(_position_hash_init(&dups) != 0){
+            _bam_close_handles(fin, nt, bce);
+            _mask_free(rmask);
+            Rf_error("failed to allocate memory for duplicate removal");
+        }
+        rprof.dups = &dups;
+    }
 
     // set shift for fetch to zero if smart shift
     int shift_f = abs(INTEGER(shift)[0]);
@@ -465,23 +1448,39 @@ SEXP profile_alignments_allelic(SEXP bamfile, SEXP profileids, SEXP tid, SEXP st
     // select bam_fetch callback function
     bam_fetch_f fetch_func = _addValidHitToSums;
 
-    // loop over query regions
-    for(i=0; i < Rf_length(tid); i++){
-        // setup region in rprof
-        rprof.sumU = profU_c + mw*profId[i];
-        rprof.sumR = profR_c + mw*profId[i];
-        rprof.sumA = profA_c + mw*profId[i];
-        rprof.start = INTEGER(start)[i];
-        rprof.end = INTEGER(end)[i];
-        rprof.ref = INTEGER(refpos)[i];
-        rprof.selstrand = Rf_translateChar(STRING_ELT(selstrand, i));
-        rprof.regstrand = Rf_translateChar(STRING_ELT(regstrand, i));
-
-        // process alignments that overlap region
-        bam_fetch(fin->x.bam, idx, INTEGER(tid)[i],
-                  INTEGER(start)[i]-shift_f-INTEGER(broaden)[0], // 0-based inclusive start
-                  INTEGER(end)[i]+shift_f+INTEGER(broaden)[0],   // 0-based exclusive end
-                  &rprof, fetch_func);
+    // profile all regions in a single sorted sweep, or with one bam_fetch() per region for duplicate removal
+    // (duplicates are recognized per region)
+    int xvError = 0;
+    char xvValue = 0;
+    if(rprof.dups == NULL){
+        rprof.sumU = profU_c;
+        rprof.sumR = profR_c;
+        rprof.sumA = profA_c;
+        xvError = _profile_sweep(fin, idx, nt, &rprof, tid, start, end, refpos, selstrand, regstrand, profId, mw,
+                                 profIdNum, shift_f + INTEGER(broaden)[0], rmask, NULL, &xvValue);
+    } else {
+        // loop over query regions
+        for(i=0; i < Rf_length(tid); i++){
+            // setup region in rprof
+            rprof.sumU = profU_c + mw*profId[i];
+            rprof.sumR = profR_c + mw*profId[i];
+            rprof.sumA = profA_c + mw*profId[i];
+            rprof.start = INTEGER(start)[i];
+            rprof.end = INTEGER(end)[i];
+            rprof.ref = INTEGER(refpos)[i];
+            rprof.selstrand = _strand_from_string(Rf_translateChar(STRING_ELT(selstrand, i)));
+            rprof.regstrand = _strand_from_string(Rf_translateChar(STRING_ELT(regstrand, i)));
+            if(rprof.dups != NULL)
+                _position_hash_reset(rprof.dups);
+            if(rmask != NULL)
+                _mask_cursor_set(&mcursor, rmask, INTEGER(tid)[i], INTEGER(start)[i]-shift_f-INTEGER(broaden)[0]);
+
+            // process alignments that overlap region
+            bam_fetch(fin[0]->x.bam, idx, INTEGER(tid)[i],
+                      INTEGER(start)[i]-shift_f-INTEGER(broaden)[0], // 0-based inclusive start
+                      INTEGER(end)[i]+shift_f+INTEGER(broaden)[0],   // 0-based exclusive end
+                      &rprof, fetch_func);
+        }
     }
 
     // set dim names
@@ -506,8 +1505,19 @@ SEXP profile_alignments_allelic(SEXP bamfile, SEXP profileids, SEXP tid, SEXP st
     setAttrib(prof, R_NamesSymbol, attrib);
 
     // clean up
-    samclose(fin);
-    bam_index_destroy(idx);
+    _bam_close_handles(fin, nt, bce);
+    int dups_full = 0;
+    if(rprof.dups != NULL){
+        dups_full = rprof.dups->full;
+        _position_hash_free(rprof.dups);
+    }
+    _mask_free(rmask);
+    if(dups_full)
+        Rf_error("too many overlapping alignments for duplicate removal");
+    if(xvError == XV_MISSING)
+        Rf_error("XV tag missing but needed for allele-specific counting");
+    else if(xvError == XV_INVALID)
+        Rf_error("'%c' is not a valid XV tag value; should be one of 'U','R' or 'A'", xvValue);
 
     UNPROTECT(6);
 
@@ -8,11 +8,19 @@ SEXP profile_alignments_non_allelic(SEXP bamfile, SEXP targetprofile, SEXP tid,
                                     SEXP selstrand, SEXP regstrand, SEXP selectReadPosition, SEXP readBitMask,
                                     SEXP shift, SEXP broaden, SEXP maxUp, SEXP maxDown, SEXP maxUpBin, SEXP maxDownBin,
                                     SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
-                                    SEXP binSize, SEXP binNames);
+                                    SEXP binSize, SEXP binNames, SEXP mask, SEXP nthreads, SEXP sparse);
 
 SEXP profile_alignments_allelic(SEXP bamfile, SEXP targetprofile, SEXP tid, SEXP start, SEXP end, SEXP refpos,
                                 SEXP selstrand, SEXP regstrand, SEXP selectReadPosition, SEXP readBitMask,
                                 SEXP shift, SEXP broaden, SEXP maxUp, SEXP maxDown, SEXP maxUpBin, SEXP maxDownBin,
                                 SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
-                                SEXP binSize, SEXP binNames);
+                                SEXP binSize, SEXP binNames, SEXP mask, SEXP nthreads);
 
+SEXP profile_alignments_aggregate(SEXP bamfile, SEXP targetprofile, SEXP tid, SEXP start, SEXP end, SEXP refpos,
+                                  SEXP selstrand, SEXP regstrand, SEXP selectReadPosition, SEXP readBitMask,
+                                  SEXP shift, SEXP broaden, SEXP maxUp, SEXP maxDown, SEXP maxUpBin, SEXP maxDownBin,
+                                  SEXP includeSpliced, SEXP mapqMin, SEXP mapqMax, SEXP absIsizeMin, SEXP absIsizeMax,
+                                  SEXP binSize, SEXP binNames, SEXP mask, SEXP nthreads);
+
+SEXP profile_coverage(SEXP profileids, SEXP upstream, SEXP downstream, SEXP maskquery, SEXP maskstart,
+                      SEXP maskend, SEXP maxUp, SEXP maxDown, SEXP binSize);
@@ -31,8 +31,7 @@ typedef struct { // for use with addHitToCounts(), bam_fetch callback function o
     bool *op; // output     (plus)
     bool *om; // output     (minus)
     uint32_t offset; // region offset
-    uint8_t mapqMin; // minimum mapping quality (MAPQ >= mapqMin)
-    uint8_t mapqMax; // maximum mapping quality (MAPQ <= mapqMax)
+    alignmentFilter filter; // alignment filter (MAPQ range)
 } methCounters;
 
 typedef struct { // for use with addHitToSNP(), bam_fetch callback function of detect_SNVs()
@@ -42,8 +41,7 @@ typedef struct { // for use with addHitToSNP(), bam_fetch callback function of d
     bool *targetC;
     bool *targetG;
     uint32_t offset; // region offset
-    uint8_t mapqMin; // minimum mapping quality (MAPQ >= mapqMin)
-    uint8_t mapqMax; // maximum mapping quality (MAPQ <= mapqMax)
+    alignmentFilter filter; // alignment filter (MAPQ range)
 } snpCounters;
 
 typedef struct { // for use with addHitToCountsAllele(), bam_fetch callback function of quantify_methylation_allele()
@@ -54,8 +52,7 @@ typedef struct { // for use with addHitToCountsAllele(), bam_fetch callback func
     bool *op; // output     (plus)
     bool *om; // output     (minus)
     uint32_t offset; // region offset
-    uint8_t mapqMin; // minimum mapping quality (MAPQ >= mapqMin)
-    uint8_t mapqMax; // maximum mapping quality (MAPQ <= mapqMax)
+    alignmentFilter filter; // alignment filter (MAPQ range)
 } methCountersAllele;
 
 typedef struct { // for use with addHitToCountsSingleAlignments(), bam_fetch callback function of quantify_methylation_singleAlignments()
@@ -67,8 +64,7 @@ typedef struct { // for use with addHitToCountsSingleAlignments(), bam_fetch cal
     bool *op; // output     (plus)
     bool *om; // output     (minus)
     uint32_t offset; // region offset
-    uint8_t mapqMin; // minimum mapping quality (MAPQ >= mapqMin)
-    uint8_t mapqMax; // maximum mapping quality (MAPQ <= mapqMax)
+    alignmentFilter filter; // alignment filter (MAPQ range)
 } methCountersSingleAlignments;
 
 const inline int alleleFlagToInt(char xv) {
@@ -101,7 +97,7 @@ static int addHitToCounts(const bam1_t *hit, void *data) { // bam_fetch callback
   cnt = (methCounters*) data;
 
   // skip alignment if mapping quality not in specified range
-  if(hit->core.qual < cnt->mapqMin || hit->core.qual > cnt->mapqMax)
+  if(!_filter_pass(&cnt->filter, hit))
       return 0;
     
   hitseq = bam1_seq(hit);
@@ -157,7 +153,7 @@ static int addHitToSNP(const bam1_t *hit, void *data) { // bam_fetch callback fu
     cnt = (snpCounters*) data;
 
     // skip alignment if mapping quality not in specified range
-    if(hit->core.qual < cnt->mapqMin || hit->core.qual > cnt->mapqMax)
+    if(!_filter_pass(&cnt->filter, hit))
         return 0;
     
     hitseq = bam1_seq(hit);
@@ -208,7 +204,7 @@ static int addHitToCountsAllele(const bam1_t *hit, void *data) { // bam_fetch ca
   cnt = (methCountersAllele*) data;
 
   // skip alignment if mapping quality not in specified range
-  if(hit->core.qual < cnt->mapqMin || hit->core.qual > cnt->mapqMax)
+  if(!_filter_pass(&cnt->filter, hit))
       return 0;
     
   hitseq = bam1_seq(hit);
@@ -261,7 +257,7 @@ static int addHitToCountsSingleAlignments(const bam1_t *hit, void *data) { // ba
   cnt = (methCountersSingleAlignments*) data;
 
   // skip alignment if mapping quality not in specified range
-  if(hit->core.qual < cnt->mapqMin || hit->core.qual > cnt->mapqMax)
+  if(!_filter_pass(&cnt->filter, hit))
       return 0;
     
   hitseq = bam1_seq(hit);
@@ -466,8 +462,8 @@ SEXP quantify_methylation(SEXP infiles, SEXP regionChr, SEXP regionChrLen, SEXP
     data.op = outputPlus;
     data.om = outputMinus;
     data.offset = (uint32_t)(start - leftextension);
-    data.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    data.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
+    _filter_init(&data.filter, BAM_FREAD1 | BAM_FREAD2 | BAM_FSECONDARY, INTEGER(mapqMin)[0], INTEGER(mapqMax)[0],
+                 NO_ISIZE_FILTER, NO_ISIZE_FILTER, 1);
 
     // scan seq and initialize counters
     _scanSeqForCG(mode_int, seq, seqlen, leftextension, outputPlus, outputMinus, &nOutputPlus, &nOutputMinus, &nOutput);
@@ -476,12 +472,12 @@ SEXP quantify_methylation(SEXP infiles, SEXP regionChr, SEXP regionChrLen, SEXP
     bam1_t *hit = bam_init1();
     samfile_t *fin;
     bam_index_t *idx;
+    bamCacheEntry *bce;
 
     for(i=0; i<nbIn; i++) {
-	fin = _bam_tryopen(inf[i], "rb", NULL);
-	idx = bam_index_load(inf[i]); // load BAM index
-	if (idx == 0)
-	    Rf_error("BAM index for '%s' unavailable\n", inf[i]);
+	bce = _bam_cache_tryopen(inf[i]); // get BAM file and index from the cache
+	fin = bce->fin;
+	idx = bce->idx;
 
 
 	// get target id
@@ -489,8 +485,10 @@ SEXP quantify_methylation(SEXP infiles, SEXP regionChr, SEXP regionChrLen, SEXP
 	while(strcmp(fin->header->target_name[tid], target_name) && tid+1<fin->header->n_targets)
 	    tid++;
 
-	if(strcmp(fin->header->target_name[tid], target_name))
+	if(strcmp(fin->header->target_name[tid], target_name)) {
+	    _bam_cache_release(bce);
 	    Rf_error("could not find target '%s' in bam header of '%s'.\n", target_name, inf[i]);
+	}
 
 
 	// call addHitToCounts on all alignments in region
@@ -498,8 +496,7 @@ SEXP quantify_methylation(SEXP infiles, SEXP regionChr, SEXP regionChrLen, SEXP
 
 
 	// clean bam file objects
-	bam_index_destroy(idx);
-	samclose(fin);
+	_bam_cache_release(bce);
     }
 
     bam_destroy1(hit);
@@ -639,8 +636,8 @@ SEXP detect_SNVs(SEXP infiles, SEXP regionChr, SEXP regionChrLen, SEXP regionSta
     data.targetC = targetC;
     data.targetG = targetG;
     data.offset  = (uint32_t)(start - leftextension);
-    data.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    data.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
+    _filter_init(&data.filter, BAM_FREAD1 | BAM_FREAD2 | BAM_FSECONDARY, INTEGER(mapqMin)[0], INTEGER(mapqMax)[0],
+                 NO_ISIZE_FILTER, NO_ISIZE_FILTER, 1);
 
     // only C's or G's in CpG context
     for(i=0; i<seqlen-1; i++)
@@ -654,12 +651,12 @@ SEXP detect_SNVs(SEXP infiles, SEXP regionChr, SEXP regionChrLen, SEXP regionSta
     bam1_t *hit = bam_init1();
     samfile_t *fin;
     bam_index_t *idx;
+    bamCacheEntry *bce;
 
     for(i=0; i<nbIn; i++) {
-	fin = _bam_tryopen(inf[i], "rb", NULL);
-	idx = bam_index_load(inf[i]); // load BAM index
-	if (idx == 0)
-	    Rf_error("BAM index for '%s' unavailable\n", inf[i]);
+	bce = _bam_cache_tryopen(inf[i]); // get BAM file and index from the cache
+	fin = bce->fin;
+	idx = bce->idx;
 
 
 	// get target id
@@ -667,16 +664,17 @@ SEXP detect_SNVs(SEXP infiles, SEXP regionChr, SEXP regionChrLen, SEXP regionSta
 	while(strcmp(fin->header->target_name[tid], target_name) && tid+1<fin->header->n_targets)
 	    tid++;
 
-	if(strcmp(fin->header->target_name[tid], target_name))
+	if(strcmp(fin->header->target_name[tid], target_name)) {
+	    _bam_cache_release(bce);
 	    Rf_error("could not find target '%s' in bam header of '%s'.\n", target_name, inf[i]);
+	}
 
 	// call addHitToCounts on all alignments in region
 	bam_fetch(fin->x.bam, idx, tid, start, end, &data, &addHitToSNP);
 
 
 	// clean bam file objects
-	bam_index_destroy(idx);
-	samclose(fin);
+	_bam_cache_release(bce);
     }
 
     bam_destroy1(hit);
@@ -804,8 +802,8 @@ SEXP quantify_methylation_allele(SEXP infiles, SEXP regionChr, SEXP regionChrLen
     data.op = outputPlus;
     data.om = outputMinus;
     data.offset = (uint32_t)(start - leftextension);
-    data.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    data.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
+    _filter_init(&data.filter, BAM_FREAD1 | BAM_FREAD2 | BAM_FSECONDARY, INTEGER(mapqMin)[0], INTEGER(mapqMax)[0],
+                 NO_ISIZE_FILTER, NO_ISIZE_FILTER, 1);
 
     // scan seq and initialize counters
     _scanSeqForCG(mode_int, seq, seqlen, leftextension, outputPlus, outputMinus, &nOutputPlus, &nOutputMinus, &nOutput);
@@ -814,12 +812,12 @@ SEXP quantify_methylation_allele(SEXP infiles, SEXP regionChr, SEXP regionChrLen
     bam1_t *hit = bam_init1();
     samfile_t *fin;
     bam_index_t *idx;
+    bamCacheEntry *bce;
 
     for(i=0; i<nbIn; i++) {
-	fin = _bam_tryopen(inf[i], "rb", NULL);
-	idx = bam_index_load(inf[i]); // load BAM index
-	if (idx == 0)
-	    Rf_error("BAM index for '%s' unavailable\n", inf[i]);
+	bce = _bam_cache_tryopen(inf[i]); // get BAM file and index from the cache
+	fin = bce->fin;
+	idx = bce->idx;
 
 
 	// get target id
@@ -827,8 +825,10 @@ SEXP quantify_methylation_allele(SEXP infiles, SEXP regionChr, SEXP regionChrLen
 	while(strcmp(fin->header->target_name[tid], target_name) && tid+1<fin->header->n_targets)
 	    tid++;
 
-	if(strcmp(fin->header->target_name[tid], target_name))
+	if(strcmp(fin->header->target_name[tid], target_name)) {
+	    _bam_cache_release(bce);
 	    Rf_error("could not find target '%s' in bam header of '%s'.\n", target_name, inf[i]);
+	}
 
 
 	// call addHitToCounts on all alignments in region
@@ -836,8 +836,7 @@ SEXP quantify_methylation_allele(SEXP infiles, SEXP regionChr, SEXP regionChrLen
 
 
 	// clean bam file objects
-	bam_index_destroy(idx);
-	samclose(fin);
+	_bam_cache_release(bce);
     }
 
     bam_destroy1(hit);
@@ -1032,8 +1031,8 @@ SEXP quantify_methylation_singleAlignments(SEXP infiles, SEXP regionChr, SEXP re
     data.op = outputPlus;
     data.om = outputMinus;
     data.offset = (uint32_t)(start - leftextension);
-    data.mapqMin = (uint8_t)(INTEGER(mapqMin)[0]);
-    data.mapqMax = (uint8_t)(INTEGER(mapqMax)[0]);
+    _filter_init(&data.filter, BAM_FREAD1 | BAM_FREAD2 | BAM_FSECONDARY, INTEGER(mapqMin)[0], INTEGER(mapqMax)[0],
+                 NO_ISIZE_FILTER, NO_ISIZE_FILTER, 1);
 
     // scan seq and initialize counters
     _scanSeqForCG(mode_int, seq, seqlen, leftextension, outputPlus, outputMinus, &nOutputPlus, &nOutputMinus, &nOutput);
@@ -1042,12 +1041,12 @@ SEXP quantify_methylation_singleAlignments(SEXP infiles, SEXP regionChr, SEXP re
     bam1_t *hit = bam_init1();
     samfile_t *fin;
     bam_index_t *idx;
+    bamCacheEntry *bce;
 
     for(i=0; i<nbIn; i++) {
-	fin = _bam_tryopen(inf[i], "rb", NULL);
-	idx = bam_index_load(inf[i]); // load BAM index
-	if (idx == 0)
-	    Rf_error("BAM index for '%s' unavailable\n", inf[i]);
+	bce = _bam_cache_tryopen(inf[i]); // get BAM file and index from the cache
+	fin = bce->fin;
+	idx = bce->idx;
 
 
 	// get target id
@@ -1055,8 +1054,10 @@ SEXP quantify_methylation_singleAlignments(SEXP infiles, SEXP regionChr, SEXP re
 	while(strcmp(fin->header->target_name[tid], target_name) && tid+1<fin->header->n_targets)
 	    tid++;
 
-	if(strcmp(fin->header->target_name[tid], target_name))
+	if(strcmp(fin->header->target_name[tid], target_name)) {
+	    _bam_cache_release(bce);
 	    Rf_error("could not find target '%s' in bam header of '%s'.\n", target_name, inf[i]);
+	}
 
 
 	// call addHitToCountsSingleAlignments on all alignments in region
@@ -1064,8 +1065,7 @@ SEXP quantify_methylation_singleAlignments(SEXP infiles, SEXP regionChr, SEXP re
 
 
 	// clean bam file objects
-	bam_index_destroy(idx);
-	samclose(fin);
+	_bam_cache_release(bce);
     }
 
     bam_destroy1(hit);
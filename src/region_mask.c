@@ -0,0 +1,101 @@
+/*!
+  @header
+
+  Masked intervals of the reference sequences (e.g. unmappable or repetitive regions), which are excluded
+  from counting by testing the anchor position of each alignment, instead of splitting the query regions
+  into unmasked pieces.
+
+  @author:    Michael Stadler
+  @copyright: Friedrich Miescher Institute for Biomedical Research, Switzerland
+  @license: GPLv3
+ */
+
+#include "region_mask.h"
+#include <R.h>
+
+
+/*! @function
+  @abstract  index the masked intervals of a call by sequence
+  @param     mask   R_NilValue, or a list with the integer vectors "seq" (sequence identifiers, 0-based),
+                    "start" (0-based inclusive) and "end" (0-based exclusive), sorted by (seq, start) and
+                    non-overlapping
+  @param     nseq   number of sequences (seq must be smaller)
+  @return    the regionMask (release with _mask_free), or NULL if mask is R_NilValue
+ */
+regionMask *_mask_init(SEXP mask, int nseq){
+    if(mask == R_NilValue)
+        return NULL;
+
+    // check parameters
+    if(!Rf_isNewList(mask) || Rf_length(mask) != 3)
+        Rf_error("'mask' must be NULL or a list with elements 'seq', 'start' and 'end'");
+    SEXP seq = VECTOR_ELT(mask, 0), start = VECTOR_ELT(mask, 1), end = VECTOR_ELT(mask, 2);
+    if(!Rf_isInteger(seq) || !Rf_isInteger(start) || !Rf_isInteger(end) ||
+       Rf_length(start) != Rf_length(seq) || Rf_length(end) != Rf_length(seq))
+        Rf_error("'mask' elements 'seq', 'start' and 'end' must be integer vectors of equal length");
+    int i, n = Rf_length(seq);
+    const int *seq_c = INTEGER(seq), *start_c = INTEGER(start), *end_c = INTEGER(end);
+    for(i = 0; i < n; i++){
+        if(seq_c[i] < 0 || seq_c[i] >= nseq || start_c[i] < 0 || end_c[i] < start_c[i])
+            Rf_error("'mask' contains an invalid interval");
+        if(i > 0 && (seq_c[i] < seq_c[i-1] || (seq_c[i] == seq_c[i-1] && start_c[i] < end_c[i-1])))
+            Rf_error("'mask' intervals must be sorted by 'seq' and 'start' and must not overlap");
+    }
+
+    // offsets of the intervals of each sequence
+    regionMask *m = (regionMask*) R_Calloc(1, regionMask);
+    m->nseq = nseq;
+    m->offset = (int*) R_Calloc(nseq + 1, int);
+    m->start = start_c;
+    m->end = end_c;
+    for(i = 0; i < n; i++)
+        m->offset[seq_c[i] + 1]++;
+    for(i = 0; i < nseq; i++)
+        m->offset[i + 1] += m->offset[i];
+
+    return m;
+}
+
+
+/*! @function
+  @abstract  release a regionMask
+  @param     m      the regionMask (or NULL)
+ */
+void _mask_free(regionMask *m){
+    if(m == NULL)
+        return;
+    R_Free(m->offset);
+    R_Free(m);
+}
+
+
+/*! @function
+  @abstract  set a cursor to the masked intervals of a sequence, at the first interval with end > pos
+  @param     c      the cursor
+  @param     m      the regionMask
+  @param     seq    sequence identifier (sequences outside of 0 to m->nseq-1 have no masked intervals)
+  @param     pos    0-based position
+ */
+void _mask_cursor_set(maskCursor *c, const regionMask *m, int seq, int pos){
+    int lo = 0, hi, mid;
+
+    if(seq < 0 || seq >= m->nseq){
+        c->start = c->end = NULL;
+        c->n = c->cur = 0;
+        return;
+    }
+    c->start = m->start + m->offset[seq];
+    c->end = m->end + m->offset[seq];
+    c->n = m->offset[seq + 1] - m->offset[seq];
+
+    // binary search for the first interval with end > pos
+    hi = c->n;
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(c->end[mid] <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    c->cur = lo;
+}
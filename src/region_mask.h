@@ -0,0 +1,65 @@
+#ifndef QUASR_REGION_MASK_H
+#define QUASR_REGION_MASK_H
+
+#include <Rinternals.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! @typedef
+  @abstract Masked intervals of the reference sequences, sorted by (sequence, start) and non-overlapping.
+            The sequence identifiers are the ones used for the regions of the call (bam target identifiers
+            or indices into the sequence levels of the regions).
+  @field nseq     number of sequences
+  @field offset   intervals of sequence i are offset[i] to offset[i+1]-1 (nseq+1 elements)
+  @field start    interval start (0-based inclusive)
+  @field end      interval end (0-based exclusive)
+*/
+typedef struct {
+    int nseq;
+    int *offset;
+    const int *start;
+    const int *end;
+} regionMask;
+
+/*! @typedef
+  @abstract Cursor into the masked intervals of one sequence, used to test the anchor positions of a sorted
+            alignment stream. The anchor positions of consecutive alignments are close to each other, so the
+            cursor is moved from the interval of the previous test (in either direction). Each thread needs
+            its own cursor.
+  @field start    interval start of the sequence (0-based inclusive)
+  @field end      interval end of the sequence (0-based exclusive)
+  @field n        number of intervals of the sequence
+  @field cur      current interval (the first interval with end > position of the previous test, or n)
+*/
+typedef struct {
+    const int *start;
+    const int *end;
+    int n;
+    int cur;
+} maskCursor;
+
+regionMask *_mask_init(SEXP mask, int nseq);
+void _mask_free(regionMask *m);
+void _mask_cursor_set(maskCursor *c, const regionMask *m, int seq, int pos);
+
+/*! @function
+  @abstract  test if a position is masked, moving the cursor to the first interval with end > pos
+  @param  c       the cursor
+  @param  pos     0-based position
+  @return         1 if pos is in a masked interval, 0 otherwise
+ */
+static inline int _mask_cursor_test(maskCursor *c, int pos){
+    while(c->cur > 0 && c->end[c->cur - 1] > pos)
+        c->cur--;
+    while(c->cur < c->n && c->end[c->cur] <= pos)
+        c->cur++;
+    return c->cur < c->n && c->start[c->cur] <= pos;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,10 +25,12 @@ SEXP remove_unmapped_from_sam_and_convert_to_bam(SEXP inSam, SEXP outBam)
         samclose(fin);
         Rf_error("SAM/BAM header missing or empty file: '%s'", Rf_translateChar(STRING_ELT(inSam, 0)));
     }
+    _bam_attach_pool(fin);
 
     samfile_t *fout = samopen(Rf_translateChar(STRING_ELT(outBam, 0)), "wb", fin->header);
     if(fout == 0)
         Rf_error("Error in opening the output file %s", Rf_translateChar(STRING_ELT(outBam, 0)));
+    _bam_attach_pool(fout);
 
     int r, count = 0;
     bam1_t *aln = bam_init1();
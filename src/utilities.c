@@ -1,4 +1,11 @@
 #include "utilities.h"
+#include <stdlib.h>
+#include <R.h>
+#include <unistd.h>
+#include <htslib/thread_pool.h>
+
+static htsThreadPool htsPool = {NULL, 0}; // shared BGZF (de)compression thread pool (see _hts_pool_init)
+static pid_t htsPoolPid = 0;              // process that created htsPool (0 if not yet initialized)
 
 /*! @function
  @abstract  check if bam1_t *hit is a spliced alignment (gap in read >= MIN_INTRON_LENGTH).
@@ -90,9 +97,371 @@ samfile_t * _bam_tryopen(const char *filename, const char *filemode, void *aux)
         Rf_error("SAM/BAM header missing or empty\n  file: '%s'",
 		 filename);
     }
+    _bam_attach_pool(sfile);
     return sfile;
 }
 
+/*! @function
+  @abstract  Create the thread pool shared by all opened SAM/BAM files for BGZF (de)compression on
+             first use in a process, with the number of threads from option QuasR.bgzfThreads or
+             environment variable QUASR_BGZF_THREADS (e.g. for cluster nodes); no pool is created for
+             values smaller than 2. The pool lives until the package is unloaded.
+             The threads of the pool are not inherited by forked child processes (e.g. of
+             parallel::mclapply): a child drops the inherited pool and the cached bam files using it,
+             without destroying them, and creates its own pool.
+             Reads R options on the R main thread, does nothing when called from worker threads.
+ */
+void _hts_pool_init(void)
+{
+    pid_t pid;
+    int nthreads;
+    const char *env;
+
+#ifdef _OPENMP
+    if (omp_in_parallel())
+        return;
+#endif
+    pid = getpid();
+    if (htsPoolPid == pid)
+        return;
+    if (htsPool.pool != NULL) {
+        // forked child process: the threads of the pool only exist in the parent
+        htsPool.pool = NULL;
+        _bam_cache_detach();
+    }
+    htsPoolPid = pid;
+
+    nthreads = Rf_asInteger(Rf_GetOption1(Rf_install("QuasR.bgzfThreads")));
+    env = getenv("QUASR_BGZF_THREADS");
+    if (nthreads == NA_INTEGER && env != NULL)
+        nthreads = atoi(env);
+    if (nthreads == NA_INTEGER || nthreads < 2)
+        return;
+    htsPool.pool = hts_tpool_init(nthreads);
+    htsPool.qsize = 0;
+}
+
+/*! @function
+  @abstract  Destroy the shared BGZF thread pool (no files using it may be open).
+ */
+void _hts_pool_destroy(void)
+{
+    if (htsPool.pool != NULL && htsPoolPid == getpid())
+        hts_tpool_destroy(htsPool.pool);
+    htsPool.pool = NULL;
+    htsPoolPid = 0;
+}
+
+/*! @function
+  @abstract  Attach the shared BGZF thread pool (if any) to an opened SAM/BAM file, creating the pool
+             on first use (see _hts_pool_init). The pool is thread-safe and can be used by files that
+             are read concurrently by different threads.
+             Does not call the R API from worker threads and can be used there.
+  @param  sfile  the opened file (may be NULL)
+ */
+void _bam_attach_pool(samfile_t *sfile)
+{
+    _hts_pool_init();
+    if (htsPool.pool != NULL && htsPoolPid == getpid() && sfile != NULL && sfile->file != NULL)
+        hts_set_thread_pool(sfile->file, &htsPool);
+}
+
+/*! @function
+  @abstract  Get the number of threads in the shared BGZF thread pool.
+  @return    integer(1), zero if no pool is used
+ */
+SEXP hts_pool_size(void)
+{
+    _hts_pool_init();
+    return Rf_ScalarInteger(htsPool.pool != NULL ? hts_tpool_size(htsPool.pool) : 0);
+}
+
+/*! @function
+  @abstract  Get and optionally set the maximal number of slots of the position hashes used for fragment counting
+             and duplicate removal (see positionHash). Calls fail if a hash is full.
+  @param  limit   new maximal number of slots (integer(1), a power of 2 greater or equal to 2), or NULL
+  @return         previous maximal number of slots
+ */
+SEXP position_hash_limit(SEXP limit)
+{
+    int size = 0;
+
+    if (!Rf_isNull(limit)) {
+        if (!Rf_isInteger(limit) || Rf_length(limit) != 1 || INTEGER(limit)[0] == NA_INTEGER ||
+            INTEGER(limit)[0] < 2 || (INTEGER(limit)[0] & (INTEGER(limit)[0] - 1)) != 0)
+            Rf_error("'limit' must be of type integer(1) and a power of 2 greater or equal to 2");
+        size = INTEGER(limit)[0];
+    }
+
+    return Rf_ScalarInteger(_position_hash_max_size(size));
+}
+
+/*! @function
+  @abstract  Compile the alignment filter parameters of a call into an alignmentFilter.
+  @param  filter         returns the compiled filter
+  @param  readBitMask    BAM_FREAD1/BAM_FREAD2 select first/second read of a pair, BAM_FSECONDARY
+                         includes secondary alignments, REMOVE_DUPLICATES skips duplicated alignments
+  @param  mapqMin        minimal mapping quality (MAPQ >= mapqMin)
+  @param  mapqMax        maximal mapping quality (MAPQ <= mapqMax)
+  @param  absIsizeMin    minimal absolute insert size (or NO_ISIZE_FILTER)
+  @param  absIsizeMax    maximal absolute insert size (or NO_ISIZE_FILTER)
+  @param  includeSpliced also keep spliced alignments
+ */
+void _filter_init(alignmentFilter *filter, int readBitMask, int mapqMin, int mapqMax,
+                  int absIsizeMin, int absIsizeMax, int includeSpliced)
+{
+    filter->flagSkip = (readBitMask & BAM_FSECONDARY) ? 0 : BAM_FSECONDARY;
+    filter->flagRequire = 0;
+    filter->readMask = (uint16_t)(readBitMask & (BAM_FREAD1 | BAM_FREAD2));
+    filter->readSelect = (filter->readMask != (BAM_FREAD1 | BAM_FREAD2));
+    filter->mapqMin = (uint8_t)mapqMin;
+    filter->mapqMax = (uint8_t)mapqMax;
+    filter->isizeMin = (absIsizeMin == NO_ISIZE_FILTER) ? 0 : absIsizeMin;
+    filter->isizeMax = (absIsizeMax == NO_ISIZE_FILTER) ? INT64_MAX : absIsizeMax;
+    filter->isizeCheck = (absIsizeMin != NO_ISIZE_FILTER || absIsizeMax != NO_ISIZE_FILTER);
+    filter->skipSpliced = includeSpliced ? 0 : 1;
+    filter->dedup = (readBitMask & REMOVE_DUPLICATES) ? 1 : 0;
+}
+
+/*! @function
+  @abstract  Skip duplicated alignments of a sorted alignment stream. Alignments are duplicates if they
+             have the same target, 5' position, strand and mate position (and mate target); the first of
+             them in the stream is kept. An alignment is kept in dups until the stream has passed its 5'
+             position, so that dups only holds the alignments that cover the current position. If dups
+             is full, the alignment is kept and the full flag of dups is set: callers check it after
+             the stream and fail the call (see positionHash).
+  @param  dups    alignments of the current stream (reset at the start of each stream), or NULL
+  @param  hit     the alignment
+  @return         1 if the alignment is not a duplicate of a preceding alignment (or dups is NULL), 0 otherwise
+ */
+int _dedup_pass(positionHash *dups, const bam1_t *hit)
+{
+    const bam1_core_t *c = &hit->core;
+    int fivePrime;
+    uint64_t key;
+
+    if (dups == NULL)
+        return 1;
+    if (c->flag & BAM_FREVERSE)
+        fivePrime = (int)bam_calend(c, bam1_cigar(hit)) - 1;
+    else
+        fivePrime = (int)c->pos;
+    key = _position_hash_key(NULL, fivePrime, (int)c->mpos) ^
+        (_position_hash_key(NULL, c->tid, c->mtid) << 1) ^ ((c->flag & BAM_FREVERSE) ? 1 : 0);
+
+    return _position_hash_insert(dups, key, fivePrime, (int)c->pos) != 0;
+}
+
+/*! @function
+  @abstract  Translate a strand string ("+", "-" or "*") into an alignmentStrand.
+  @param  strand  the strand string
+  @return         PLUS_STRAND, MINUS_STRAND, or ANY_STRAND for any other string
+ */
+alignmentStrand _strand_from_string(const char *strand)
+{
+    if (strand[0] == '+' && strand[1] == '\0')
+        return PLUS_STRAND;
+    if (strand[0] == '-' && strand[1] == '\0')
+        return MINUS_STRAND;
+    return ANY_STRAND;
+}
+
+/*! @function
+  @abstract  Get the number of threads to use for a parallel loop.
+  @param  nthreads  requested number of threads (integer(1), greater than zero)
+  @param  nwork     number of independent work units of the loop
+  @return           number of threads (1 if compiled without OpenMP support)
+ */
+int _get_nthreads(SEXP nthreads, int nwork)
+{
+    int n = 1;
+#ifdef _OPENMP
+    n = INTEGER(nthreads)[0];
+#endif
+    if (n > nwork)
+        n = nwork;
+    if (n < 1)
+        n = 1;
+    return n;
+}
+
+/*! @function
+  @abstract  Get the number of the calling thread within a parallel region.
+  @return    thread number (0 in the master thread or if compiled without OpenMP support)
+ */
+int _thread_num(void)
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+/*! @function
+  @abstract  Open a bamfile multiple times (one handle per thread) and get its index once from the
+             bam handle cache, like _bam_open_handles(), but return NULL instead of raising an R error,
+             so that the caller can release its own resources before raising the error with
+             _bam_cache_error().
+  @param  filename  Name of the bamfile
+  @param  nhandles  number of file handles to open
+  @param  entry     returns the bam handle cache entry (holding the shared bam index)
+  @param  status    returns BAM_CACHE_OK, or the reason why the bamfile could not be opened (see
+                    _bam_cache_acquire)
+  @return           array of nhandles file handles (release with _bam_close_handles), or NULL
+ */
+samfile_t ** _bam_acquire_handles(const char *filename, int nhandles, bamCacheEntry **entry, int *status)
+{
+    *entry = _bam_cache_acquire(filename, status);
+    if (*entry == NULL)
+        return NULL;
+    samfile_t **sfiles = (samfile_t**) R_Calloc(nhandles, samfile_t*);
+    sfiles[0] = (*entry)->fin;
+    for (int i = 1; i < nhandles; ++i) {
+        sfiles[i] = samopen(filename, "rb", NULL);
+        if (sfiles[i] == 0) {
+            _bam_close_handles(sfiles, i, *entry);
+            *entry = NULL;
+            *status = BAM_CACHE_OPEN_FAILED;
+            return NULL;
+        }
+        _bam_attach_pool(sfiles[i]);
+    }
+    return sfiles;
+}
+
+/*! @function
+  @abstract  Open a bamfile multiple times (one handle per thread) and get its index once from the
+             bam handle cache. The first handle is the cached one; the index is only read by
+             bam_fetch() and can be shared by all handles.
+  @param  filename  Name of the bamfile
+  @param  nhandles  number of file handles to open
+  @param  entry     returns the bam handle cache entry (holding the shared bam index)
+  @return           array of nhandles file handles (release with _bam_close_handles)
+ */
+samfile_t ** _bam_open_handles(const char *filename, int nhandles, bamCacheEntry **entry)
+{
+    int status;
+    samfile_t **sfiles = _bam_acquire_handles(filename, nhandles, entry, &status);
+    if (sfiles == NULL)
+        _bam_cache_error(filename, status);
+    return sfiles;
+}
+
+/*! @function
+  @abstract  Close the file handles opened by _bam_open_handles and release the cache entry.
+  @param  sfiles    array of file handles
+  @param  nhandles  number of file handles
+  @param  entry     bam handle cache entry
+ */
+void _bam_close_handles(samfile_t **sfiles, int nhandles, bamCacheEntry *entry)
+{
+    for (int i = 1; i < nhandles; ++i)
+        samclose(sfiles[i]);
+    R_Free(sfiles);
+    _bam_cache_release(entry);
+}
+
+/*! @function
+  @abstract  compare two bamRegion by target and start (used by qsort).
+ */
+static int _compareBamRegions(const void *a, const void *b)
+{
+    const bamRegion *ra = (const bamRegion*)a, *rb = (const bamRegion*)b;
+    if (ra->tid != rb->tid)
+        return (ra->tid < rb->tid) ? -1 : 1;
+    if (ra->beg != rb->beg)
+        return (ra->beg < rb->beg) ? -1 : 1;
+    return 0;
+}
+
+/*! @function
+  @abstract  Process all alignments overlapping a set of regions using a single htslib multi-region
+             iterator (like bam_fetch(), but for many regions at once). The regions are sorted, and
+             overlapping or adjacent regions are coalesced, so that each alignment is passed to func
+             only once, in the order of the bam file, and the BGZF blocks shared by neighboring regions
+             are read and decompressed only once. Does not call the R API and can be used from worker
+             threads.
+  @param  fin    bam file handle (must only be used by the calling thread)
+  @param  idx    bam index
+  @param  reg    array of regions (will be sorted and coalesced in place); regions with
+                 invalid targets or empty ranges are ignored
+  @param  nreg   number of regions in reg
+  @param  data   user provided data passed to func
+  @param  func   bam_fetch() callback function
+  @return        number of alignments passed to func, or -1 if no multi-region iterator could be
+                 created (the coalesced regions are then processed by bam_fetch())
+ */
+int _bam_fetch_regions(samfile_t *fin, const bam_index_t *idx, bamRegion *reg, int nreg, void *data, bam_fetch_f func)
+{
+    int i, j, k, n = 0, nlist = 0, nhits = 0, ntargets = fin->header->n_targets;
+
+    // drop invalid regions, sort and coalesce overlapping or adjacent regions
+    for (i = 0; i < nreg; i++) {
+        if (reg[i].beg < 0)
+            reg[i].beg = 0;
+        if (reg[i].tid >= 0 && reg[i].tid < ntargets && reg[i].beg < reg[i].end)
+            reg[n++] = reg[i];
+    }
+    if (n == 0)
+        return 0;
+    qsort(reg, (size_t)n, sizeof(bamRegion), _compareBamRegions);
+    for (i = 1, j = 0; i < n; i++) {
+        if (reg[i].tid == reg[j].tid && reg[i].beg <= reg[j].end) {
+            if (reg[i].end > reg[j].end)
+                reg[j].end = reg[i].end;
+        } else {
+            reg[++j] = reg[i];
+        }
+    }
+    n = j + 1;
+    for (i = 0; i < n; i++)
+        if (i == 0 || reg[i].tid != reg[i-1].tid)
+            nlist++;
+
+    // build the region list (one element per target; owned and freed by the iterator)
+    hts_reglist_t *rlist = (hts_reglist_t*) calloc(nlist, sizeof(hts_reglist_t));
+    for (i = 0, k = -1; i < n && rlist != NULL; i++) {
+        if (k < 0 || reg[i].tid != rlist[k].tid) {
+            k++;
+            for (j = i; j < n && reg[j].tid == reg[i].tid; j++) ;
+            rlist[k].reg = fin->header->target_name[reg[i].tid];
+            rlist[k].tid = reg[i].tid;
+            rlist[k].intervals = (hts_pair_pos_t*) calloc(j - i, sizeof(hts_pair_pos_t));
+            rlist[k].count = 0;
+            rlist[k].min_beg = reg[i].beg;
+            rlist[k].max_end = reg[j-1].end;
+            if (rlist[k].intervals == NULL) {
+                hts_reglist_free(rlist, k + 1);
+                rlist = NULL;
+                break;
+            }
+        }
+        rlist[k].intervals[rlist[k].count].beg = reg[i].beg;
+        rlist[k].intervals[rlist[k].count].end = reg[i].end;
+        rlist[k].count++;
+    }
+
+    // process alignments (fall back to one bam_fetch() per coalesced region if no iterator could be created)
+    hts_itr_t *itr = (rlist != NULL ? sam_itr_regions(idx, fin->header, rlist, nlist) : NULL);
+    if (itr == NULL) {
+        if (rlist != NULL) // not taken over by the iterator
+            hts_reglist_free(rlist, nlist);
+        for (i = 0; i < n; i++)
+            bam_fetch(fin->x.bam, idx, reg[i].tid, reg[i].beg, reg[i].end, data, func);
+        return -1;
+    }
+    bam1_t *b = bam_init1();
+    while (sam_itr_next(fin->file, itr, b) >= 0) {
+        func(b, data);
+        nhits++;
+    }
+    bam_destroy1(b);
+    hts_itr_multi_destroy(itr);
+
+    return nhits;
+}
+
 /*! @function
   @abstract  Get the pointer of a named list element.
   @param  list  List/data.fram object
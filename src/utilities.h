@@ -1,12 +1,127 @@
+#ifndef QUASR_UTILITIES_H
+#define QUASR_UTILITIES_H
+
 #include <stdio.h>
 #include <math.h>
 #include <Rinternals.h>
 #include <samtools-1.7-compat.h>
+#include "bam_cache.h"
+#include "position_hash.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define MIN_INTRON_LENGTH 60 // minimum length of an insertion for the alignment to be "spliced"
+#define NO_ISIZE_FILTER -1   // disabled insert size-based alignment filtering
+#define REMOVE_DUPLICATES 0x10000 // readBitMask bit: skip duplicated alignments (see _dedup_pass)
+
+/*! @typedef
+  @abstract Strand selection of alignments (values are the strand characters used in region vectors).
+*/
+typedef enum {
+    ANY_STRAND = '*',
+    PLUS_STRAND = '+',
+    MINUS_STRAND = '-'
+} alignmentStrand;
+
+/*! @typedef
+  @abstract Region-independent alignment filter, compiled once per call by _filter_init() into
+            flag masks and range comparisons, and applied to each alignment by _filter_pass().
+  @field flagSkip     skip alignments with any of these flags set (e.g. BAM_FSECONDARY)
+  @field flagRequire  skip alignments without all of these flags set (e.g. BAM_FPROPER_PAIR)
+  @field readMask     BAM_FREAD1 and/or BAM_FREAD2: selected reads of paired-end alignments
+  @field readSelect   skip alignments with BAM_FREAD1 or BAM_FREAD2 set, but none of readMask
+  @field mapqMin      minimum mapping quality (MAPQ >= mapqMin)
+  @field mapqMax      maximum mapping quality (MAPQ <= mapqMax)
+  @field isizeMin     minimum absolute insert size (abs(ISIZE) >= isizeMin, 0 if disabled)
+  @field isizeMax     maximum absolute insert size (abs(ISIZE) <= isizeMax, INT64_MAX if disabled)
+  @field isizeCheck   at least one of the insert size bounds is enabled
+  @field skipSpliced  skip spliced alignments (see _isSpliced)
+  @field dedup        skip duplicated alignments (applied by the callbacks with _dedup_pass)
+*/
+typedef struct {
+    uint16_t flagSkip;
+    uint16_t flagRequire;
+    uint16_t readMask;
+    int readSelect;
+    uint8_t mapqMin;
+    uint8_t mapqMax;
+    int64_t isizeMin;
+    int64_t isizeMax;
+    int isizeCheck;
+    int skipSpliced;
+    int dedup;
+} alignmentFilter;
+
+/*! @typedef
+  @abstract Region to be processed by _bam_fetch_regions().
+  @field tid    target identifier
+  @field beg    0-based inclusive start
+  @field end    0-based exclusive end
+*/
+typedef struct {
+    int tid;
+    int beg;
+    int end;
+} bamRegion;
 
 int _isSpliced(const bam1_t *hit);
 void _reverse(char *buf, int len);
 void _complement(char *buf, int len);
 samfile_t * _bam_tryopen(const char *filename, const char *filemode, void *aux);
 SEXP _getListElement(SEXP list, const char *str);
+int _get_nthreads(SEXP nthreads, int nwork);
+int _thread_num(void);
+samfile_t ** _bam_acquire_handles(const char *filename, int nhandles, bamCacheEntry **entry, int *status);
+samfile_t ** _bam_open_handles(const char *filename, int nhandles, bamCacheEntry **entry);
+void _bam_close_handles(samfile_t **sfiles, int nhandles, bamCacheEntry *entry);
+int _bam_fetch_regions(samfile_t *fin, const bam_index_t *idx, bamRegion *reg, int nreg, void *data, bam_fetch_f func);
+void _hts_pool_init(void);
+void _hts_pool_destroy(void);
+void _bam_attach_pool(samfile_t *sfile);
+SEXP hts_pool_size(void);
+SEXP position_hash_limit(SEXP limit);
+void _filter_init(alignmentFilter *filter, int readBitMask, int mapqMin, int mapqMax,
+                  int absIsizeMin, int absIsizeMax, int includeSpliced);
+alignmentStrand _strand_from_string(const char *strand);
+int _dedup_pass(positionHash *dups, const bam1_t *hit);
+
+/*! @function
+  @abstract  apply a compiled alignment filter (cheap flag and range tests first, spliced test last)
+  @param  filter  the compiled filter
+  @param  hit     the alignment
+  @return         1 if the alignment passes the filter, 0 otherwise
+ */
+static inline int _filter_pass(const alignmentFilter *filter, const bam1_t *hit)
+{
+    uint16_t flag = hit->core.flag;
+    int64_t isize;
+
+    if ((flag & filter->flagSkip) || (flag & filter->flagRequire) != filter->flagRequire)
+        return 0;
+    if (filter->readSelect && (flag & (BAM_FREAD1 | BAM_FREAD2)) && (flag & filter->readMask) == 0)
+        return 0;
+    if (hit->core.qual < filter->mapqMin || hit->core.qual > filter->mapqMax)
+        return 0;
+    if (filter->isizeCheck) {
+        isize = (hit->core.isize < 0) ? -(int64_t)hit->core.isize : (int64_t)hit->core.isize;
+        if (isize < filter->isizeMin || isize > filter->isizeMax)
+            return 0;
+    }
+    if (filter->skipSpliced && _isSpliced(hit))
+        return 0;
+    return 1;
+}
+
+/*! @function
+  @abstract  test if an alignment is on a selected strand
+  @param  strand  selected strand (ANY_STRAND selects all alignments)
+  @param  hit     the alignment
+  @return         1 if the alignment is on the selected strand, 0 otherwise
+ */
+static inline int _strand_pass(alignmentStrand strand, const bam1_t *hit)
+{
+    return strand == ANY_STRAND || ((hit->core.flag & BAM_FREVERSE) == 0) == (strand == PLUS_STRAND);
+}
+
+#endif